@@ -23,8 +23,10 @@
 #include <QLineEdit>
 #include <QJsonObject>
 #include <QMainWindow>
-#include <QStandardItemModel>
 
+#include "model.h"
+#include "history.h"
+#include "shard.h"
 #include "tunnel.h"
 #include "liturgy.h"
 
@@ -45,18 +47,35 @@ public:
 
 	void peer_set_state(u_int8_t, int) override;
 	void message_show(const char *, u_int64_t, Qt::GlobalColor) override;
+	void message_text(u_int8_t, u_int64_t, Qt::GlobalColor,
+	    const u_int8_t *, size_t) override;
+
+	void history_restore(const struct litany_history_msg *);
+	void search_result(const struct litany_history_msg *);
 
 private slots:
 	void create_message(void);
+	void rows_added(void);
 
 private:
+	void stats_show(void);
+	void search_show(const QString &);
+	TunnelShard *shard_get(u_int8_t);
+
 	/* What chat mode are we in, direct or group? */
 	int				chat_mode;
 
 	/* GUI stuff. */
 	QListView			*view;
 	QLineEdit			*input;
-	QStandardItemModel		*model;
+	ChatModel			*model;
+
+	/* Set when a message should alert the user on the next frame. */
+	bool				alert;
+
+	/* The persistent history, NULL if disabled. */
+	ChatHistory			*history;
+	size_t				search_hits;
 
 	/* Our own id in the flock (kek-id). */
 	QString				kek_id;
@@ -67,8 +86,16 @@ private:
 	/* The discovery liturgy. */
 	Liturgy				*discovery;
 
-	/* A tunnel per participant. */
-	Tunnel				*tunnels[KYRKA_PEERS_PER_FLOCK];
+	/*
+	 * The shards running our tunnels, a peer always lives on
+	 * shard (peer_id % shard_count). Shards start when they get
+	 * their first tunnel.
+	 */
+	size_t				shard_count;
+	TunnelShard			*shards[LITANY_SHARDS_MAX];
+
+	/* The peers we currently have a tunnel for. */
+	bool				peers[KYRKA_PEERS_PER_FLOCK];
 };
 
 #endif
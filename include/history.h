@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __H_LITANY_HISTORY_H
+#define __H_LITANY_HISTORY_H
+
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <QLockFile>
+#include <QJsonObject>
+#include <QWaitCondition>
+
+#include "util.h"
+#include "index.h"
+#include "model.h"
+
+/* A log segment is closed once it grows beyond this size. */
+#define LITANY_HISTORY_SEGMENT_MAX	(16 * 1024 * 1024)
+
+/* The number of messages we restore when a chat window opens. */
+#define LITANY_HISTORY_RESTORE		1000
+
+/* The maximum number of results for a search. */
+#define LITANY_HISTORY_SEARCH_MAX	50
+
+/* The key, nonce and tag sizes for our records. */
+#define LITANY_HISTORY_KEY_LEN		32
+#define LITANY_HISTORY_NONCE_LEN	24
+#define LITANY_HISTORY_TAG_LEN		16
+
+/*
+ * A record in a log segment:
+ *	be32 length | nonce | ciphertext (length bytes, including tag)
+ *
+ * The plaintext is a struct litany_history_rec followed by the text.
+ * The segment number and offset of the record are authenticated as
+ * additional data, so records cannot be moved around.
+ */
+struct litany_history_rec {
+	u_int64_t		id;
+	u_int64_t		time;
+	u_int8_t		color;
+} __attribute__((packed));
+
+/* The largest ciphertext we accept in a record. */
+#define LITANY_HISTORY_RECORD_MAX	\
+    (sizeof(struct litany_history_rec) + LITANY_MESSAGE_LONG_MAX + \
+    64 + LITANY_HISTORY_TAG_LEN)
+
+/*
+ * A message read back from the history.
+ */
+struct litany_history_msg {
+	u_int64_t		id;
+	u_int64_t		time;
+	Qt::GlobalColor		color;
+	const char		*text;
+	size_t			len;
+};
+
+/*
+ * A read-only view of the log and index of a segment.
+ */
+struct litany_history_view {
+	u_int64_t		segment;
+	QFile			log;
+	QFile			idx;
+	const u_int8_t		*lmap;
+	const u_int8_t		*xmap;
+	u_int64_t		lsize;
+	size_t			count;
+};
+
+/*
+ * A message waiting for the writer.
+ */
+struct litany_history_pending {
+	struct litany_history_rec	rec;
+	size_t				len;
+	char				text[];
+};
+
+/*
+ * The persistent history of a single chat or group.
+ *
+ * Messages are appended to encrypted log segments in the history
+ * directory of the chat, next to each segment is an index holding the
+ * big endian offset of every record in it. The index lets us find the
+ * last N messages without reading the log from the start.
+ *
+ * Appending only queues the message, a writer thread encrypts and
+ * writes everything that was queued and then syncs the log followed
+ * by the index (group commit). The index is only written once the
+ * log records it points to are on disk, so after a crash we only need
+ * to look at records past the last indexed one and cut off anything
+ * that does not authenticate.
+ *
+ * Messages can be searched for through a trigram index per segment
+ * (see HistoryIndex), the writer keeps the index for the segment it
+ * writes to up to date and seals it when the segment is closed.
+ *
+ * A chat that is open in another process has its history locked, in
+ * which case we do not persist anything.
+ */
+class ChatHistory {
+public:
+	ChatHistory(QJsonObject *, const QString &);
+	~ChatHistory(void);
+
+	bool active(void);
+	void append(u_int64_t, Qt::GlobalColor, const char *);
+	void append_text(u_int8_t, u_int64_t, Qt::GlobalColor,
+	    const u_int8_t *, size_t);
+	void tail(size_t, void (*)(const struct litany_history_msg *,
+	    void *), void *);
+	bool search(const char *, size_t,
+	    void (*)(const struct litany_history_msg *, void *), void *);
+	void stats(char *, size_t);
+
+private:
+	void writer_run(void);
+	void pending_queue(u_int64_t, Qt::GlobalColor,
+	    const char *, size_t, const void *, size_t);
+	void index_build(void);
+	void segment_index(u_int64_t, HistoryIndex *);
+	void segment_open(u_int64_t);
+	void segment_recover(void);
+	void segment_write(struct litany_history_pending *);
+	void segment_commit(void);
+
+	bool record_open(u_int64_t, u_int64_t, const u_int8_t *, size_t,
+	    u_int8_t *, size_t *);
+	size_t segment_tail(u_int64_t, size_t,
+	    QList<struct litany_history_msg> &, QList<u_int8_t *> &);
+	size_t segment_search(u_int64_t, const u_int16_t *, size_t,
+	    const char *, size_t, size_t,
+	    QList<struct litany_history_msg> &, QList<u_int8_t *> &);
+
+	bool view_open(u_int64_t, struct litany_history_view *);
+	void view_close(struct litany_history_view *);
+	u_int8_t *view_record(struct litany_history_view *, size_t,
+	    struct litany_history_msg *);
+
+	QString segment_path(u_int64_t, const char *);
+
+	/* The directory of this history and its lock. */
+	QString				path;
+	QLockFile			*lock;
+	bool				locked;
+
+	/* True if the directory of this history could not be created. */
+	bool				nodir;
+
+	/* The key for our records and the one for our trigram index. */
+	u_int8_t			key[LITANY_HISTORY_KEY_LEN];
+	u_int8_t			index_key[LITANY_INDEX_KEY_LEN];
+
+	/* The trigram index for the current segment. */
+	HistoryIndex			*index;
+
+	/* The current segment, its log and index, owned by the writer. */
+	u_int64_t			segment;
+	QFile				log;
+	QFile				idx;
+	u_int64_t			log_size;
+	u_int32_t			records;
+	QList<u_int64_t>		idx_pending;
+
+	/* The writer thread and its queue. */
+	QThread				*writer;
+	QMutex				mtx;
+	QWaitCondition			cond;
+	bool				quit;
+	QList<struct litany_history_pending *>	queue;
+
+	/* Statistics, updated under mtx. */
+	u_int64_t			written;
+	u_int64_t			commits;
+	u_int64_t			recovered;
+	u_int64_t			truncated;
+};
+
+#endif
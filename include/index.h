@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __H_LITANY_INDEX_H
+#define __H_LITANY_INDEX_H
+
+#include <QList>
+#include <QMutex>
+#include <QString>
+
+#include "util.h"
+
+/* The number of buckets trigrams are hashed into. */
+#define LITANY_INDEX_BUCKETS		65536
+
+/* The number of postings we keep in memory before sealing. */
+#define LITANY_INDEX_LIVE_MAX		(1024 * 1024)
+
+/* The key for hashing trigrams into buckets. */
+#define LITANY_INDEX_KEY_LEN		16
+
+/* The maximum number of distinct buckets in a query. */
+#define LITANY_INDEX_QUERY_MAX		64
+
+/*
+ * A trigram index over the records of history segments.
+ *
+ * Each lowercased trigram of a message is hashed with a keyed hash
+ * into one of LITANY_INDEX_BUCKETS buckets, each bucket holds the
+ * ascending record numbers (the position in the segment its index)
+ * of the messages that contain a trigram hashing into it.
+ *
+ * The postings for the segment being written are kept in memory and
+ * updated as records are written. Once the segment is closed they are
+ * sealed into its .tix file:
+ *	be32 offsets[LITANY_INDEX_BUCKETS + 1] | be32 postings
+ *
+ * A lookup returns candidates only, the caller verifies those against
+ * the decrypted record, so a collision in a bucket or a damaged .tix
+ * file never results in a wrong match.
+ */
+class HistoryIndex {
+public:
+	HistoryIndex(const u_int8_t *);
+	~HistoryIndex(void);
+
+	bool full(void);
+	void reset(u_int64_t, bool);
+	void ready(u_int64_t);
+	void seal(const QString &, u_int64_t);
+	void add(u_int32_t, const char *, size_t);
+	void stats(char *, size_t);
+
+	size_t grams(const char *, size_t, u_int16_t *, size_t);
+	bool lookup(u_int64_t, const u_int16_t *, size_t,
+	    QList<u_int32_t> &);
+
+	static bool lookup_file(const QString &, const u_int16_t *, size_t,
+	    QList<u_int32_t> &);
+	static bool match(const char *, size_t, const char *, size_t);
+
+private:
+	u_int16_t bucket(const u_int8_t *);
+	static void intersect(QList<u_int32_t> &, const QList<u_int32_t> &);
+
+	/* Protects everything below, the writer and searches share us. */
+	QMutex				mtx;
+
+	/* The keyed hash key. */
+	u_int8_t			key[LITANY_INDEX_KEY_LEN];
+
+	/* The segment the live postings are for and if they are complete. */
+	u_int64_t			segment;
+	bool				complete;
+
+	/* The live postings. */
+	QList<u_int32_t>		*live;
+	u_int64_t			postings;
+
+	/* How many segments we sealed. */
+	u_int64_t			sealed;
+};
+
+#endif
@@ -29,7 +29,10 @@
 #include "util.h"
 #include "chat.h"
 #include "litany.h"
+#include "wheel.h"
+#include "socket.h"
 #include "tunnel.h"
+#include "shard.h"
 #include "liturgy.h"
 #include "peer.h"
 #include "group.h"
@@ -37,6 +40,7 @@
 
 /* src/main.cc */
 extern QApplication	*app;
+extern thread_local TimerWheel	*wheel;
 
 char		*litany_json_string(QJsonObject *, const char *);
 u_int64_t	litany_json_number(QJsonObject *, const char *, u_int64_t);
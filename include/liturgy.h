@@ -17,13 +17,18 @@
 #ifndef __H_LITANY_LITURGY_H
 #define __H_LITANY_LITURGY_H
 
-#include <QTimer>
-#include <QObject>
-#include <QUdpSocket>
+#include <QJsonObject>
 #include <QHostAddress>
 
 #include <libkyrka/libkyrka.h>
 
+#include "socket.h"
+#include "wheel.h"
+#include "worker.h"
+
+/* The interval (in milliseconds) at which we send our liturgy. */
+#define LITURGY_NOTIFY_INTERVAL		2500
+
 /*
  * The interface objects wanting to use liturgies must adhere too.
  */
@@ -42,32 +47,40 @@ public:
 #define LITURGY_MODE_DISCOVERY		1
 #define LITURGY_MODE_SIGNAL		2
 
-class Liturgy: public QObject {
-	Q_OBJECT
-
+/*
+ * A liturgy runs on its own worker thread so its socket is always
+ * read in time, the peer states it learns about are handed to its
+ * owner on the GUI thread as events.
+ */
+class Liturgy: public LitanyWorker, public SocketInterface {
 public:
 	Liturgy(LiturgyInterface *, QJsonObject *, int, u_int16_t);
 	~Liturgy(void);
 
 	void signaling_state(u_int8_t, int);
 	void socket_send(const void *, size_t);
+	void stats(char *, size_t);
+
+	void liturgy_send(void);
+
+	void event_dispatch(struct litany_event *) override;
+	int packet_read(const void *, size_t, bool) override;
 
 	LiturgyInterface	*owner;
 	int			runmode;
 
-private slots:
-	void packet_read(void);
-	void liturgy_send(void);
-
 private:
+	void setup(QJsonObject *, u_int16_t);
+
+	/* The following are only accessed from our thread. */
 	u_int8_t	signaling[KYRKA_PEERS_PER_FLOCK];
 
-	quint16		port;
-	QUdpSocket	socket;
-	QHostAddress	address;
+	quint16			port;
+	LitanySocket		*socket;
+	QHostAddress		address;
 
-	QTimer		notify;
-	KYRKA		*kyrka;
+	struct litany_timer	notify;
+	KYRKA			*kyrka;
 };
 
 #endif
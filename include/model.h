@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __H_LITANY_MODEL_H
+#define __H_LITANY_MODEL_H
+
+#include <QSet>
+#include <QList>
+#include <QTimer>
+#include <QObject>
+#include <QVariant>
+#include <QElapsedTimer>
+#include <QAbstractListModel>
+
+#include "util.h"
+
+/* The default and maximum number of messages a chat window keeps. */
+#define LITANY_CHAT_HISTORY_DEFAULT	10000
+#define LITANY_CHAT_HISTORY_MAX		1000000
+
+/* We add new messages to the model at most once per frame (in ms). */
+#define LITANY_CHAT_FRAME_MS		16
+
+/* The entry is text from a peer, shown with a "<peer> " prefix. */
+#define LITANY_CHAT_ENTRY_PEER		(1 << 0)
+
+/* The length of that prefix. */
+#define LITANY_CHAT_PREFIX_LEN		5
+
+/*
+ * A single message in the model, its utf8 text follows it directly.
+ */
+struct litany_chat_entry {
+	u_int64_t		id;
+	u_int32_t		len;
+	u_int8_t		color;
+	u_int8_t		flags;
+	u_int8_t		peer;
+	char			text[];
+};
+
+/*
+ * The model behind a chat window.
+ *
+ * Messages live in a ring of at most cap entries, once it is full the
+ * oldest messages are dropped. Each entry is a single allocation of
+ * its header and utf8 text, the QString for the view is only built
+ * when the view asks for it in data(). Text from our peers is stored
+ * as it arrived together with the peer id, its "<peer> " prefix is
+ * only added in data() as well.
+ *
+ * New messages are collected and added to the model in one go, at
+ * most once per frame, so a burst of messages results in a single
+ * rowsRemoved() and rowsInserted() pair. A message arriving after a
+ * quiet period is added as soon as we return to the event loop. The
+ * time each frame takes, including the view reacting to it, is kept
+ * for our statistics.
+ *
+ * The ids of all messages in the model (or about to be) are kept in
+ * a hash set so duplicate checks do not depend on the history size.
+ */
+class ChatModel: public QAbstractListModel {
+	Q_OBJECT
+
+public:
+	ChatModel(QObject *, size_t);
+	~ChatModel(void);
+
+	bool append(const char *, u_int64_t, Qt::GlobalColor);
+	bool append_text(u_int8_t, u_int64_t, Qt::GlobalColor,
+	    const u_int8_t *, size_t);
+	void stats(char *, size_t);
+
+	static void prefix(u_int8_t, char *);
+
+	int rowCount(const QModelIndex &) const override;
+	QVariant data(const QModelIndex &, int) const override;
+
+private slots:
+	void flush(void);
+
+private:
+	struct litany_chat_entry *entry(size_t) const;
+	bool entry_queue(u_int64_t, Qt::GlobalColor, u_int8_t, u_int8_t,
+	    const void *, size_t);
+	void entry_free(struct litany_chat_entry *);
+
+	/* The ring of entries, head is the oldest. */
+	size_t				cap;
+	size_t				head;
+	size_t				count;
+	struct litany_chat_entry	**ring;
+
+	/* Entries waiting to be added on the next flush. */
+	QList<struct litany_chat_entry *>	pending;
+	QTimer				timer;
+
+	/* Time since the last frame and our frame statistics. */
+	QElapsedTimer			last;
+	u_int64_t			frames;
+	u_int64_t			frame_rows;
+	u_int64_t			frame_ns;
+	u_int64_t			frame_ns_max;
+
+	/* The ids of the entries in the ring and pending list. */
+	QSet<u_int64_t>			seen;
+
+	/* The bytes of text we hold and how many entries we dropped. */
+	u_int64_t			bytes;
+	u_int64_t			evicted;
+};
+
+#endif
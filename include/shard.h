@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __H_LITANY_SHARD_H
+#define __H_LITANY_SHARD_H
+
+#include <QList>
+#include <QJsonObject>
+
+#include "tunnel.h"
+#include "worker.h"
+
+/* The maximum number of tunnel shards a chat runs. */
+#define LITANY_SHARDS_MAX		8
+
+/*
+ * A worker thread running a subset of the tunnels in a chat.
+ *
+ * Besides its own event loop and timer wheel each shard in group mode
+ * has its own socket shared by the tunnels on it, so the crypto and
+ * keying for those tunnels never runs on the GUI thread.
+ *
+ * The tunnels on a shard are only ever touched from its thread, the
+ * GUI thread talks to them by posting work to the shard. Messages
+ * coming out of the tunnels travel to the owner of the shard on the
+ * GUI thread as events.
+ */
+class TunnelShard final: public LitanyWorker, public TunnelInterface {
+public:
+	TunnelShard(TunnelInterface *, QJsonObject *, int, bool);
+	~TunnelShard(void);
+
+	void tunnel_create(u_int8_t);
+	void tunnel_remove(u_int8_t);
+
+	void stats_show(void);
+	void file_send(XferSource *);
+	void file_answer(u_int8_t, bool);
+	void send_text(struct litany_msg_body **, size_t);
+
+	void event_dispatch(struct litany_event *) override;
+	void message_show(const char *, u_int64_t, Qt::GlobalColor) override;
+	void message_text(u_int8_t, u_int64_t, Qt::GlobalColor,
+	    const u_int8_t *, size_t) override;
+
+private:
+	/* The interface on the GUI thread we deliver messages too. */
+	TunnelInterface		*owner;
+
+	/* Our copy of the configuration, only read from our thread. */
+	QJsonObject		config;
+
+	/* Our index and if we run group tunnels over a shared socket. */
+	int			index;
+	bool			group;
+
+	/* The following are only accessed from our thread. */
+	LitanySocket		*mux;
+	Tunnel			*tunnels[KYRKA_PEERS_PER_FLOCK];
+	QList<Tunnel *>		active;
+};
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __H_LITANY_SOCKET_H
+#define __H_LITANY_SOCKET_H
+
+#include <QHash>
+#include <QList>
+#include <QTimer>
+#include <QObject>
+#include <QUdpSocket>
+#include <QHostAddress>
+
+#if defined(__linux__)
+#include <QSocketNotifier>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <linux/io_uring.h>
+#endif
+
+#include "util.h"
+
+/* The maximum size of a single datagram we will read or write. */
+#define LITANY_SOCKET_PACKET_MAX	1500
+
+/* The maximum number of datagrams we read or write per syscall. */
+#define LITANY_SOCKET_BATCH		32
+
+/* The time in milliseconds before we retry when the socket is full. */
+#define LITANY_SOCKET_TX_RETRY		1
+
+/* The number of buckets in our batch histograms. */
+#define LITANY_SOCKET_BUCKETS		6
+
+/*
+ * The I/O backends a socket can use, picked at runtime via the
+ * LITANY_IO environment variable (qt, mmsg, epoll or uring). Outside
+ * of Linux only the Qt backend exists.
+ */
+#define LITANY_SOCKET_BACKEND_QT	1
+#define LITANY_SOCKET_BACKEND_MMSG	2
+#define LITANY_SOCKET_BACKEND_EPOLL	3
+#define LITANY_SOCKET_BACKEND_URING	4
+
+/* The maximum number of ready sockets we handle per epoll_wait(). */
+#define LITANY_SOCKET_POLL_EVENTS	64
+
+/*
+ * The sizes of the io_uring submission and completion queues shared
+ * by all sockets on a thread, and the number of receive buffers each
+ * socket hands to the kernel (must be a power of two). A receive
+ * buffer holds the recvmsg header, the source address and a datagram.
+ */
+#define LITANY_SOCKET_URING_SQ		64
+#define LITANY_SOCKET_URING_CQ		4096
+#define LITANY_SOCKET_URING_BUFS	64
+#define LITANY_SOCKET_URING_BUF_SIZE					\
+    (sizeof(struct io_uring_recvmsg_out) +				\
+    sizeof(struct sockaddr_in) + LITANY_SOCKET_PACKET_MAX)
+
+/*
+ * The interface objects wanting to receive datagrams from
+ * a LitanySocket must adhere too.
+ *
+ * The broadcast flag is set when the datagram could not be routed and
+ * every endpoint gets a copy, an endpoint that cannot use it returns
+ * -1 and the datagram is dropped instead of being treated as fatal.
+ */
+class SocketInterface {
+public:
+	virtual int packet_read(const void *, size_t, bool);
+};
+
+/*
+ * A udp socket that hands its datagrams to the endpoints attached to it.
+ *
+ * A single socket can be shared by many endpoints, such as the tunnels
+ * of a group chat that run on the same shard, so a group chat has one
+ * socket per shard (see TunnelShard). Inbound datagrams are routed to
+ * the endpoint that registered the SPI found in the packet header, or
+ * otherwise to the endpoint that registered the source ip:port of the
+ * packet. Anything we cannot route (cathedral traffic, key offers)
+ * goes to all endpoints and libkyrka sorts out which context it
+ * belongs too.
+ *
+ * On Linux we bypass QUdpSocket by default and drain the socket with
+ * recvmmsg() into a preallocated ring of buffers each time it becomes
+ * readable. Outgoing datagrams are queued and written with a single
+ * sendmmsg() once the current event loop iteration is done, or when
+ * the queue fills up. With the mmsg backend each socket has its own
+ * QSocketNotifier, with the epoll backend all sockets on a thread
+ * share a single epoll instance (see SocketPoller) and that is the
+ * only thing the event loop watches.
+ *
+ * The uring backend shares a single io_uring instance per thread
+ * instead (see SocketRing), each socket keeps a multishot recvmsg
+ * armed on it that fills buffers registered with the kernel, and
+ * our queued datagrams are submitted to it in one go. It falls back
+ * to the epoll backend if the kernel cannot do this.
+ *
+ * The Qt backend uses QUdpSocket and reads or writes one datagram at
+ * a time, it is the only backend on other platforms.
+ */
+class LitanySocket: public QObject {
+	Q_OBJECT
+
+	friend class SocketPoller;
+	friend class SocketRing;
+
+public:
+	LitanySocket(void);
+	~LitanySocket(void);
+
+	void attach(SocketInterface *);
+	void detach(SocketInterface *);
+
+	void route_spi(SocketInterface *, u_int32_t);
+	void route_peer(SocketInterface *, u_int32_t, u_int16_t);
+
+	void send(const void *, size_t, const QHostAddress &, quint16);
+	void stats(char *, size_t);
+
+private slots:
+	void packet_read(void);
+	void packet_flush(void);
+
+private:
+	void batch_record(u_int64_t *, size_t);
+	void dispatch(const void *, size_t, u_int32_t, u_int16_t);
+
+	/* The backend this socket uses. */
+	int			backend;
+
+	/* The endpoints attached to us. */
+	QList<SocketInterface *>		endpoints;
+
+	/* Routes by SPI and by peer ip:port to endpoints. */
+	QHash<u_int32_t, SocketInterface *>	spis;
+	QHash<u_int64_t, SocketInterface *>	peers;
+
+	/* The last SPI and peer route each endpoint registered. */
+	QHash<SocketInterface *, u_int32_t>	spi_last;
+	QHash<SocketInterface *, u_int64_t>	peer_last;
+
+	/* How inbound datagrams were routed. */
+	u_int64_t		rx_by_spi;
+	u_int64_t		rx_by_peer;
+	u_int64_t		rx_by_all;
+	u_int64_t		rx_by_all_drops;
+
+	/*
+	 * Statistics, the batch histograms count syscalls by number of
+	 * datagrams read or written: 1, 2-3, 4-7, 8-15, 16-31, 32.
+	 */
+	u_int64_t		rx_packets;
+	u_int64_t		rx_wakeups;
+	u_int64_t		rx_batches[LITANY_SOCKET_BUCKETS];
+
+	u_int64_t		tx_drops;
+	u_int64_t		tx_packets;
+	u_int64_t		tx_flushes;
+	u_int64_t		tx_batches[LITANY_SOCKET_BUCKETS];
+
+	/* Used by the Qt backend. */
+	QUdpSocket		socket;
+
+#if defined(__linux__)
+	int			fd;
+	QSocketNotifier		*notifier;
+
+	/* The receive ring, allocated once. */
+	u_int8_t		*ring;
+	struct iovec		rx_iov[LITANY_SOCKET_BATCH];
+	struct mmsghdr		rx_hdr[LITANY_SOCKET_BATCH];
+	struct sockaddr_in	rx_addr[LITANY_SOCKET_BATCH];
+
+	/*
+	 * Used by the uring backend, the receive ring holds the buffers
+	 * registered under our buffer group and the rx_batch datagrams
+	 * we read since our last wakeup.
+	 */
+	bool			rx_armed;
+	size_t			rx_batch;
+	u_int16_t		rx_bgid;
+	u_int16_t		rx_tail;
+	struct msghdr		rx_msg;
+	struct io_uring_buf	*rx_bufs;
+
+	/*
+	 * The transmit queue, flushed from a zero timer or from a short
+	 * one while the socket buffer is full.
+	 */
+	QTimer			tx_timer;
+	u_int8_t		*tx_ring;
+	size_t			tx_count;
+	struct iovec		tx_iov[LITANY_SOCKET_BATCH];
+	struct mmsghdr		tx_hdr[LITANY_SOCKET_BATCH];
+	struct sockaddr_in	tx_addr[LITANY_SOCKET_BATCH];
+#endif
+};
+
+#if defined(__linux__)
+/*
+ * The epoll instance shared by all sockets on a thread that use the
+ * epoll backend. When it becomes readable we ask it which sockets
+ * are ready and let each of those drain itself.
+ */
+class SocketPoller {
+public:
+	SocketPoller(void);
+	~SocketPoller(void);
+
+	void add(LitanySocket *);
+	void remove(LitanySocket *);
+	void run(void);
+
+	/* The number of sockets on this poller. */
+	size_t			refs;
+
+private:
+	int			efd;
+	QSocketNotifier		*notifier;
+	struct epoll_event	events[LITANY_SOCKET_POLL_EVENTS];
+};
+
+/*
+ * A completion taken off the io_uring completion queue.
+ */
+struct socket_cqe {
+	u_int64_t	user_data;
+	int32_t		res;
+	u_int32_t	flags;
+};
+
+/*
+ * The io_uring instance shared by all sockets on a thread that use
+ * the uring backend. We talk to the kernel with the raw syscalls and
+ * map its queues ourselves. Completions are signalled on an eventfd
+ * which is the only thing the event loop watches.
+ *
+ * Sends are reaped right away by whoever submitted them, receive
+ * completions seen while doing so are set aside on the backlog and
+ * handled before anything else on the completion queue.
+ */
+class SocketRing {
+public:
+	SocketRing(void);
+	~SocketRing(void);
+
+	static bool supported(void);
+
+	void add(LitanySocket *);
+	void remove(LitanySocket *);
+	void send(LitanySocket *, bool *);
+	void run(void);
+
+	/* The number of sockets on this ring. */
+	size_t			refs;
+
+private:
+	void arm(LitanySocket *);
+	void recv(LitanySocket *, const struct socket_cqe *);
+	void buffer_add(LitanySocket *, u_int16_t);
+
+	struct io_uring_sqe *sqe_get(void);
+	void enter(u_int32_t);
+	bool reap(struct socket_cqe *);
+	bool next(struct socket_cqe *);
+	void events_disable(bool);
+
+	int			fd;
+	int			evfd;
+	QSocketNotifier		*notifier;
+
+	/* The sockets on this ring and their buffer groups. */
+	QList<LitanySocket *>	sockets;
+	QList<u_int16_t>	bgid_free;
+	u_int16_t		bgid_next;
+
+	/* Receive completions set aside while reaping sends. */
+	QList<struct socket_cqe>	backlog;
+
+	/* The mapped submission queue. */
+	u_int8_t		*sq_map;
+	size_t			sq_len;
+	u_int32_t		sq_mask;
+	u_int32_t		sq_entries;
+	u_int32_t		sq_local;
+	u_int32_t		*sq_head;
+	u_int32_t		*sq_tail;
+	u_int32_t		*sq_flags;
+	u_int32_t		*sq_array;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_len;
+
+	/* The mapped completion queue. */
+	u_int8_t		*cq_map;
+	size_t			cq_len;
+	u_int32_t		cq_mask;
+	u_int32_t		*cq_head;
+	u_int32_t		*cq_tail;
+	u_int32_t		*cq_flags;
+	struct io_uring_cqe	*cqes;
+};
+#endif
+
+#endif
@@ -19,12 +19,69 @@
 
 #include <QTimer>
 #include <QObject>
-#include <QUdpSocket>
 #include <QHostAddress>
 
 #include <libkyrka/libkyrka.h>
 
 #include "util.h"
+#include "wheel.h"
+#include "socket.h"
+#include "xfer.h"
+
+/* The intervals (in milliseconds) at which our timers fire. */
+#define TUNNEL_KEYS_INTERVAL		500
+#define TUNNEL_NOTIFY_INTERVAL		5000
+#define TUNNEL_HEARTBEAT_INTERVAL	1000
+
+/*
+ * The heartbeat interval backs off to this on idle tunnels, this must
+ * stay well below TUNNEL_OFFLINE_TIMEOUT so that a few lost heartbeats
+ * do not cause our peer to consider us offline, and below common NAT
+ * udp binding timeouts.
+ */
+#define TUNNEL_HEARTBEAT_IDLE		3000
+
+/*
+ * How long we hold on to acks in the hope that they can ride along
+ * with a text or heartbeat message before sending them by themselves.
+ */
+#define TUNNEL_ACK_DELAY		100
+
+/* The window in which we coalesce records into a single frame. */
+#define TUNNEL_FRAME_DELAY		LITANY_WHEEL_TICK
+
+/* After how long we consider a peer to be offline. */
+#define TUNNEL_OFFLINE_TIMEOUT		10000
+
+/*
+ * Congestion control, the window is counted in frames per round-trip
+ * and grows with the number of messages our peer acknowledged. Before
+ * we have a round-trip time estimate we assume TUNNEL_CC_RTT_DEFAULT.
+ */
+#define TUNNEL_CC_CWND_INITIAL		10
+#define TUNNEL_CC_CWND_MIN		2
+#define TUNNEL_CC_CWND_MAX		4096
+#define TUNNEL_CC_RTT_MIN		20
+#define TUNNEL_CC_RTT_DEFAULT		100
+
+/*
+ * The pacer releases data frames at cwnd frames per round-trip, it
+ * allows bursts of TUNNEL_PACER_BURST frames or a single wheel tick
+ * worth of frames, whichever is larger. Frames that do not fit in
+ * the queue are dropped, we retransmit those later.
+ */
+#define TUNNEL_PACER_BURST		4
+#define TUNNEL_PACER_QUEUE_MAX		1024
+
+/*
+ * A data frame waiting on the pacer.
+ */
+struct tunnel_frame {
+	struct litany_msg_data		data;
+	TAILQ_ENTRY(tunnel_frame)	list;
+};
+
+TAILQ_HEAD(tunnel_frame_queue, tunnel_frame);
 
 /*
  * The interface objects wanting to use tunnels must adhere too.
@@ -32,44 +89,83 @@
 class TunnelInterface {
 public:
 	virtual void message_show(const char *, u_int64_t, Qt::GlobalColor);
+	virtual void message_text(u_int8_t, u_int64_t, Qt::GlobalColor,
+	    const u_int8_t *, size_t);
 };
 
 /*
  * A tunnel object, responsible for maintaing a single peer-to-peer
  * and end-to-end encrypted tunnel to a peer using libkyrka.
  */
-class Tunnel: public QObject {
+class Tunnel: public QObject, public SocketInterface {
 	Q_OBJECT
 
 public:
-	Tunnel(TunnelInterface *, QJsonObject *, u_int8_t, bool);
+	Tunnel(TunnelInterface *, QJsonObject *,
+	    LitanySocket *, u_int8_t, bool);
 	~Tunnel(void);
 
 	void send_heartbeat(void);
-	void send_text(const void *, size_t);
+	void send_text(struct litany_msg_body **, size_t);
 	void send_msg(struct litany_msg_data *);
 
+	void legacy_set(bool);
+	void legacy_send(u_int8_t, u_int64_t, const void *, size_t);
+
+	void frame_acks(void);
+	void frame_flush(void);
+
+	void cc_loss(void);
+	void cc_ack(u_int64_t);
+	u_int64_t cc_rate(void);
+
+	void pacer_run(void);
+	void pacer_send(struct litany_msg_data *);
+	void frame_msg(struct litany_msg *);
+	u_int8_t *frame_record(u_int8_t, size_t);
+
 	void socket_send(const void *, size_t, int, int);
 
 	void send_ack(u_int64_t);
-	void recv_ack(u_int64_t);
-	void recv_msg(Qt::GlobalColor, u_int64_t, const char *, ...);
+	void ack_flush(void);
+
+	void recv_acks(const void *, size_t);
+	void recv_fragment(u_int64_t, const struct litany_fragment *,
+	    const void *, size_t);
+	void recv_xfer(u_int8_t, const u_int8_t *, size_t);
+
+	void file_send(XferSource *);
+	void file_answer(bool);
+	void xfer_done(u_int64_t, u_int8_t);
+	void xfer_reap(void);
+	void xfer_tick(void);
+	void recv_text(Qt::GlobalColor, u_int64_t, const u_int8_t *, size_t);
 
 	void system_msg(const char *, ...);
+	void stats_show(void);
+
+	void heartbeat(void);
+	void key_manage(void);
+	void offline_check(void);
+	void reassembly_expire(void);
+	void resend_pending(void);
+	u_int64_t resend_timeout(void);
+	void resend_schedule(void);
+	void cathedral_notify(void);
 
 	void peer_alive(void);
+	void keys_update(u_int32_t);
 	void peer_update(struct kyrka_event_peer *);
 
+	int packet_read(const void *, size_t, bool) override;
+
 	/* The peer_id we are talking too. */
 	u_int8_t		peer_id;
 
-private slots:
-	void manage(void);
-	void packet_read(void);
-	void resend_pending(void);
-
 private:
-	QUdpSocket		socket;
+	/* Our socket, possibly shared with other tunnels. */
+	LitanySocket		*socket;
+	bool			socket_shared;
 
 	/* The ip:port of our peer. */
 	quint16			peer_port;
@@ -85,16 +181,78 @@ private:
 	/* The underlying libkyrka context to maintain tunnel state. */
 	KYRKA			*kyrka;
 
-	QTimer			manager;
-	time_t			last_update;
-	time_t			last_notify;
-	time_t			last_heartbeat;
+	/* When we last heard from our peer, 0 if it is offline. */
+	u_int64_t		last_update;
+
+	/* When we last sent a message to our peer. */
+	u_int64_t		last_send;
+
+	/* The current heartbeat interval and heartbeat counters. */
+	u_int64_t		hb_interval;
+	u_int64_t		hb_sent;
+	u_int64_t		hb_suppressed;
+
+	/* Our timers on the timer wheel. */
+	struct litany_timer	ack_timer;
+	struct litany_timer	keys_timer;
+	struct litany_timer	frame_timer;
+	struct litany_timer	reasm_timer;
+	struct litany_timer	xfer_timer;
+	struct litany_timer	pacer_timer;
+	struct litany_timer	notify_timer;
+	struct litany_timer	resend_timer;
+	struct litany_timer	offline_timer;
+	struct litany_timer	heartbeat_timer;
+
+	/* Store of non-ack'd messages. */
+	struct litany_msg_store	msgs;
+
+	/* Our file transfers to and from our peer, if any. */
+	FileSend		*xfer_tx;
+	FileRecv		*xfer_rx;
+
+	/* The largest file (in bytes) we accept from our peer. */
+	u_int64_t		xfer_max;
+
+	/* The last incoming transfer we finished and how it went. */
+	u_int64_t		xfer_last_id;
+	u_int8_t		xfer_last_status;
+
+	/* Long messages from our peer that are being reassembled. */
+	struct litany_reassembly	reasm;
+
+	/* Round-trip time estimate, used for our resend timeouts. */
+	struct litany_rtt	rtt;
+
+	/* The acks (big endian) we still have to send to our peer. */
+	size_t			acks_count;
+	u_int64_t		acks[LITANY_MESSAGE_ACKS_MAX];
+
+	/* True if our peer uses the old message format without frames. */
+	bool			peer_legacy;
+
+	/* The frame we are filling with records, not yet sent. */
+	bool			frame_data;
+	size_t			frame_len;
+	struct litany_msg_data	frame;
+
+	/* Congestion control state, see cc_ack() and cc_loss(). */
+	u_int64_t		cc_cwnd;
+	u_int64_t		cc_acked;
+	u_int64_t		cc_losses;
+	u_int64_t		cc_ssthresh;
+	u_int64_t		cc_recovery;
 
-	/* Timer to periodically flush messages. */
-	QTimer			flush;
+	/* The pacer, its tokens are in thousandths of a frame. */
+	u_int64_t		pacer_last;
+	u_int64_t		pacer_drops;
+	u_int64_t		pacer_tokens;
+	size_t			pacer_queued;
+	struct tunnel_frame_queue	pacer_queue;
 
-	/* List of non-ack'd messages. */
-	struct litany_msg_list	msgs;
+	/* The number of frames we sent and the records they carried. */
+	u_int64_t		tx_frames;
+	u_int64_t		tx_records;
 };
 
 #endif
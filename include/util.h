@@ -52,10 +52,28 @@ extern "C" {
 /* The maximum number of bytes per message we can submit. */
 #define LITANY_MESSAGE_MAX_SIZE		512
 
-/* The different types of messages. */
+/*
+ * The different types of messages. On the wire we only send messages
+ * of type LITANY_MESSAGE_TYPE_FRAME, the other types are used for
+ * the records inside of a frame, or as bare messages for peers that
+ * use the old message format.
+ */
 #define LITANY_MESSAGE_TYPE_TEXT	1
 #define LITANY_MESSAGE_TYPE_ACK		2
 #define LITANY_MESSAGE_TYPE_HEARTBEAT	3
+#define LITANY_MESSAGE_TYPE_FRAGMENT	4
+#define LITANY_MESSAGE_TYPE_FRAME	5
+#define LITANY_MESSAGE_TYPE_XFER_OFFER	6
+#define LITANY_MESSAGE_TYPE_XFER_DATA	7
+#define LITANY_MESSAGE_TYPE_XFER_ACK	8
+#define LITANY_MESSAGE_TYPE_XFER_DONE	9
+
+/*
+ * Peers from before frames send bare TEXT, ACK, HEARTBEAT and ACKS
+ * messages, which we still accept. ACKS shares its value with the
+ * fragment record type, it only ever appears as a message type.
+ */
+#define LITANY_MESSAGE_TYPE_ACKS	4
 
 /*
  * A message containing some data that we are sending to the other
@@ -68,28 +86,302 @@ struct litany_msg_data {
 	u_int8_t		data[LITANY_MESSAGE_MAX_SIZE];
 } __attribute__((packed));
 
+/*
+ * A frame is a litany_msg_data of type LITANY_MESSAGE_TYPE_FRAME that
+ * is always sent at its full size. The first byte of its data is the
+ * frame version, followed by records up until len bytes. Each record
+ * is a litany_record header followed by len bytes of value.
+ *
+ * Text records carry a big endian message id followed by the text,
+ * ack records carry a list of big endian message ids and heartbeat
+ * records are empty. Records of unknown types are skipped.
+ *
+ * Fragment records carry a big endian message id, followed by a
+ * litany_fragment header and a part of the text of a long message.
+ */
+#define LITANY_FRAME_VERSION		1
+
+struct litany_record {
+	u_int8_t		type;
+	u_int16_t		len;
+} __attribute__((packed));
+
+/* The maximum length of a single record its value. */
+#define LITANY_RECORD_MAX_SIZE		\
+    (LITANY_MESSAGE_MAX_SIZE - 1 - sizeof(struct litany_record))
+
+/* The maximum number of bytes of text we can put in one record. */
+#define LITANY_MESSAGE_TEXT_MAX		\
+    (LITANY_RECORD_MAX_SIZE - sizeof(u_int64_t))
+
+/* The maximum number of message ids in a single ack record. */
+#define LITANY_MESSAGE_ACKS_MAX		\
+    (LITANY_RECORD_MAX_SIZE / sizeof(u_int64_t))
+
+/*
+ * Text that does not fit in a single record is split into fragments,
+ * each one registered, retransmitted and ACK'd as its own message.
+ *
+ * The base is the id that was reserved for the entire message, index
+ * is the position of the fragment and count the number of fragments.
+ * All fragments except the last one carry LITANY_FRAGMENT_DATA bytes.
+ */
+struct litany_fragment {
+	u_int64_t		base;
+	u_int8_t		index;
+	u_int8_t		count;
+} __attribute__((packed));
+
+#define LITANY_FRAGMENT_MAX		32
+#define LITANY_FRAGMENT_DATA		\
+    (LITANY_MESSAGE_TEXT_MAX - sizeof(struct litany_fragment))
+
+/* The maximum number of bytes of text in a fragmented message. */
+#define LITANY_MESSAGE_LONG_MAX		\
+    (LITANY_FRAGMENT_MAX * LITANY_FRAGMENT_DATA)
+
+/*
+ * The file transfer records, all fields are big endian.
+ *
+ * An offer announces a file of the given size and its BLAKE2b-256
+ * digest, followed by its name. Data records carry one chunk of the
+ * file at the given index, every chunk except the last one carries
+ * exactly LITANY_XFER_CHUNK bytes. The receiver acknowledges with
+ * the first chunk it is missing and a bitmap of the chunks after
+ * that it did receive (bit 0 being next). Once the file is complete
+ * and its digest verified the receiver reports the result with a
+ * done record.
+ */
+#define LITANY_XFER_DIGEST_LEN		32
+#define LITANY_XFER_NAME_MAX		255
+
+struct litany_xfer_offer {
+	u_int64_t		id;
+	u_int64_t		size;
+	u_int8_t		digest[LITANY_XFER_DIGEST_LEN];
+} __attribute__((packed));
+
+struct litany_xfer_data {
+	u_int64_t		id;
+	u_int32_t		index;
+} __attribute__((packed));
+
+struct litany_xfer_ack {
+	u_int64_t		id;
+	u_int32_t		next;
+	u_int64_t		sack;
+} __attribute__((packed));
+
+struct litany_xfer_done {
+	u_int64_t		id;
+	u_int8_t		status;
+} __attribute__((packed));
+
+#define LITANY_XFER_CHUNK		\
+    (LITANY_RECORD_MAX_SIZE - sizeof(struct litany_xfer_data))
+
+/* The status in a done record. */
+#define LITANY_XFER_STATUS_OK		0
+#define LITANY_XFER_STATUS_REFUSED	1
+#define LITANY_XFER_STATUS_CORRUPT	2
+#define LITANY_XFER_STATUS_FAILED	3
+
+/*
+ * The bounds (in milliseconds) for our retransmission timeout,
+ * which is calculated as per RFC 6298.
+ */
+#define LITANY_RTO_MIN			250
+#define LITANY_RTO_MAX			30000
+#define LITANY_RTO_INITIAL		1000
+#define LITANY_RTO_GRANULARITY		50
+
+/*
+ * The round-trip time estimate for a peer, all values in milliseconds.
+ */
+struct litany_rtt {
+	u_int64_t		srtt;
+	u_int64_t		rttvar;
+	u_int64_t		rto;
+	u_int64_t		samples;
+};
+
+/*
+ * The immutable body of a text or fragment message. When a message
+ * goes to several peers, all of their stores reference the same body,
+ * it is released once the last of them dropped its reference.
+ *
+ * Bodies are shared between tunnel shards, refs is only ever touched
+ * with atomic operations.
+ */
+struct litany_msg_body {
+	u_int32_t		refs;
+	u_int16_t		len;
+	u_int8_t		type;
+	u_int8_t		data[LITANY_MESSAGE_TEXT_MAX];
+};
+
+/*
+ * A message we sent that has not yet been ACK'd. It lives in the hash
+ * index of its store (by id) and on its min-heap (by resend deadline).
+ *
+ * Each time a message is resent its timeout is doubled, up until
+ * LITANY_RTO_MAX is reached.
+ */
 struct litany_msg {
 	u_int64_t		id;
-	time_t			age;
-	struct litany_msg_data	data;
-	TAILQ_ENTRY(litany_msg)	list;
+	u_int64_t		sent;
+	u_int64_t		timeout;
+	u_int64_t		deadline;
+	u_int32_t		retries;
+	size_t			heap_idx;
+	struct litany_msg_body	*body;
+	LIST_ENTRY(litany_msg)	hash;
+};
+
+LIST_HEAD(litany_msg_bucket, litany_msg);
+
+struct litany_msg_slab;
+LIST_HEAD(litany_msg_slabs, litany_msg_slab);
+
+/*
+ * A pool of fixed size objects carved out of slabs of locked pages,
+ * so that plaintext never ends up in the general heap. Objects are
+ * zeroed when they are returned to the pool.
+ */
+struct litany_msg_pool {
+	size_t				size;
+	size_t				inuse;
+	size_t				total;
+	size_t				highwater;
+
+	size_t				slabs;
+	size_t				unlocked;
+
+	void				*freelist;
+	struct litany_msg_slabs		slablist;
+};
+
+/*
+ * The store of messages that were not yet ACK'd by a peer, each
+ * store has its own pool to allocate messages from.
+ */
+struct litany_msg_store {
+	size_t				count;
+	struct litany_msg_pool		pool;
+
+	size_t				mask;
+	struct litany_msg_bucket	*buckets;
+
+	size_t				heap_max;
+	struct litany_msg		**heap;
+};
+
+/*
+ * A message that is being reassembled from its fragments, its buffer
+ * is only allocated while the slot is in use.
+ */
+struct litany_reassembly_slot {
+	u_int64_t		base;
+	u_int64_t		started;
+	u_int8_t		count;
+	size_t			length;
+	u_int32_t		received;
+	u_int8_t		*buf;
 };
 
-TAILQ_HEAD(litany_msg_list, litany_msg);
+/* The number of messages per peer we reassemble at the same time. */
+#define LITANY_REASSEMBLY_SLOTS		4
+
+/* How long (in milliseconds) we wait for a message to complete. */
+#define LITANY_REASSEMBLY_TIMEOUT	60000
+
+/* The number of completed messages we remember per peer. */
+#define LITANY_REASSEMBLY_DONE		32
+
+/*
+ * The bounded reassembly buffer for the fragmented messages of a peer.
+ *
+ * The bases of the last LITANY_REASSEMBLY_DONE completed messages are
+ * kept in a ring so that late retransmits of their fragments, whose
+ * acks got lost, are acked again without taking up a slot.
+ */
+struct litany_reassembly {
+	size_t				inuse;
+	u_int64_t			completed;
+	u_int64_t			expired;
+	u_int64_t			dropped;
+	u_int64_t			late;
+	u_int64_t			done[LITANY_REASSEMBLY_DONE];
+	struct litany_reassembly_slot	pending[LITANY_REASSEMBLY_SLOTS];
+};
+
+/*
+ * A lock-free single-producer single-consumer ring of pointers. The
+ * producer only writes head and the consumer only writes tail, both
+ * live on their own cache line.
+ */
+struct litany_ring {
+	size_t			elm;
+	size_t			mask;
+	void			**data;
+
+	u_int64_t		head __attribute__((aligned(64)));
+	u_int64_t		tail __attribute__((aligned(64)));
+};
 
 /* src/main.cc */
 extern const char	*config_file;
+u_int64_t		litany_msec(void);
 void			fatal(const char *, ...) __attribute__((noreturn));
 
 /* src/msg.c */
 void	litany_msg_number_reset(u_int8_t);
-void	litany_msg_ack(struct litany_msg_list *, u_int64_t);
+u_int64_t	litany_msg_number_reserve(void);
+void	litany_msg_store_init(struct litany_msg_store *);
+void	litany_msg_store_cleanup(struct litany_msg_store *);
+void	litany_msg_reschedule(struct litany_msg_store *,
+	    struct litany_msg *, u_int64_t);
+void	litany_msg_retransmit(struct litany_msg_store *,
+	    struct litany_msg *, u_int64_t);
+int	litany_msg_ack(struct litany_msg_store *, u_int64_t, u_int64_t *);
+size_t	litany_msg_acks(struct litany_msg_store *, const void *, size_t,
+	    struct litany_rtt *);
+
+void	litany_rtt_init(struct litany_rtt *);
+void	litany_rtt_sample(struct litany_rtt *, u_int64_t);
+
+u_int64_t		litany_msg_next_deadline(struct litany_msg_store *);
+struct litany_msg	*litany_msg_expired(struct litany_msg_store *,
+			    u_int64_t);
+struct litany_msg	*litany_msg_register(struct litany_msg_store *,
+			    struct litany_msg_body *, u_int64_t);
+
+size_t	litany_msg_text(const void *, size_t, struct litany_msg_body **,
+	    size_t);
+void	litany_msg_body_ref(struct litany_msg_body *);
+void	litany_msg_body_release(struct litany_msg_body *);
+void	litany_msg_body_stats(size_t *, size_t *);
+struct litany_msg_body	*litany_msg_body_alloc(u_int8_t, const void *,
+			    size_t);
+
+void	litany_reassembly_init(struct litany_reassembly *);
+void	litany_reassembly_cleanup(struct litany_reassembly *);
+void	litany_reassembly_release(struct litany_reassembly *,
+	    struct litany_reassembly_slot *);
+void	litany_reassembly_expire(struct litany_reassembly *, u_int64_t);
+int	litany_reassembly_add(struct litany_reassembly *,
+	    const struct litany_fragment *, const void *, size_t, u_int64_t,
+	    struct litany_reassembly_slot **);
 
-struct litany_msg	*litany_msg_register(struct litany_msg_list *,
-			    const void *, size_t);
+/* src/ring.c */
+void	litany_ring_init(struct litany_ring *, size_t);
+void	litany_ring_cleanup(struct litany_ring *);
+int	litany_ring_queue(struct litany_ring *, void *);
+void	*litany_ring_dequeue(struct litany_ring *);
+size_t	litany_ring_pending(struct litany_ring *);
 
 /* src/utf8.c */
-int	litany_utf8_sequence(const void *, size_t, size_t, size_t *);
+int	litany_utf8_valid(const void *, size_t);
 
 #if defined(__cplusplus)
 }
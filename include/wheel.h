@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __H_LITANY_WHEEL_H
+#define __H_LITANY_WHEEL_H
+
+#include <QTimer>
+#include <QObject>
+
+#include "util.h"
+
+/* The resolution of the wheel in milliseconds. */
+#define LITANY_WHEEL_TICK		50
+
+/*
+ * The wheel levels, the first level covers 256 ticks, every level
+ * after that covers 64 slots of the level below it.
+ */
+#define LITANY_WHEEL_L0_BITS		8
+#define LITANY_WHEEL_LN_BITS		6
+#define LITANY_WHEEL_L0_SIZE		(1 << LITANY_WHEEL_L0_BITS)
+#define LITANY_WHEEL_LN_SIZE		(1 << LITANY_WHEEL_LN_BITS)
+#define LITANY_WHEEL_L0_MASK		(LITANY_WHEEL_L0_SIZE - 1)
+#define LITANY_WHEEL_LN_MASK		(LITANY_WHEEL_LN_SIZE - 1)
+
+#define LITANY_WHEEL_L1_SHIFT		LITANY_WHEEL_L0_BITS
+#define LITANY_WHEEL_L2_SHIFT		\
+    (LITANY_WHEEL_L0_BITS + LITANY_WHEEL_LN_BITS)
+
+#define LITANY_WHEEL_L1_SPAN		(1ULL << LITANY_WHEEL_L1_SHIFT)
+#define LITANY_WHEEL_L2_SPAN		(1ULL << LITANY_WHEEL_L2_SHIFT)
+#define LITANY_WHEEL_MAX_SPAN		\
+    (1ULL << (LITANY_WHEEL_L2_SHIFT + LITANY_WHEEL_LN_BITS))
+
+struct litany_timer_list;
+
+/*
+ * A single timer that lives on the wheel. The owner embeds these and
+ * initializes them once with TimerWheel::timer_init().
+ */
+struct litany_timer {
+	u_int64_t			expires;
+	int				armed;
+	void				(*cb)(void *);
+	void				*udata;
+	struct litany_timer_list	*head;
+	TAILQ_ENTRY(litany_timer)	list;
+};
+
+TAILQ_HEAD(litany_timer_list, litany_timer);
+
+/*
+ * A hierarchical timer wheel, driven by a single QTimer that is only
+ * armed for the next tick that has work due. This means that regardless
+ * of how many tunnels we have, we only wake up when one of their
+ * deadlines is actually due.
+ *
+ * Every thread that runs timers has its own wheel, timers must only be
+ * added to and cancelled on the wheel of the thread that owns them.
+ */
+class TimerWheel: public QObject {
+	Q_OBJECT
+
+public:
+	TimerWheel(void);
+
+	static void timer_init(struct litany_timer *,
+	    void (*)(void *), void *);
+
+	void timer_add(struct litany_timer *, u_int64_t);
+	void timer_cancel(struct litany_timer *);
+
+	void stats(char *, size_t);
+
+private slots:
+	void run(void);
+
+private:
+	void rearm(void);
+	void place(struct litany_timer *);
+	void cascade(struct litany_timer_list *);
+
+	/* The QTimer that drives us and the tick it is armed for. */
+	QTimer				timer;
+	u_int64_t			next;
+
+	/* The last tick we processed and the number of armed timers. */
+	u_int64_t			tick;
+	u_int64_t			count;
+
+	/* Wakeups per second, measured over the last full second. */
+	u_int64_t			wakeups;
+	u_int64_t			wakeups_rate;
+	u_int64_t			wakeups_second;
+
+	struct litany_timer_list	l0[LITANY_WHEEL_L0_SIZE];
+	struct litany_timer_list	l1[LITANY_WHEEL_LN_SIZE];
+	struct litany_timer_list	l2[LITANY_WHEEL_LN_SIZE];
+};
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __H_LITANY_WORKER_H
+#define __H_LITANY_WORKER_H
+
+#include <QObject>
+#include <QString>
+#include <QThread>
+
+#include "util.h"
+#include "queue.h"
+#include "wheel.h"
+
+/* The number of events that fit on the ring towards the GUI. */
+#define LITANY_WORKER_RING_SIZE		4096
+
+/* The types of events a worker hands to the GUI thread. */
+#define LITANY_EVENT_MESSAGE		1
+#define LITANY_EVENT_LITURGY		2
+#define LITANY_EVENT_TEXT		3
+
+/*
+ * An event for the GUI thread, its data is allocated together with it.
+ * For LITANY_EVENT_MESSAGE data is the nul-terminated message, for
+ * LITANY_EVENT_TEXT it is the text peer sent us and for
+ * LITANY_EVENT_LITURGY it holds the state of each peer in the flock.
+ */
+struct litany_event {
+	int				type;
+	u_int8_t			peer;
+	u_int64_t			id;
+	Qt::GlobalColor			color;
+	size_t				len;
+	u_int8_t			*data;
+	TAILQ_ENTRY(litany_event)	list;
+};
+
+TAILQ_HEAD(litany_event_list, litany_event);
+
+/*
+ * A thread doing network I/O and libkyrka processing away from the
+ * GUI thread, so that a stalled GUI never delays reading our sockets,
+ * keying or heartbeats.
+ *
+ * The thread has its own event loop and timer wheel. The GUI thread
+ * hands work to it with post(). The worker hands events back over a
+ * lock-free single-producer single-consumer ring, the GUI thread is
+ * only woken up when the ring goes from empty to non-empty. If the
+ * ring is full the events are held back on our side, in order, and
+ * retried from a timer; the worker never blocks on the GUI thread.
+ */
+class LitanyWorker {
+public:
+	LitanyWorker(const QString &);
+	virtual ~LitanyWorker(void);
+
+	virtual void event_dispatch(struct litany_event *);
+
+	void event_send(int, u_int8_t, u_int64_t, Qt::GlobalColor,
+	    const void *, size_t);
+	void event_retry(void);
+
+	/* Run fn on the worker thread. */
+	template<typename F> void post(F fn) {
+		QMetaObject::invokeMethod(ctx, fn, Qt::QueuedConnection);
+	}
+
+	/* Run fn on the worker thread and wait for it to complete. */
+	template<typename F> void post_wait(F fn) {
+		QMetaObject::invokeMethod(ctx, fn,
+		    Qt::BlockingQueuedConnection);
+	}
+
+protected:
+	/* Must be called from the destructor of the subclass. */
+	void stop(void);
+
+	/* The wheel for our thread, only accessed from our thread. */
+	TimerWheel			*timers;
+
+private:
+	void events_drain(void);
+
+	/* The thread and the object living on it we post work to. */
+	QThread				thread;
+	QObject				*ctx;
+
+	/* The object on the GUI thread our wakeups are posted to. */
+	QObject				gui;
+
+	/* Set while a wakeup is pending on the GUI thread. */
+	int				wakeup;
+
+	/* The ring to the GUI thread and events that did not fit. */
+	struct litany_ring		ring;
+	struct litany_event_list	backlog;
+	struct litany_timer		backlog_timer;
+	bool				stopped;
+};
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __H_LITANY_XFER_H
+#define __H_LITANY_XFER_H
+
+#include <QFile>
+#include <QMutex>
+#include <QString>
+
+#include "util.h"
+#include "wheel.h"
+
+/* The number of chunks we may have in flight, one bit per chunk. */
+#define XFER_WINDOW		64
+
+/* How often (in milliseconds) the tunnel runs our transfers. */
+#define XFER_TICK		(LITANY_WHEEL_TICK * 2)
+
+/* After how long without progress we give up on a transfer. */
+#define XFER_STALL_TIMEOUT	30000
+
+/* How long (in milliseconds) an offer waits for the user to accept. */
+#define XFER_ACCEPT_TIMEOUT	120000
+
+/*
+ * The largest file (in MiB) we accept unless "xfer-max-size" says
+ * otherwise, and how much free space we leave on the disk.
+ */
+#define XFER_SIZE_MAX		1024
+#define XFER_SPACE_RESERVE	(64ULL * 1024 * 1024)
+
+/* The receiver acks after this many chunks or on its next tick. */
+#define XFER_ACK_EVERY		8
+
+class Tunnel;
+
+/*
+ * A file we are sending, shared by the transfers to all peers that
+ * a single /send goes to.
+ *
+ * The file is opened, mapped and hashed only once, by the first
+ * transfer that calls prepare(). The others wait for it and use the
+ * same mapping and digest. The last reference closes the file.
+ */
+class XferSource {
+public:
+	XferSource(const QString &);
+
+	void ref(void);
+	void release(void);
+	bool prepare(Tunnel *);
+
+	/* Only valid once prepare() returned true. */
+	QString			name;
+	const u_int8_t		*map;
+	u_int64_t		size;
+	u_int32_t		chunks;
+	u_int8_t		digest[LITANY_XFER_DIGEST_LEN];
+
+private:
+	~XferSource(void);
+
+	/* Protects state while we prepare. */
+	QMutex			mtx;
+	int			state;
+
+	QFile			file;
+	QString			path;
+	u_int32_t		refs;
+};
+
+/*
+ * An outgoing file transfer to the peer of a tunnel.
+ *
+ * The chunks are sent straight from the mapping of our source. At
+ * most XFER_WINDOW chunks are unacknowledged at any time, chunks the
+ * receiver reports as missing are resent once they are older than
+ * the retransmission timeout of the tunnel.
+ */
+class FileSend {
+public:
+	FileSend(Tunnel *, XferSource *);
+	~FileSend(void);
+
+	void start(void);
+	void tick(void);
+	void ack(const struct litany_xfer_ack *);
+	void done(u_int8_t);
+
+	void stats(char *, size_t);
+
+	/* The id of this transfer and if it is finished. */
+	u_int64_t		id;
+	bool			finished;
+
+	/* Set if the file could not be opened or mapped. */
+	bool			failed;
+
+private:
+	void fill(void);
+	void offer(void);
+	void progress(void);
+	void chunk_send(u_int32_t);
+
+	Tunnel			*tunnel;
+
+	/* The file we send, we hold a reference on it. */
+	XferSource		*src;
+
+	/* The window, bit n in acked is chunk base + n. */
+	u_int32_t		base;
+	u_int32_t		next;
+	u_int64_t		acked;
+	u_int64_t		sent[XFER_WINDOW];
+
+	/* If the receiver accepted our offer. */
+	bool			accepted;
+	u_int64_t		offered;
+
+	/* Statistics. */
+	u_int64_t		started;
+	u_int64_t		progressed;
+	u_int64_t		retransmits;
+	u_int32_t		reported;
+};
+
+/*
+ * An incoming file transfer from the peer of a tunnel.
+ *
+ * Nothing touches the disk until the user accepts the offer. Then the
+ * destination file is created with its full size up front and mapped
+ * into memory, chunks are copied straight into that mapping. Once all
+ * chunks arrived the digest is verified and the file moved into place.
+ */
+class FileRecv {
+public:
+	FileRecv(Tunnel *, const struct litany_xfer_offer *,
+	    const char *, size_t, u_int64_t);
+	~FileRecv(void);
+
+	void tick(void);
+	void accept(void);
+	void reject(void);
+	void ack_send(void);
+	void data(u_int32_t, const u_int8_t *, size_t);
+
+	void stats(char *, size_t);
+
+	/* The id of this transfer and its status once finished. */
+	u_int64_t		id;
+	bool			finished;
+	u_int8_t		status;
+
+	/* Set once the user accepted the offer. */
+	bool			accepted;
+
+private:
+	void complete(void);
+	void finish(u_int8_t);
+
+	Tunnel			*tunnel;
+
+	/* The destination file (and its temporary name) and mapping. */
+	bool			created;
+	QFile			file;
+	QString			path;
+	QString			name;
+	u_int8_t		*map;
+	u_int64_t		size;
+	u_int32_t		chunks;
+	u_int8_t		digest[LITANY_XFER_DIGEST_LEN];
+
+	/* The chunks we received, next is the first one we miss. */
+	u_int8_t		*received;
+	u_int32_t		count;
+	u_int32_t		next;
+	u_int32_t		pending;
+
+	/* Statistics. */
+	u_int64_t		started;
+	u_int64_t		progressed;
+	u_int32_t		reported;
+};
+
+#endif
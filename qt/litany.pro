@@ -21,7 +21,15 @@ LIBS += -lsodium
 
 HEADERS+=	include/litany.h \
 		include/chat.h \
+		include/model.h \
+		include/history.h \
+		include/index.h \
 		include/tunnel.h \
+		include/shard.h \
+		include/worker.h \
+		include/socket.h \
+		include/wheel.h \
+		include/xfer.h \
 		include/liturgy.h \
 		include/group.h \
 		include/peer.h \
@@ -30,13 +38,22 @@ HEADERS+=	include/litany.h \
 
 SOURCES +=	src/main.cc \
 		src/chat.cc \
+		src/model.cc \
+		src/history.cc \
+		src/index.cc \
 		src/tunnel.cc \
+		src/shard.cc \
+		src/worker.cc \
+		src/socket.cc \
+		src/wheel.cc \
+		src/xfer.cc \
 		src/litany.cc \
 		src/liturgy.cc \
 		src/group.cc \
 		src/peer.cc \
 		src/settings.cc \
 		src/msg.c \
+		src/ring.c \
 		src/utf8.c
 
 QMAKE_CXXFLAGS	+=	-g
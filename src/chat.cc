@@ -15,11 +15,21 @@
  */
 
 #include <QBoxLayout>
+#include <QDateTime>
+#include <QElapsedTimer>
 #include <QEvent>
 
 #include "litany.h"
 #include "chat.h"
 
+/* We can use libnyfe because its included in libkyrka. */
+extern "C" void	nyfe_mem_zero(void *, size_t);
+
+static void	chat_history_restore(const struct litany_history_msg *,
+		    void *);
+static void	chat_search_result(const struct litany_history_msg *,
+		    void *);
+
 /*
  * A chat window for either talking to a single peer or multiple peers
  * in a group setting.
@@ -27,7 +37,10 @@
 Chat::Chat(QJsonObject *config, const char *which, int mode)
 {
 	u_int8_t	id;
+	int		threads;
 	u_int16_t	group;
+	u_int64_t	keep;
+	QString		label;
 	QWidget		*widget;
 	QBoxLayout	*layout;
 
@@ -36,9 +49,13 @@ Chat::Chat(QJsonObject *config, const char *which, int mode)
 	PRECOND(mode == LITANY_CHAT_MODE_DIRECT ||
 	    mode == LITANY_CHAT_MODE_GROUP);
 
+	alert = false;
+	history = NULL;
+	search_hits = 0;
 	discovery = NULL;
 	chat_mode = mode;
-	memset(tunnels, 0, sizeof(tunnels));
+	memset(peers, 0, sizeof(peers));
+	memset(shards, 0, sizeof(shards));
 
 	id = litany_json_number(config, "kek-id", UCHAR_MAX) & 0xff;
 	litany_msg_number_reset(id);
@@ -69,8 +86,17 @@ Chat::Chat(QJsonObject *config, const char *which, int mode)
 	connect(input,
 	    &QLineEdit::returnPressed, this, &Chat::create_message);
 
-	model = new QStandardItemModel(this);
-	model->insertColumn(0);
+	/* The number of messages we keep, optional "chat-history". */
+	if (config->contains("chat-history")) {
+		keep = litany_json_number(config,
+		    "chat-history", LITANY_CHAT_HISTORY_MAX);
+		if (keep == 0)
+			fatal("chat-history must be at least 1");
+	} else {
+		keep = LITANY_CHAT_HISTORY_DEFAULT;
+	}
+
+	model = new ChatModel(this, keep);
 
 	view = new QListView(widget);
 	view->setWordWrap(true);
@@ -82,16 +108,47 @@ Chat::Chat(QJsonObject *config, const char *which, int mode)
 
 	view->setStyleSheet("border: 1px solid #353535");
 
+	connect(model, &QAbstractItemModel::rowsInserted,
+	    this, &Chat::rows_added);
+
 	layout->addWidget(input);
 	layout->addWidget(view);
 	layout->addStretch();
 
 	setCentralWidget(widget);
 
+	/* Messages are persisted unless "chat-persist" is set to 0. */
+	if (!config->contains("chat-persist") ||
+	    litany_json_number(config, "chat-persist", 1) != 0) {
+		if (chat_mode == LITANY_CHAT_MODE_DIRECT) {
+			label = QString("chat-%1").arg(QString(which)
+			    .toUShort(NULL, 16) & 0xff, 2, 16,
+			    QLatin1Char('0'));
+		} else {
+			label = QString("group-%1").arg(QString(which)
+			    .toUShort(NULL, 16), 4, 16, QLatin1Char('0'));
+		}
+
+		history = new ChatHistory(config, label);
+		history->tail(qMin(keep, (u_int64_t)LITANY_HISTORY_RESTORE),
+		    chat_history_restore, this);
+	}
+
 	if (chat_mode == LITANY_CHAT_MODE_DIRECT) {
+		shard_count = 1;
 		id = QString(which).toUShort(NULL, 16) & 0xff;
-		tunnels[id] = new Tunnel(this, config, id, false);
+		peers[id] = true;
+		shard_get(id)->tunnel_create(id);
 	} else {
+		/* Leave a core for the GUI thread if we can. */
+		threads = QThread::idealThreadCount() - 1;
+		if (threads < 1)
+			threads = 1;
+		if (threads > LITANY_SHARDS_MAX)
+			threads = LITANY_SHARDS_MAX;
+
+		shard_count = threads;
+
 		group = QString(which).toUShort(NULL, 16);
 		discovery = new Liturgy(this,
 		    config, LITURGY_MODE_DISCOVERY, group);
@@ -107,24 +164,84 @@ Chat::Chat(QJsonObject *config, const char *which, int mode)
 void
 Chat::create_message(void)
 {
-	int			i;
+	size_t			idx, count;
+	QByteArray		utf8;
+	u_int16_t		peer;
+	bool			ok, accept;
+	XferSource		*src;
 	QString			text, full;
+	struct litany_msg_body	*bodies[LITANY_FRAGMENT_MAX];
 
 	text = input->text();
 
-	if (text.length() > 0 && text.length() < LITANY_MESSAGE_MAX_SIZE) {
+	if (text == "/stats") {
+		stats_show();
+		input->setText("");
+		return;
+	}
+
+	if (text.startsWith("/search ")) {
+		search_show(text.mid(8).trimmed());
+		input->setText("");
+		return;
+	}
+
+	if (text.startsWith("/send ")) {
+		/* Opened and hashed once, shared by all tunnels. */
+		src = new XferSource(text.mid(6).trimmed());
+
+		for (idx = 0; idx < shard_count; idx++) {
+			if (shards[idx] != NULL)
+				shards[idx]->file_send(src);
+		}
+
+		src->release();
+		input->setText("");
+		return;
+	}
+
+	if (text.startsWith("/accept ") || text.startsWith("/reject ")) {
+		accept = text.startsWith("/accept ");
+		peer = text.mid(8).trimmed().toUShort(&ok, 16);
+
+		if (!ok || peer >= KYRKA_PEERS_PER_FLOCK || !peers[peer]) {
+			message_show("[xfer]: no such peer",
+			    LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+		} else {
+			shard_get(peer)->file_answer(peer, accept);
+		}
+
+		input->setText("");
+		return;
+	}
+
+	utf8 = text.toUtf8();
+
+	if (utf8.length() > 0 &&
+	    (size_t)utf8.length() <= LITANY_MESSAGE_LONG_MAX) {
 		full = QString("<%1> %2").arg(kek_id).arg(text);
 		message_show(full.toUtf8().data(),
 		    LITANY_MESSAGE_SYSTEM_ID, Qt::white);
 
-		/* XXX */
-		for (i = 0; i < KYRKA_PEERS_PER_FLOCK; i++) {
-			if (tunnels[i] != NULL) {
-				tunnels[i]->send_text(text.toUtf8().data(),
-				    text.toUtf8().length());
-			}
+		if (history != NULL)
+			history->append(LITANY_MESSAGE_SYSTEM_ID,
+			    Qt::white, full.toUtf8().data());
+
+		/*
+		 * The bodies are built once and shared by all tunnels,
+		 * each shard takes its own reference.
+		 */
+		count = litany_msg_text(utf8.data(), utf8.length(),
+		    bodies, LITANY_FRAGMENT_MAX);
+
+		for (idx = 0; idx < shard_count; idx++) {
+			if (shards[idx] != NULL)
+				shards[idx]->send_text(bodies, count);
 		}
 
+		for (idx = 0; idx < count; idx++)
+			litany_msg_body_release(bodies[idx]);
+
 		input->setText("");
 	}
 }
@@ -136,43 +253,184 @@ Chat::create_message(void)
 void
 Chat::message_show(const char *msg, u_int64_t id, Qt::GlobalColor color)
 {
-	QVariant		val;
-	qulonglong		qid;
-	QModelIndex		index;
-	int			i, row;
-
 	PRECOND(msg != NULL);
 
-	row = model->rowCount();
-
 	/*
-	 * XXX - can be a lot smarter, but this works for now.
-	 * When (if) this actually becomes an issue we can fix it.
+	 * Our peers retransmit until they see our ack, so the same id
+	 * can show up several times, the model filters those out.
 	 */
-	if (id != LITANY_MESSAGE_SYSTEM_ID) {
-		for (i = 0; i < row; i++) {
-			index = model->index(i, 0);
-			val = model->data(index, Qt::UserRole);
-			qid = val.toULongLong();
-
-			if (qid == id)
-				return;
-		}
+	if (!model->append(msg, id, color))
+		return;
+
+	if (history != NULL && id != LITANY_MESSAGE_SYSTEM_ID)
+		history->append(id, color, msg);
+
+	/* We alert at most once per frame, see rows_added(). */
+	if (id != LITANY_MESSAGE_SYSTEM_ID && this->isActiveWindow() == false)
+		alert = true;
+}
+
+/*
+ * Add text from the given peer to our model as long as it did not yet
+ * exist in the model. The text is stored as is, the model adds the
+ * "<peer> " prefix when it is shown.
+ */
+void
+Chat::message_text(u_int8_t peer, u_int64_t id, Qt::GlobalColor color,
+    const u_int8_t *text, size_t len)
+{
+	PRECOND(text != NULL);
+	PRECOND(id != LITANY_MESSAGE_SYSTEM_ID);
+
+	if (!model->append_text(peer, id, color, text, len))
+		return;
+
+	if (history != NULL)
+		history->append_text(peer, id, color, text, len);
+
+	if (this->isActiveWindow() == false)
+		alert = true;
+}
+
+/*
+ * Our model added a frame worth of messages, scroll to them once and
+ * alert the user if any of them asked for it.
+ */
+void
+Chat::rows_added(void)
+{
+	view->scrollToBottom();
 
+	if (alert) {
+		alert = false;
 		if (this->isActiveWindow() == false)
 			app->alert(this);
 	}
+}
 
-	qid = id;
-	model->insertRow(row);
-	index = model->index(row, 0);
+/*
+ * Add a message from our history to the model, it is not persisted
+ * again and does not alert the user.
+ */
+void
+Chat::history_restore(const struct litany_history_msg *msg)
+{
+	QByteArray	text;
 
-	model->setData(index, msg);
-	model->setData(index, qid, Qt::UserRole);
-	model->setData(index, Qt::AlignLeft, Qt::TextAlignmentRole);
-	model->setData(index, QBrush(color), Qt::ForegroundRole);
+	PRECOND(msg != NULL);
 
-	view->scrollToBottom();
+	text = QByteArray(msg->text, msg->len);
+	model->append(text.constData(), msg->id, msg->color);
+
+	nyfe_mem_zero(text.data(), text.size());
+}
+
+/*
+ * Show a message from our history that matched a search.
+ */
+void
+Chat::search_result(const struct litany_history_msg *msg)
+{
+	PRECOND(msg != NULL);
+
+	message_show(QString("[search] %1 %2")
+	    .arg(QDateTime::fromSecsSinceEpoch(msg->time)
+	    .toString("yyyy-MM-dd hh:mm"))
+	    .arg(QString::fromUtf8(msg->text, msg->len)).toUtf8().data(),
+	    LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+
+	search_hits++;
+}
+
+/*
+ * Search our history for the given text and show the matches.
+ */
+void
+Chat::search_show(const QString &query)
+{
+	QByteArray	utf8;
+	QElapsedTimer	timer;
+
+	if (history == NULL || !history->active()) {
+		message_show("[search]: history is not persisted",
+		    LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+		return;
+	}
+
+	utf8 = query.toUtf8();
+	search_hits = 0;
+
+	timer.start();
+
+	if (!history->search(utf8.constData(),
+	    LITANY_HISTORY_SEARCH_MAX, chat_search_result, this)) {
+		message_show("[search]: use at least 3 characters",
+		    LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+		return;
+	}
+
+	message_show(QString("[search]: %1 matches for \"%2\" in %3 ms")
+	    .arg(search_hits).arg(query).arg(timer.elapsed())
+	    .toUtf8().data(), LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+}
+
+/*
+ * Show the statistics for our discovery liturgy and all tunnels.
+ */
+void
+Chat::stats_show(void)
+{
+	char		buf[512];
+	size_t		idx, inuse, highwater;
+
+	if (discovery != NULL) {
+		discovery->stats(buf, sizeof(buf));
+		message_show(QString("[stats discovery]: %1").arg(buf)
+		    .toUtf8().data(), LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+	}
+
+	wheel->stats(buf, sizeof(buf));
+	message_show(QString("[stats wheel]: %1").arg(buf).toUtf8().data(),
+	    LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+
+	model->stats(buf, sizeof(buf));
+	message_show(QString("[stats model]: %1").arg(buf).toUtf8().data(),
+	    LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+
+	if (history != NULL) {
+		history->stats(buf, sizeof(buf));
+		message_show(QString("[stats history]: %1").arg(buf)
+		    .toUtf8().data(), LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+	}
+
+	litany_msg_body_stats(&inuse, &highwater);
+	message_show(QString("[stats bodies]: %1 in use, %2 high-water")
+	    .arg(inuse).arg(highwater).toUtf8().data(),
+	    LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+
+	for (idx = 0; idx < shard_count; idx++) {
+		if (shards[idx] != NULL)
+			shards[idx]->stats_show();
+	}
+}
+
+/*
+ * Returns the shard the given peer its tunnel lives on, starting
+ * it if this is the first tunnel on it.
+ */
+TunnelShard *
+Chat::shard_get(u_int8_t id)
+{
+	size_t		idx;
+
+	idx = id % shard_count;
+
+	if (shards[idx] == NULL) {
+		shards[idx] = new TunnelShard(this, tunnel_config,
+		    idx, chat_mode == LITANY_CHAT_MODE_GROUP);
+	}
+
+	return (shards[idx]);
 }
 
 /*
@@ -184,13 +442,14 @@ Chat::peer_set_state(u_int8_t id, int state)
 {
 	PRECOND(chat_mode == LITANY_CHAT_MODE_GROUP);
 
-	if (tunnels[id] == NULL && state == 1) {
-		tunnels[id] = new Tunnel(this, tunnel_config, id, true);
+	if (!peers[id] && state == 1) {
+		peers[id] = true;
+		shard_get(id)->tunnel_create(id);
 	}
 
-	if (tunnels[id] != NULL && state == 0) {
-		delete tunnels[id];
-		tunnels[id] = NULL;
+	if (peers[id] && state == 0) {
+		peers[id] = false;
+		shard_get(id)->tunnel_remove(id);
 	}
 }
 
@@ -199,12 +458,42 @@ Chat::peer_set_state(u_int8_t id, int state)
  */
 Chat::~Chat(void)
 {
-	int		i;
+	size_t		idx;
 
 	delete discovery;
 
-	for (i = 0; i < KYRKA_PEERS_PER_FLOCK; i++) {
-		if (tunnels[i] != NULL)
-			delete tunnels[i];
-	}
+	for (idx = 0; idx < shard_count; idx++)
+		delete shards[idx];
+
+	delete history;
+}
+
+/*
+ * Called by our history for each message it restores.
+ */
+static void
+chat_history_restore(const struct litany_history_msg *msg, void *udata)
+{
+	Chat		*chat;
+
+	PRECOND(msg != NULL);
+	PRECOND(udata != NULL);
+
+	chat = (Chat *)udata;
+	chat->history_restore(msg);
+}
+
+/*
+ * Called by our history for each message matching a search.
+ */
+static void
+chat_search_result(const struct litany_history_msg *msg, void *udata)
+{
+	Chat		*chat;
+
+	PRECOND(msg != NULL);
+	PRECOND(udata != NULL);
+
+	chat = (Chat *)udata;
+	chat->search_result(msg);
 }
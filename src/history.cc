@@ -0,0 +1,943 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <QDir>
+#include <QStandardPaths>
+
+#if defined(PLATFORM_WINDOWS)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <inttypes.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "litany.h"
+#include "history.h"
+
+/* The bytes in front of the ciphertext of each record. */
+#define HISTORY_RECORD_HDR	(sizeof(u_int32_t) + LITANY_HISTORY_NONCE_LEN)
+
+static void	history_sync(QFile *);
+static void	history_ad(u_int8_t *, u_int64_t, u_int64_t);
+
+/*
+ * Open the history for the chat with the given name, its records are
+ * encrypted under a key derived from our cs secret and that name.
+ */
+ChatHistory::ChatHistory(QJsonObject *config, const QString &name)
+{
+	QFile		secret;
+	QByteArray	label, data;
+	QStringList	segments;
+	char		*cs_path;
+	u_int8_t	seed[LITANY_HISTORY_KEY_LEN];
+
+	PRECOND(config != NULL);
+
+	quit = false;
+	nodir = false;
+	index = NULL;
+	writer = NULL;
+	segment = 0;
+	records = 0;
+	log_size = 0;
+
+	written = 0;
+	commits = 0;
+	recovered = 0;
+	truncated = 0;
+
+	path = QStandardPaths::writableLocation(
+	    QStandardPaths::AppDataLocation) + "/history/" + name;
+
+	if (!QDir(path).mkpath(".")) {
+		nodir = true;
+		locked = false;
+		lock = NULL;
+		return;
+	}
+
+	lock = new QLockFile(path + "/lock");
+	if ((locked = lock->tryLock(0)) == false)
+		return;
+
+	cs_path = litany_json_string(config, "cs-path");
+	secret.setFileName(cs_path);
+	free(cs_path);
+
+	if (!secret.open(QFile::ReadOnly))
+		fatal("failed to open cs secret for history");
+
+	data = secret.readAll();
+	label = QString("LITANY.HISTORY.%1").arg(name).toUtf8();
+
+	if (data.isEmpty())
+		fatal("empty cs secret, cannot derive history key");
+
+	if (crypto_generichash(seed, sizeof(seed),
+	    (const u_int8_t *)data.constData(), data.size(), NULL, 0) == -1)
+		fatal("failed to hash cs secret");
+
+	if (crypto_generichash(key, sizeof(key),
+	    (const u_int8_t *)label.constData(), label.size(),
+	    seed, sizeof(seed)) == -1)
+		fatal("failed to derive history key");
+
+	label = QByteArray("LITANY.INDEX");
+	if (crypto_generichash(index_key, sizeof(index_key),
+	    (const u_int8_t *)label.constData(), label.size(),
+	    key, sizeof(key)) == -1)
+		fatal("failed to derive history index key");
+
+	sodium_memzero(seed, sizeof(seed));
+	sodium_memzero(data.data(), data.size());
+
+	index = new HistoryIndex(index_key);
+
+	segments = QDir(path).entryList(QStringList() << "*.log",
+	    QDir::Files, QDir::Name);
+
+	if (segments.isEmpty())
+		segment_open(1);
+	else
+		segment_open(segments.last().split(".")[0]
+		    .toULongLong(NULL, 16));
+
+	writer = QThread::create([this]() {
+		writer_run();
+	});
+
+	writer->setObjectName("history");
+	writer->start();
+}
+
+/*
+ * Let the writer commit whatever is still queued and close up.
+ */
+ChatHistory::~ChatHistory(void)
+{
+	if (writer != NULL) {
+		mtx.lock();
+		quit = true;
+		cond.wakeOne();
+		mtx.unlock();
+
+		writer->wait();
+		delete writer;
+
+		log.close();
+		idx.close();
+	}
+
+	delete index;
+
+	sodium_memzero(key, sizeof(key));
+	sodium_memzero(index_key, sizeof(index_key));
+
+	if (lock != NULL) {
+		if (locked)
+			lock->unlock();
+		delete lock;
+	}
+}
+
+/*
+ * Returns true if we are persisting messages for this chat.
+ */
+bool
+ChatHistory::active(void)
+{
+	return (writer != NULL);
+}
+
+/*
+ * Queue the given message for the writer.
+ */
+void
+ChatHistory::append(u_int64_t id, Qt::GlobalColor color, const char *msg)
+{
+	PRECOND(msg != NULL);
+
+	pending_queue(id, color, NULL, 0, msg, strlen(msg));
+}
+
+/*
+ * Queue text from the given peer for the writer, it is stored with
+ * its "<peer> " prefix like it is shown.
+ */
+void
+ChatHistory::append_text(u_int8_t peer, u_int64_t id, Qt::GlobalColor color,
+    const u_int8_t *text, size_t len)
+{
+	char		prefix[LITANY_CHAT_PREFIX_LEN];
+
+	PRECOND(text != NULL);
+
+	ChatModel::prefix(peer, prefix);
+	pending_queue(id, color, prefix, sizeof(prefix), text, len);
+}
+
+/*
+ * Copy the optional prefix and the message into a new record and hand
+ * it to the writer.
+ */
+void
+ChatHistory::pending_queue(u_int64_t id, Qt::GlobalColor color,
+    const char *prefix, size_t plen, const void *msg, size_t mlen)
+{
+	size_t				len;
+	struct litany_history_pending	*p;
+
+	PRECOND(msg != NULL);
+	PRECOND(prefix != NULL || plen == 0);
+
+	if (writer == NULL)
+		return;
+
+	len = plen + mlen;
+	if (len > LITANY_MESSAGE_LONG_MAX + 64)
+		fatal("%s: message too long (%zu)", __func__, len);
+
+	if ((p = (struct litany_history_pending *)calloc(1,
+	    sizeof(*p) + len)) == NULL)
+		fatal("calloc: failed to allocate history record");
+
+	p->len = len;
+	p->rec.id = htobe64(id);
+	p->rec.color = color;
+	p->rec.time = htobe64((u_int64_t)time(NULL));
+
+	if (plen > 0)
+		memcpy(p->text, prefix, plen);
+	memcpy(&p->text[plen], msg, mlen);
+
+	mtx.lock();
+	queue.append(p);
+	cond.wakeOne();
+	mtx.unlock();
+}
+
+/*
+ * Hand the last n messages in our history to cb, oldest first. We only
+ * look at the index and the records it points to, so this does not
+ * depend on the size of the history.
+ *
+ * This is safe to call while the writer runs, the index never points
+ * to records that are not completely on disk.
+ */
+void
+ChatHistory::tail(size_t n,
+    void (*cb)(const struct litany_history_msg *, void *), void *udata)
+{
+	int					pos;
+	QStringList				segments;
+	size_t					need;
+	QList<u_int8_t *>			bufs;
+	QList<struct litany_history_msg>	msgs;
+
+	PRECOND(cb != NULL);
+
+	if (writer == NULL || n == 0)
+		return;
+
+	need = n;
+	segments = QDir(path).entryList(QStringList() << "*.log",
+	    QDir::Files, QDir::Name);
+
+	for (pos = segments.size() - 1; pos >= 0 && need > 0; pos--) {
+		need -= segment_tail(segments.at(pos).split(".")[0]
+		    .toULongLong(NULL, 16), need, msgs, bufs);
+	}
+
+	for (const struct litany_history_msg &msg : msgs)
+		cb(&msg, udata);
+
+	for (u_int8_t *buf : bufs) {
+		sodium_memzero(buf, LITANY_HISTORY_RECORD_MAX);
+		free(buf);
+	}
+}
+
+/*
+ * Search our history for messages containing query, ignoring ascii
+ * case. The last max matches are handed to cb, oldest first.
+ *
+ * Returns false if the query is too short to search for.
+ */
+bool
+ChatHistory::search(const char *query, size_t max,
+    void (*cb)(const struct litany_history_msg *, void *), void *udata)
+{
+	int					pos;
+	QStringList				segments;
+	size_t					need, qlen, count;
+	QList<u_int8_t *>			bufs;
+	QList<struct litany_history_msg>	msgs;
+	u_int16_t				grams[LITANY_INDEX_QUERY_MAX];
+
+	PRECOND(query != NULL);
+	PRECOND(cb != NULL);
+	PRECOND(max > 0);
+
+	if (writer == NULL)
+		return (false);
+
+	qlen = strlen(query);
+	if ((count = index->grams(query, qlen, grams,
+	    LITANY_INDEX_QUERY_MAX)) == 0)
+		return (false);
+
+	need = max;
+	segments = QDir(path).entryList(QStringList() << "*.log",
+	    QDir::Files, QDir::Name);
+
+	for (pos = segments.size() - 1; pos >= 0 && need > 0; pos--) {
+		need -= segment_search(segments.at(pos).split(".")[0]
+		    .toULongLong(NULL, 16), grams, count, query, qlen,
+		    need, msgs, bufs);
+	}
+
+	for (const struct litany_history_msg &msg : msgs)
+		cb(&msg, udata);
+
+	for (u_int8_t *buf : bufs) {
+		sodium_memzero(buf, LITANY_HISTORY_RECORD_MAX);
+		free(buf);
+	}
+
+	return (true);
+}
+
+/*
+ * Format our statistics into the given buffer.
+ */
+void
+ChatHistory::stats(char *buf, size_t len)
+{
+	int		ret;
+	char		ibuf[128];
+
+	PRECOND(buf != NULL);
+	PRECOND(len > 0);
+
+	if (writer == NULL) {
+		ret = snprintf(buf, len, "not persisting (%s)",
+		    nodir ? "cannot create its directory" :
+		    "locked by another window");
+	} else {
+		mtx.lock();
+		ret = snprintf(buf, len,
+		    "segment %" PRIx64 ", %" PRIu64 " messages in %" PRIu64
+		    " commits, %" PRIu64 " recovered, %" PRIu64
+		    " bytes truncated, ", segment, written, commits,
+		    recovered, truncated);
+		mtx.unlock();
+
+		if (ret != -1 && (size_t)ret < len) {
+			index->stats(ibuf, sizeof(ibuf));
+			ret += snprintf(buf + ret, len - ret, "%s", ibuf);
+		}
+	}
+
+	if (ret == -1 || (size_t)ret >= len)
+		fatal("history stats did not fit");
+}
+
+/*
+ * The writer thread, it takes everything that was queued, writes it
+ * out and makes it durable with a single commit.
+ */
+void
+ChatHistory::writer_run(void)
+{
+	bool					done;
+	QList<struct litany_history_pending *>	batch;
+
+	index_build();
+
+	for (;;) {
+		mtx.lock();
+
+		while (queue.isEmpty() && !quit)
+			cond.wait(&mtx);
+
+		batch.swap(queue);
+		done = quit;
+
+		mtx.unlock();
+
+		if (batch.isEmpty()) {
+			if (done)
+				break;
+			continue;
+		}
+
+		for (struct litany_history_pending *p : batch)
+			segment_write(p);
+
+		segment_commit();
+
+		mtx.lock();
+		commits++;
+		written += batch.size();
+		mtx.unlock();
+
+		for (struct litany_history_pending *p : batch) {
+			sodium_memzero(p, sizeof(*p) + p->len);
+			free(p);
+		}
+
+		batch.clear();
+	}
+}
+
+/*
+ * Seal the trigram index for any older segment that does not have one
+ * and build the live postings for the current segment.
+ */
+void
+ChatHistory::index_build(void)
+{
+	u_int64_t	seg;
+	QStringList	segments;
+	HistoryIndex	*sealer;
+
+	segments = QDir(path).entryList(QStringList() << "*.log",
+	    QDir::Files, QDir::Name);
+
+	sealer = NULL;
+
+	for (const QString &name : segments) {
+		seg = name.split(".")[0].toULongLong(NULL, 16);
+		if (seg == segment || QFile::exists(segment_path(seg, "tix")))
+			continue;
+
+		if (sealer == NULL)
+			sealer = new HistoryIndex(index_key);
+
+		sealer->reset(seg, false);
+		segment_index(seg, sealer);
+		sealer->seal(segment_path(seg, "tix"), 0);
+	}
+
+	delete sealer;
+
+	index->reset(segment, false);
+	segment_index(segment, index);
+	index->ready(segment);
+}
+
+/*
+ * Add all records in the given segment to the given index.
+ */
+void
+ChatHistory::segment_index(u_int64_t seg, HistoryIndex *ix)
+{
+	size_t				rec;
+	u_int8_t			*out;
+	struct litany_history_msg	msg;
+	struct litany_history_view	view;
+
+	PRECOND(ix != NULL);
+
+	if (!view_open(seg, &view))
+		return;
+
+	for (rec = 0; rec < view.count; rec++) {
+		if ((out = view_record(&view, rec, &msg)) == NULL)
+			continue;
+
+		ix->add(rec, msg.text, msg.len);
+
+		sodium_memzero(out, LITANY_HISTORY_RECORD_MAX);
+		free(out);
+	}
+
+	view_close(&view);
+}
+
+/*
+ * Open the log and index for the given segment, creating them if
+ * required, and recover anything written after the last index entry.
+ */
+void
+ChatHistory::segment_open(u_int64_t seg)
+{
+	mtx.lock();
+	segment = seg;
+	mtx.unlock();
+
+	log.setFileName(segment_path(seg, "log"));
+	idx.setFileName(segment_path(seg, "idx"));
+
+	if (!log.open(QFile::ReadWrite))
+		fatal("failed to open %s", log.fileName().toUtf8().data());
+
+	if (!idx.open(QFile::ReadWrite))
+		fatal("failed to open %s", idx.fileName().toUtf8().data());
+
+	segment_recover();
+	records = idx.size() / sizeof(u_int64_t);
+
+	log.seek(log_size);
+	idx.seek(idx.size());
+}
+
+/*
+ * Walk the records after the last indexed one. Every record that
+ * authenticates is added to the index, anything from the first one
+ * that does not is cut off.
+ */
+void
+ChatHistory::segment_recover(void)
+{
+	u_int8_t		*map, *out;
+	u_int32_t		len;
+	u_int64_t		off, entry, size;
+
+	if (idx.size() % sizeof(entry) != 0) {
+		if (!idx.resize(idx.size() - (idx.size() % sizeof(entry))))
+			fatal("failed to truncate %s",
+			    idx.fileName().toUtf8().data());
+	}
+
+	off = 0;
+	size = log.size();
+
+	if (size == 0) {
+		log_size = 0;
+		return;
+	}
+
+	if ((map = log.map(0, size)) == NULL)
+		fatal("failed to map %s", log.fileName().toUtf8().data());
+
+	if (idx.size() > 0) {
+		idx.seek(idx.size() - sizeof(entry));
+		if (idx.read((char *)&entry, sizeof(entry)) != sizeof(entry))
+			fatal("failed to read %s",
+			    idx.fileName().toUtf8().data());
+
+		off = be64toh(entry);
+		if (off + HISTORY_RECORD_HDR > size)
+			fatal("%s: index points past the log", __func__);
+
+		memcpy(&len, &map[off], sizeof(len));
+		off += HISTORY_RECORD_HDR + be32toh(len);
+
+		if (off > size)
+			fatal("%s: last indexed record is cut off", __func__);
+	}
+
+	if ((out = (u_int8_t *)malloc(LITANY_HISTORY_RECORD_MAX)) == NULL)
+		fatal("malloc: failed to allocate recovery buffer");
+
+	idx.seek(idx.size());
+
+	while (off < size) {
+		if (!record_open(segment, off,
+		    &map[off], size - off, out, NULL))
+			break;
+
+		entry = htobe64(off);
+		if (idx.write((const char *)&entry,
+		    sizeof(entry)) != sizeof(entry))
+			fatal("failed to write %s",
+			    idx.fileName().toUtf8().data());
+
+		memcpy(&len, &map[off], sizeof(len));
+		off += HISTORY_RECORD_HDR + be32toh(len);
+
+		recovered++;
+	}
+
+	sodium_memzero(out, LITANY_HISTORY_RECORD_MAX);
+	free(out);
+
+	log.unmap(map);
+
+	if (off < size) {
+		truncated += size - off;
+		if (!log.resize(off))
+			fatal("failed to truncate %s",
+			    log.fileName().toUtf8().data());
+		history_sync(&log);
+	}
+
+	history_sync(&idx);
+	log_size = off;
+}
+
+/*
+ * Encrypt the given message and append it to the current segment,
+ * moving on to a new segment when the current one is full.
+ */
+void
+ChatHistory::segment_write(struct litany_history_pending *p)
+{
+	u_int32_t		len;
+	unsigned long long	clen;
+	u_int8_t		ad[16];
+	u_int8_t		nonce[LITANY_HISTORY_NONCE_LEN];
+	u_int8_t		ct[LITANY_HISTORY_RECORD_MAX];
+
+	PRECOND(p != NULL);
+
+	if (log_size >= LITANY_HISTORY_SEGMENT_MAX || index->full()) {
+		segment_commit();
+		index->seal(segment_path(segment, "tix"), segment + 1);
+
+		log.close();
+		idx.close();
+
+		segment_open(segment + 1);
+	}
+
+	/* The record and text are contiguous in p. */
+	randombytes_buf(nonce, sizeof(nonce));
+	history_ad(ad, segment, log_size);
+
+	if (crypto_aead_xchacha20poly1305_ietf_encrypt(ct, &clen,
+	    (const u_int8_t *)&p->rec, sizeof(p->rec) + p->len,
+	    ad, sizeof(ad), NULL, nonce, key) == -1)
+		fatal("failed to encrypt history record");
+
+	len = htobe32(clen);
+
+	if (log.write((const char *)&len, sizeof(len)) != sizeof(len) ||
+	    log.write((const char *)nonce, sizeof(nonce)) != sizeof(nonce) ||
+	    log.write((const char *)ct, clen) != (qint64)clen)
+		fatal("failed to write %s", log.fileName().toUtf8().data());
+
+	index->add(records++, p->text, p->len);
+
+	idx_pending.append(log_size);
+	log_size += HISTORY_RECORD_HDR + clen;
+}
+
+/*
+ * Make everything we wrote durable, the log first and the index after
+ * so that the index never points to records that are not on disk.
+ */
+void
+ChatHistory::segment_commit(void)
+{
+	u_int64_t	entry;
+
+	if (idx_pending.isEmpty())
+		return;
+
+	history_sync(&log);
+
+	for (u_int64_t off : idx_pending) {
+		entry = htobe64(off);
+		if (idx.write((const char *)&entry,
+		    sizeof(entry)) != sizeof(entry))
+			fatal("failed to write %s",
+			    idx.fileName().toUtf8().data());
+	}
+
+	history_sync(&idx);
+	idx_pending.clear();
+}
+
+/*
+ * Read up to need of the last records from the given segment, these
+ * are prepended to msgs so it stays in order. The decrypted records
+ * are placed in bufs for the caller to wipe.
+ *
+ * Returns the number of records we looked at.
+ */
+size_t
+ChatHistory::segment_tail(u_int64_t seg, size_t need,
+    QList<struct litany_history_msg> &msgs, QList<u_int8_t *> &bufs)
+{
+	u_int8_t			*out;
+	size_t				first, pos;
+	struct litany_history_msg	msg;
+	struct litany_history_view	view;
+
+	if (!view_open(seg, &view))
+		return (0);
+
+	first = view.count > need ? view.count - need : 0;
+
+	for (pos = view.count; pos > first; pos--) {
+		if ((out = view_record(&view, pos - 1, &msg)) == NULL)
+			continue;
+
+		msgs.prepend(msg);
+		bufs.append(out);
+	}
+
+	view_close(&view);
+
+	return (view.count - first);
+}
+
+/*
+ * Search the given segment for query, using the trigram index to find
+ * the candidate records. If the segment has no usable index all of its
+ * records are candidates. Matches are prepended to msgs and their
+ * buffers placed in bufs for the caller to wipe.
+ *
+ * Returns the number of matches, at most need.
+ */
+size_t
+ChatHistory::segment_search(u_int64_t seg, const u_int16_t *grams,
+    size_t count, const char *query, size_t qlen, size_t need,
+    QList<struct litany_history_msg> &msgs, QList<u_int8_t *> &bufs)
+{
+	u_int8_t			*out;
+	qsizetype			pos;
+	size_t				found, rec;
+	QList<u_int32_t>		cand;
+	struct litany_history_msg	msg;
+	struct litany_history_view	view;
+
+	PRECOND(grams != NULL);
+	PRECOND(query != NULL);
+
+	if (!view_open(seg, &view))
+		return (0);
+
+	if (!index->lookup(seg, grams, count, cand) &&
+	    !HistoryIndex::lookup_file(segment_path(seg, "tix"),
+	    grams, count, cand)) {
+		cand.clear();
+		for (rec = 0; rec < view.count; rec++)
+			cand.append(rec);
+	}
+
+	found = 0;
+
+	for (pos = cand.size() - 1; pos >= 0 && found < need; pos--) {
+		if ((out = view_record(&view, cand[pos], &msg)) == NULL)
+			continue;
+
+		if (!HistoryIndex::match(msg.text, msg.len, query, qlen)) {
+			sodium_memzero(out, LITANY_HISTORY_RECORD_MAX);
+			free(out);
+			continue;
+		}
+
+		msgs.prepend(msg);
+		bufs.append(out);
+		found++;
+	}
+
+	view_close(&view);
+
+	return (found);
+}
+
+/*
+ * Map the log and index of the given segment for reading, only the
+ * entries that are in the index at this point are visible.
+ *
+ * Returns false if the segment has no records.
+ */
+bool
+ChatHistory::view_open(u_int64_t seg, struct litany_history_view *view)
+{
+	PRECOND(view != NULL);
+
+	view->segment = seg;
+	view->lmap = NULL;
+	view->xmap = NULL;
+
+	view->log.setFileName(segment_path(seg, "log"));
+	view->idx.setFileName(segment_path(seg, "idx"));
+
+	if (!view->log.open(QFile::ReadOnly) ||
+	    !view->idx.open(QFile::ReadOnly))
+		return (false);
+
+	view->lsize = view->log.size();
+	view->count = view->idx.size() / sizeof(u_int64_t);
+
+	if (view->count == 0 || view->lsize == 0)
+		return (false);
+
+	if ((view->xmap = view->idx.map(0,
+	    view->count * sizeof(u_int64_t))) == NULL)
+		fatal("failed to map %s",
+		    view->idx.fileName().toUtf8().data());
+
+	if ((view->lmap = view->log.map(0, view->lsize)) == NULL)
+		fatal("failed to map %s",
+		    view->log.fileName().toUtf8().data());
+
+	return (true);
+}
+
+/*
+ * Unmap the files of the given view.
+ */
+void
+ChatHistory::view_close(struct litany_history_view *view)
+{
+	PRECOND(view != NULL);
+
+	if (view->lmap != NULL)
+		view->log.unmap((uchar *)view->lmap);
+
+	if (view->xmap != NULL)
+		view->idx.unmap((uchar *)view->xmap);
+
+	view->log.close();
+	view->idx.close();
+}
+
+/*
+ * Decrypt record rec from the given view into msg. Returns the buffer
+ * msg points into, the caller must wipe and free it, or NULL if the
+ * record could not be read.
+ */
+u_int8_t *
+ChatHistory::view_record(struct litany_history_view *view, size_t rec,
+    struct litany_history_msg *msg)
+{
+	u_int8_t			*out;
+	size_t				outlen;
+	struct litany_history_rec	hdr;
+	u_int64_t			entry;
+
+	PRECOND(view != NULL);
+	PRECOND(msg != NULL);
+
+	if (rec >= view->count)
+		return (NULL);
+
+	memcpy(&entry, &view->xmap[rec * sizeof(entry)], sizeof(entry));
+	entry = be64toh(entry);
+
+	if (entry >= view->lsize)
+		return (NULL);
+
+	if ((out = (u_int8_t *)malloc(LITANY_HISTORY_RECORD_MAX)) == NULL)
+		fatal("malloc: failed to allocate history buffer");
+
+	if (!record_open(view->segment, entry, &view->lmap[entry],
+	    view->lsize - entry, out, &outlen)) {
+		free(out);
+		return (NULL);
+	}
+
+	memcpy(&hdr, out, sizeof(hdr));
+
+	msg->id = be64toh(hdr.id);
+	msg->time = be64toh(hdr.time);
+	msg->color = (Qt::GlobalColor)hdr.color;
+	msg->text = (const char *)&out[sizeof(hdr)];
+	msg->len = outlen - sizeof(hdr);
+
+	return (out);
+}
+
+/*
+ * Authenticate and decrypt the record at off in the given segment,
+ * data points to it and has avail bytes. The plaintext is written
+ * to out which must hold LITANY_HISTORY_RECORD_MAX bytes.
+ */
+bool
+ChatHistory::record_open(u_int64_t seg, u_int64_t off, const u_int8_t *data,
+    size_t avail, u_int8_t *out, size_t *outlen)
+{
+	u_int32_t		len;
+	unsigned long long	plen;
+	u_int8_t		ad[16];
+
+	PRECOND(data != NULL);
+	PRECOND(out != NULL);
+
+	if (avail < HISTORY_RECORD_HDR)
+		return (false);
+
+	memcpy(&len, data, sizeof(len));
+	len = be32toh(len);
+
+	if (len < sizeof(struct litany_history_rec) + LITANY_HISTORY_TAG_LEN ||
+	    len > LITANY_HISTORY_RECORD_MAX ||
+	    len > avail - HISTORY_RECORD_HDR)
+		return (false);
+
+	history_ad(ad, seg, off);
+
+	if (crypto_aead_xchacha20poly1305_ietf_decrypt(out, &plen, NULL,
+	    &data[HISTORY_RECORD_HDR], len, ad, sizeof(ad),
+	    &data[sizeof(len)], key) == -1)
+		return (false);
+
+	if (outlen != NULL)
+		*outlen = plen;
+
+	return (true);
+}
+
+/*
+ * Returns the path to the given file of a segment.
+ */
+QString
+ChatHistory::segment_path(u_int64_t seg, const char *ext)
+{
+	return (QString("%1/%2.%3").arg(path)
+	    .arg(seg, 16, 16, QLatin1Char('0')).arg(ext));
+}
+
+/*
+ * Flush the given file and make sure it hits the disk.
+ */
+static void
+history_sync(QFile *file)
+{
+	int		ret;
+
+	PRECOND(file != NULL);
+
+	if (!file->flush())
+		fatal("failed to flush %s", file->fileName().toUtf8().data());
+
+#if defined(PLATFORM_WINDOWS)
+	ret = _commit(file->handle());
+#else
+	ret = fsync(file->handle());
+#endif
+
+	if (ret == -1)
+		fatal("failed to sync %s", file->fileName().toUtf8().data());
+}
+
+/*
+ * The additional data for a record, its segment and offset.
+ */
+static void
+history_ad(u_int8_t *ad, u_int64_t seg, u_int64_t off)
+{
+	PRECOND(ad != NULL);
+
+	seg = htobe64(seg);
+	off = htobe64(off);
+
+	memcpy(ad, &seg, sizeof(seg));
+	memcpy(&ad[sizeof(seg)], &off, sizeof(off));
+}
@@ -0,0 +1,534 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <QFile>
+
+#if defined(PLATFORM_WINDOWS)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <inttypes.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "litany.h"
+#include "index.h"
+
+/* The size of the offsets in front of the postings in a .tix file. */
+#define INDEX_HDR_LEN	((LITANY_INDEX_BUCKETS + 1) * sizeof(u_int32_t))
+
+static u_int8_t	index_lower(char);
+static void	index_order(size_t *, const size_t *, size_t);
+
+/*
+ * Create an empty index, trigrams are hashed under the given key.
+ */
+HistoryIndex::HistoryIndex(const u_int8_t *k)
+{
+	PRECOND(k != NULL);
+
+	memcpy(key, k, sizeof(key));
+
+	segment = 0;
+	complete = false;
+
+	sealed = 0;
+	postings = 0;
+	live = new QList<u_int32_t>[LITANY_INDEX_BUCKETS];
+}
+
+/*
+ * Release the live postings and wipe our key.
+ */
+HistoryIndex::~HistoryIndex(void)
+{
+	delete [] live;
+	sodium_memzero(key, sizeof(key));
+}
+
+/*
+ * Returns true if the live postings reached their limit and the
+ * segment should be closed.
+ */
+bool
+HistoryIndex::full(void)
+{
+	bool		ret;
+
+	mtx.lock();
+	ret = postings >= LITANY_INDEX_LIVE_MAX;
+	mtx.unlock();
+
+	return (ret);
+}
+
+/*
+ * Drop the live postings and start over for the given segment. The
+ * postings are only used for lookups once they are complete.
+ */
+void
+HistoryIndex::reset(u_int64_t seg, bool done)
+{
+	size_t		idx;
+
+	mtx.lock();
+
+	for (idx = 0; idx < LITANY_INDEX_BUCKETS; idx++)
+		live[idx].clear();
+
+	postings = 0;
+	segment = seg;
+	complete = done;
+
+	mtx.unlock();
+}
+
+/*
+ * Mark the live postings for the given segment as complete.
+ */
+void
+HistoryIndex::ready(u_int64_t seg)
+{
+	mtx.lock();
+
+	if (segment == seg)
+		complete = true;
+
+	mtx.unlock();
+}
+
+/*
+ * Add the trigrams of the given text for record rec, records are
+ * added in ascending order so the postings stay sorted.
+ */
+void
+HistoryIndex::add(u_int32_t rec, const char *text, size_t len)
+{
+	size_t		idx;
+	u_int16_t	b;
+	u_int8_t	tri[3];
+
+	PRECOND(text != NULL);
+
+	if (len < sizeof(tri))
+		return;
+
+	mtx.lock();
+
+	for (idx = 0; idx + sizeof(tri) <= len; idx++) {
+		tri[0] = index_lower(text[idx]);
+		tri[1] = index_lower(text[idx + 1]);
+		tri[2] = index_lower(text[idx + 2]);
+
+		b = bucket(tri);
+
+		if (!live[b].isEmpty() && live[b].last() == rec)
+			continue;
+
+		live[b].append(rec);
+		postings++;
+	}
+
+	mtx.unlock();
+}
+
+/*
+ * Turn the given query into its distinct buckets, returns the number
+ * of buckets written to out or 0 if the query is too short.
+ */
+size_t
+HistoryIndex::grams(const char *query, size_t len, u_int16_t *out,
+    size_t max)
+{
+	u_int16_t	b;
+	size_t		idx, pos, count;
+	u_int8_t	tri[3];
+
+	PRECOND(query != NULL);
+	PRECOND(out != NULL);
+	PRECOND(max > 0);
+
+	count = 0;
+
+	for (idx = 0; idx + sizeof(tri) <= len && count < max; idx++) {
+		tri[0] = index_lower(query[idx]);
+		tri[1] = index_lower(query[idx + 1]);
+		tri[2] = index_lower(query[idx + 2]);
+
+		b = bucket(tri);
+
+		for (pos = 0; pos < count; pos++) {
+			if (out[pos] == b)
+				break;
+		}
+
+		if (pos == count)
+			out[count++] = b;
+	}
+
+	return (count);
+}
+
+/*
+ * Look up the candidates for the given buckets in the live postings.
+ * Returns false if we do not hold complete postings for the segment.
+ *
+ * We start from the shortest postings and intersect the rest with it,
+ * so common trigrams cost little.
+ */
+bool
+HistoryIndex::lookup(u_int64_t seg, const u_int16_t *b, size_t count,
+    QList<u_int32_t> &out)
+{
+	size_t		idx;
+	size_t		lens[LITANY_INDEX_QUERY_MAX];
+	size_t		order[LITANY_INDEX_QUERY_MAX];
+
+	PRECOND(b != NULL);
+	PRECOND(count > 0 && count <= LITANY_INDEX_QUERY_MAX);
+
+	mtx.lock();
+
+	if (segment != seg || !complete) {
+		mtx.unlock();
+		return (false);
+	}
+
+	for (idx = 0; idx < count; idx++)
+		lens[idx] = live[b[idx]].size();
+
+	index_order(order, lens, count);
+
+	out = live[b[order[0]]];
+	for (idx = 1; idx < count && !out.isEmpty(); idx++)
+		intersect(out, live[b[order[idx]]]);
+
+	mtx.unlock();
+
+	return (true);
+}
+
+/*
+ * Look up the candidates for the given buckets in a sealed .tix file.
+ * Returns false if there is no usable file at the given path.
+ *
+ * Only the shortest postings are copied out, the candidates are then
+ * looked up in the other postings in place.
+ */
+bool
+HistoryIndex::lookup_file(const QString &path, const u_int16_t *b,
+    size_t count, QList<u_int32_t> &out)
+{
+	QFile			file;
+	const u_int8_t		*map, *list;
+	qsizetype		pos, keep;
+	size_t			idx, lo, hi, mid;
+	u_int32_t		val, start[LITANY_INDEX_QUERY_MAX];
+	size_t			lens[LITANY_INDEX_QUERY_MAX];
+	size_t			order[LITANY_INDEX_QUERY_MAX];
+
+	PRECOND(b != NULL);
+	PRECOND(count > 0 && count <= LITANY_INDEX_QUERY_MAX);
+
+	file.setFileName(path);
+
+	if (!file.open(QFile::ReadOnly))
+		return (false);
+
+	if ((size_t)file.size() < INDEX_HDR_LEN)
+		return (false);
+
+	if ((map = file.map(0, file.size())) == NULL)
+		return (false);
+
+	for (idx = 0; idx < count; idx++) {
+		memcpy(&start[idx], &map[b[idx] * sizeof(val)], sizeof(val));
+		memcpy(&val, &map[(b[idx] + 1) * sizeof(val)], sizeof(val));
+
+		start[idx] = be32toh(start[idx]);
+		val = be32toh(val);
+
+		if (start[idx] > val || INDEX_HDR_LEN + (u_int64_t)val *
+		    sizeof(val) > (u_int64_t)file.size()) {
+			file.unmap((uchar *)map);
+			return (false);
+		}
+
+		lens[idx] = val - start[idx];
+	}
+
+	index_order(order, lens, count);
+
+	out.clear();
+
+	list = &map[INDEX_HDR_LEN + start[order[0]] * sizeof(val)];
+	for (lo = 0; lo < lens[order[0]]; lo++) {
+		memcpy(&val, &list[lo * sizeof(val)], sizeof(val));
+		out.append(be32toh(val));
+	}
+
+	for (idx = 1; idx < count && !out.isEmpty(); idx++) {
+		list = &map[INDEX_HDR_LEN + start[order[idx]] * sizeof(val)];
+
+		keep = 0;
+		hi = lens[order[idx]];
+
+		/* Close in size, walk both instead of searching. */
+		if ((size_t)out.size() * 16 >= hi) {
+			lo = 0;
+			for (pos = 0; pos < out.size() && lo < hi; pos++) {
+				do {
+					memcpy(&val, &list[lo * sizeof(val)],
+					    sizeof(val));
+					val = be32toh(val);
+				} while (val < out[pos] && ++lo < hi);
+
+				if (lo < hi && val == out[pos])
+					out[keep++] = out[pos];
+			}
+
+			out.resize(keep);
+			continue;
+		}
+
+		for (pos = 0; pos < out.size(); pos++) {
+			lo = 0;
+			hi = lens[order[idx]];
+
+			while (lo < hi) {
+				mid = lo + (hi - lo) / 2;
+				memcpy(&val, &list[mid * sizeof(val)],
+				    sizeof(val));
+				if (be32toh(val) < out[pos])
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			if (lo == lens[order[idx]])
+				continue;
+
+			memcpy(&val, &list[lo * sizeof(val)], sizeof(val));
+			if (be32toh(val) == out[pos])
+				out[keep++] = out[pos];
+		}
+
+		out.resize(keep);
+	}
+
+	file.unmap((uchar *)map);
+
+	return (true);
+}
+
+/*
+ * Write the live postings to a .tix file at the given path and start
+ * over with empty postings for the next segment.
+ *
+ * The file is written under a temporary name and renamed once it is
+ * on disk so a crash never leaves a partial file behind.
+ */
+void
+HistoryIndex::seal(const QString &path, u_int64_t next)
+{
+	QFile		file;
+	int		ret;
+	size_t		idx;
+	u_int32_t	off, val;
+
+	file.setFileName(path + ".tmp");
+	if (!file.open(QFile::WriteOnly | QFile::Truncate))
+		fatal("failed to open %s", file.fileName().toUtf8().data());
+
+	mtx.lock();
+
+	off = 0;
+	for (idx = 0; idx <= LITANY_INDEX_BUCKETS; idx++) {
+		val = htobe32(off);
+		if (file.write((const char *)&val, sizeof(val)) != sizeof(val))
+			fatal("failed to write %s",
+			    file.fileName().toUtf8().data());
+
+		if (idx < LITANY_INDEX_BUCKETS)
+			off += live[idx].size();
+	}
+
+	for (idx = 0; idx < LITANY_INDEX_BUCKETS; idx++) {
+		for (u_int32_t rec : live[idx]) {
+			val = htobe32(rec);
+			if (file.write((const char *)&val,
+			    sizeof(val)) != sizeof(val))
+				fatal("failed to write %s",
+				    file.fileName().toUtf8().data());
+		}
+	}
+
+	sealed++;
+
+	mtx.unlock();
+
+	if (!file.flush())
+		fatal("failed to flush %s", file.fileName().toUtf8().data());
+
+#if defined(PLATFORM_WINDOWS)
+	ret = _commit(file.handle());
+#else
+	ret = fsync(file.handle());
+#endif
+
+	if (ret == -1)
+		fatal("failed to sync %s", file.fileName().toUtf8().data());
+
+	file.close();
+
+	QFile::remove(path);
+	if (!file.rename(path))
+		fatal("failed to rename %s", file.fileName().toUtf8().data());
+
+	reset(next, true);
+}
+
+/*
+ * Format our statistics into the given buffer.
+ */
+void
+HistoryIndex::stats(char *buf, size_t len)
+{
+	int		ret;
+
+	PRECOND(buf != NULL);
+	PRECOND(len > 0);
+
+	mtx.lock();
+	ret = snprintf(buf, len, "%" PRIu64 " live postings (%s), %" PRIu64
+	    " segments sealed", postings, complete ? "complete" : "building",
+	    sealed);
+	mtx.unlock();
+
+	if (ret == -1 || (size_t)ret >= len)
+		fatal("index stats did not fit");
+}
+
+/*
+ * Returns true if query occurs in text, ignoring ascii case like our
+ * trigrams do.
+ */
+bool
+HistoryIndex::match(const char *text, size_t len, const char *query,
+    size_t qlen)
+{
+	size_t		idx, pos;
+
+	PRECOND(text != NULL);
+	PRECOND(query != NULL);
+
+	if (qlen == 0 || qlen > len)
+		return (false);
+
+	for (idx = 0; idx + qlen <= len; idx++) {
+		for (pos = 0; pos < qlen; pos++) {
+			if (index_lower(text[idx + pos]) !=
+			    index_lower(query[pos]))
+				break;
+		}
+
+		if (pos == qlen)
+			return (true);
+	}
+
+	return (false);
+}
+
+/*
+ * Returns the bucket for the given trigram.
+ */
+u_int16_t
+HistoryIndex::bucket(const u_int8_t *tri)
+{
+	u_int8_t	hash[crypto_shorthash_BYTES];
+
+	PRECOND(tri != NULL);
+
+	crypto_shorthash(hash, tri, 3, key);
+
+	return (hash[0] | (hash[1] << 8));
+}
+
+/*
+ * Only keep the elements of acc that are also in list, both are
+ * sorted in ascending order.
+ */
+void
+HistoryIndex::intersect(QList<u_int32_t> &acc, const QList<u_int32_t> &list)
+{
+	qsizetype	a, b, n;
+
+	a = 0;
+	b = 0;
+	n = 0;
+
+	while (a < acc.size() && b < list.size()) {
+		if (acc[a] < list[b]) {
+			a++;
+		} else if (acc[a] > list[b]) {
+			b++;
+		} else {
+			acc[n++] = acc[a];
+			a++;
+			b++;
+		}
+	}
+
+	acc.resize(n);
+}
+
+/*
+ * Lowercase the given character if it is ascii, multibyte utf8 is
+ * left alone.
+ */
+static u_int8_t
+index_lower(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return (c + ('a' - 'A'));
+
+	return ((u_int8_t)c);
+}
+
+/*
+ * Fill order with the positions in lens sorted by ascending length.
+ */
+static void
+index_order(size_t *order, const size_t *lens, size_t count)
+{
+	size_t		idx, pos, tmp;
+
+	PRECOND(order != NULL);
+	PRECOND(lens != NULL);
+
+	for (idx = 0; idx < count; idx++) {
+		order[idx] = idx;
+		for (pos = idx; pos > 0 &&
+		    lens[order[pos]] < lens[order[pos - 1]]; pos--) {
+			tmp = order[pos];
+			order[pos] = order[pos - 1];
+			order[pos - 1] = tmp;
+		}
+	}
+}
@@ -20,6 +20,7 @@
 
 #include "litany.h"
 
+static void	liturgy_notify(void *);
 static void	kyrka_event(KYRKA *, union kyrka_event *, void *);
 static void	cathedral_send(const void *, size_t, u_int64_t, void *);
 
@@ -62,20 +63,65 @@ LiturgyInterface::peer_set_notification(u_int8_t id, int state)
  */
 Liturgy::Liturgy(LiturgyInterface *parent, QJsonObject *config,
     int mode, u_int16_t group)
+    : LitanyWorker(mode == LITURGY_MODE_SIGNAL ?
+    "liturgy-signal" : "liturgy-discovery")
+{
+	QJsonObject		copy;
+
+	PRECOND(parent != NULL);
+	PRECOND(config != NULL);
+	PRECOND(mode == LITURGY_MODE_DISCOVERY || mode == LITURGY_MODE_SIGNAL);
+
+	copy = *config;
+	runmode = mode;
+	owner = parent;
+
+	kyrka = NULL;
+	socket = NULL;
+	memset(signaling, 0, sizeof(signaling));
+
+	post([this, copy, group]() mutable {
+		setup(&copy, group);
+	});
+}
+
+/*
+ * Cleanup any and all resources on our thread, before stopping it.
+ */
+Liturgy::~Liturgy(void)
+{
+	post_wait([this]() {
+		timers->timer_cancel(&notify);
+
+		socket->detach(this);
+		delete socket;
+
+		kyrka_ctx_free(kyrka);
+	});
+
+	stop();
+}
+
+/*
+ * Called on our thread to create our socket and libkyrka context
+ * and start sending our liturgy.
+ */
+void
+Liturgy::setup(QJsonObject *config, u_int16_t group)
 {
 	bool					ok;
 	struct kyrka_cathedral_cfg		cfg;
 	QJsonValue				val;
 	char					*path;
 
-	PRECOND(parent != NULL);
 	PRECOND(config != NULL);
-	PRECOND(mode == LITURGY_MODE_DISCOVERY || mode == LITURGY_MODE_SIGNAL);
 
 	if ((kyrka = kyrka_ctx_alloc(kyrka_event, this)) == NULL)
 		fatal("failed to create kyrka event");
 
 	memset(&cfg, 0, sizeof(cfg));
+	socket = new LitanySocket();
+	socket->attach(this);
 
 	cfg.udata = this;
 	cfg.send = cathedral_send;
@@ -94,7 +140,7 @@ Liturgy::Liturgy(LiturgyInterface *parent, QJsonObject *config,
 	} else {
 		cfg.flock_src |= litany_json_number(config,
 		    "flock-domain", UCHAR_MAX);
-		if (mode == LITURGY_MODE_DISCOVERY)
+		if (runmode == LITURGY_MODE_DISCOVERY)
 			cfg.group = USHRT_MAX;
 	}
 
@@ -119,27 +165,9 @@ Liturgy::Liturgy(LiturgyInterface *parent, QJsonObject *config,
 		fatal("kyrka_cathedral_config: %d", kyrka_last_error(kyrka));
 
 	free(path);
-	runmode = mode;
-	owner = parent;
-
-	memset(signaling, 0, sizeof(signaling));
-
-	socket.bind(QHostAddress::AnyIPv4);
-	notify.setInterval(2500);
-
-	connect(&notify, &QTimer::timeout, this, &Liturgy::liturgy_send);
-	connect(&socket, &QUdpSocket::readyRead, this, &Liturgy::packet_read);
 
+	TimerWheel::timer_init(&notify, liturgy_notify, this);
 	liturgy_send();
-	notify.start();
-}
-
-/*
- * Cleanup any and all resources.
- */
-Liturgy::~Liturgy(void)
-{
-	kyrka_ctx_free(kyrka);
 }
 
 /*
@@ -151,12 +179,14 @@ Liturgy::signaling_state(u_int8_t peer, int onoff)
 	PRECOND(runmode == LITURGY_MODE_SIGNAL);
 	PRECOND(onoff == 0 || onoff == 1);
 
-	signaling[peer] = onoff;
+	post([this, peer, onoff]() {
+		signaling[peer] = onoff;
+	});
 }
 
 /*
- * Callback for our notify QTimer that fires every few seconds. From here
- * we trigger the sending of a cathedral liturgy packet.
+ * Called every few seconds from our timer. From here we trigger the
+ * sending of a cathedral liturgy packet.
  */
 void
 Liturgy::liturgy_send(void)
@@ -174,26 +204,30 @@ Liturgy::liturgy_send(void)
 
 	if (kyrka_cathedral_liturgy(kyrka, ptr, len) == -1)
 		fatal("kyrka_cathedral_liturgy: %d", kyrka_last_error(kyrka));
+
+	timers->timer_add(&notify, LITURGY_NOTIFY_INTERVAL);
 }
 
 /*
- * Qt calls this when a packet can be read from the underlying udp socket.
- * We read it and feed it into libkyrka which will handle the rest.
+ * Our socket calls this for each datagram it read, we feed it
+ * into libkyrka which will handle the rest.
  */
-void
-Liturgy::packet_read(void)
+int
+Liturgy::packet_read(const void *packet, size_t len, bool broadcast)
 {
-	qint64		len;
-	char		packet[1500];
+	PRECOND(packet != NULL);
 
-	if ((len = socket.readDatagram(packet, sizeof(packet))) == -1) {
-		printf("failed to read packet: %d\n", socket.error());
-		return;
+	if (kyrka_purgatory_input(kyrka, packet, len) == -1) {
+		if (broadcast)
+			return (-1);
+
+		if (kyrka_last_error(kyrka) != KYRKA_ERROR_NO_RX_KEY) {
+			fatal("kyrka_purgatory_input: %d",
+			    kyrka_last_error(kyrka));
+		}
 	}
 
-	if (kyrka_purgatory_input(kyrka, packet, len) == -1 &&
-	    kyrka_last_error(kyrka) != KYRKA_ERROR_NO_RX_KEY)
-		fatal("kyrka_purgatory_input: %d", kyrka_last_error(kyrka));
+	return (0);
 }
 
 /*
@@ -202,18 +236,51 @@ Liturgy::packet_read(void)
 void
 Liturgy::socket_send(const void *data, size_t len)
 {
-	if (socket.writeDatagram((const char *)data, len, address, port) == -1)
-		printf("failed to write to cathedral: %d\n", socket.error());
+	socket->send(data, len, address, port);
+}
+
+/*
+ * Format the statistics of our socket into the given buffer, the
+ * socket is only touched on our thread so we wait for it there.
+ */
+void
+Liturgy::stats(char *buf, size_t len)
+{
+	PRECOND(buf != NULL);
+
+	post_wait([this, buf, len]() {
+		socket->stats(buf, len);
+	});
 }
 
 /*
- * Called when a new libkyrka event triggers.
+ * Called on the GUI thread with the peer states from a liturgy we
+ * received, these are handed to our owner.
+ */
+void
+Liturgy::event_dispatch(struct litany_event *evt)
+{
+	u_int8_t		idx;
+
+	PRECOND(evt != NULL);
+	PRECOND(evt->type == LITANY_EVENT_LITURGY);
+	PRECOND(evt->len == KYRKA_PEERS_PER_FLOCK);
+
+	for (idx = 1; idx < KYRKA_PEERS_PER_FLOCK; idx++) {
+		if (runmode == LITURGY_MODE_DISCOVERY)
+			owner->peer_set_state(idx, evt->data[idx]);
+		else
+			owner->peer_set_notification(idx, evt->data[idx]);
+	}
+}
+
+/*
+ * Called when a new libkyrka event triggers, the peer states from
+ * a liturgy are sent to the GUI thread in one go.
  */
 static void
 kyrka_event(KYRKA *ctx, union kyrka_event *evt, void *udata)
 {
-	u_int8_t		idx;
-	LiturgyInterface	*owner;
 	Liturgy			*liturgy;
 
 	PRECOND(ctx != NULL);
@@ -221,21 +288,11 @@ kyrka_event(KYRKA *ctx, union kyrka_event *evt, void *udata)
 	PRECOND(udata != NULL);
 
 	liturgy = (Liturgy *)udata;
-	owner = (LiturgyInterface *)liturgy->owner;
 
 	switch (evt->type) {
 	case KYRKA_EVENT_LITURGY_RECEIVED:
-		if (liturgy->runmode == LITURGY_MODE_DISCOVERY) {
-			for (idx = 1; idx < KYRKA_PEERS_PER_FLOCK; idx++) {
-				owner->peer_set_state(idx,
-				    evt->liturgy.peers[idx]);
-			}
-		} else {
-			for (idx = 1; idx < KYRKA_PEERS_PER_FLOCK; idx++) {
-				owner->peer_set_notification(idx,
-				    evt->liturgy.peers[idx]);
-			}
-		}
+		liturgy->event_send(LITANY_EVENT_LITURGY, 0, 0, Qt::white,
+		    evt->liturgy.peers, KYRKA_PEERS_PER_FLOCK);
 		break;
 	default:
 		printf("got a libkyrka event %u\n", evt->type);
@@ -243,6 +300,20 @@ kyrka_event(KYRKA *ctx, union kyrka_event *evt, void *udata)
 	}
 }
 
+/*
+ * The timer wheel callback for our liturgy.
+ */
+static void
+liturgy_notify(void *arg)
+{
+	Liturgy		*liturgy;
+
+	PRECOND(arg != NULL);
+
+	liturgy = (Liturgy *)arg;
+	liturgy->liturgy_send();
+}
+
 /*
  * Called when libkyrka wants to send a cathedral message.
  */
@@ -16,6 +16,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <QFile>
@@ -31,6 +32,12 @@ static QJsonObject		*config_load(void);
 /* The global application. */
 QApplication	*app = NULL;
 
+/*
+ * The timer wheel for the calling thread, the GUI thread and every
+ * tunnel shard run their own.
+ */
+thread_local TimerWheel	*wheel = NULL;
+
 /*
  * The path to the given configuration file (-c) if any.
  */
@@ -46,6 +53,7 @@ main(int argc, char *argv[])
 
 	config_file = NULL;
 	app = new QApplication(argc, argv);
+	wheel = new TimerWheel();
 
 	while ((ch = getopt(argc, argv, "c:")) != -1) {
 		switch (ch) {
@@ -88,6 +96,7 @@ main(int argc, char *argv[])
 		ret = 1;
 	}
 
+	delete wheel;
 	delete app;
 
 	return (ret);
@@ -145,6 +154,19 @@ litany_json_string(QJsonObject *json, const char *field)
 	return (value);
 }
 
+/*
+ * Returns the current monotonic time in milliseconds.
+ */
+u_int64_t
+litany_msec(void)
+{
+	struct timespec		ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((u_int64_t)ts.tv_sec * 1000 + (ts.tv_nsec / 1000000));
+}
+
 /* Bad juju happened. */
 void
 fatal(const char *fmt, ...)
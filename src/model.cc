@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <QBrush>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "litany.h"
+#include "model.h"
+
+/* We can use libnyfe because its included in libkyrka. */
+extern "C" void	nyfe_mem_zero(void *, size_t);
+
+/*
+ * Create an empty model that keeps at most max messages.
+ */
+ChatModel::ChatModel(QObject *parent, size_t max)
+    : QAbstractListModel(parent)
+{
+	PRECOND(max > 0 && max <= LITANY_CHAT_HISTORY_MAX);
+
+	if ((ring = (struct litany_chat_entry **)calloc(max,
+	    sizeof(*ring))) == NULL)
+		fatal("calloc: failed to allocate chat ring");
+
+	cap = max;
+	head = 0;
+	count = 0;
+	bytes = 0;
+	evicted = 0;
+
+	frames = 0;
+	frame_ns = 0;
+	frame_rows = 0;
+	frame_ns_max = 0;
+
+	timer.setSingleShot(true);
+	connect(&timer, &QTimer::timeout, this, &ChatModel::flush);
+}
+
+/*
+ * Release all messages, they are wiped first.
+ */
+ChatModel::~ChatModel(void)
+{
+	size_t		idx;
+
+	for (idx = 0; idx < count; idx++)
+		entry_free(entry(idx));
+
+	for (struct litany_chat_entry *ent : pending)
+		entry_free(ent);
+
+	free(ring);
+}
+
+/*
+ * Queue a message for the model, it shows up on the next frame.
+ *
+ * Returns false if a message with the same id is already in the
+ * model, system messages (id 0) are never considered duplicates.
+ */
+bool
+ChatModel::append(const char *msg, u_int64_t id, Qt::GlobalColor color)
+{
+	PRECOND(msg != NULL);
+
+	return (entry_queue(id, color, 0, 0, msg, strlen(msg)));
+}
+
+/*
+ * Queue text from the given peer for the model, like append() but the
+ * text is taken as is and needs no nul-terminator.
+ */
+bool
+ChatModel::append_text(u_int8_t peer, u_int64_t id, Qt::GlobalColor color,
+    const u_int8_t *text, size_t len)
+{
+	PRECOND(text != NULL);
+	PRECOND(id != LITANY_MESSAGE_SYSTEM_ID);
+
+	return (entry_queue(id, color, LITANY_CHAT_ENTRY_PEER, peer,
+	    text, len));
+}
+
+/*
+ * Copy the given message into a new entry and queue it for the next
+ * frame, unless we already have a message with its id.
+ */
+bool
+ChatModel::entry_queue(u_int64_t id, Qt::GlobalColor color, u_int8_t flags,
+    u_int8_t peer, const void *text, size_t len)
+{
+	struct litany_chat_entry	*ent;
+
+	PRECOND(text != NULL);
+
+	if (id != LITANY_MESSAGE_SYSTEM_ID) {
+		if (seen.contains(id))
+			return (false);
+		seen.insert(id);
+	}
+
+	if (len > UINT_MAX)
+		fatal("%s: message too long (%zu)", __func__, len);
+
+	if ((ent = (struct litany_chat_entry *)malloc(sizeof(*ent) +
+	    len)) == NULL)
+		fatal("malloc: failed to allocate chat entry");
+
+	ent->id = id;
+	ent->len = len;
+	ent->peer = peer;
+	ent->flags = flags;
+	ent->color = color;
+	memcpy(ent->text, text, len);
+
+	bytes += len;
+	pending.append(ent);
+
+	if (!timer.isActive()) {
+		if (!last.isValid() || last.elapsed() >= LITANY_CHAT_FRAME_MS)
+			timer.start(0);
+		else
+			timer.start(LITANY_CHAT_FRAME_MS - last.elapsed());
+	}
+
+	return (true);
+}
+
+/*
+ * Add all pending messages to the ring. We first drop as many of the
+ * oldest messages as required to make room, then add the new ones,
+ * each as a single change for the view.
+ */
+void
+ChatModel::flush(void)
+{
+	QElapsedTimer			took;
+	size_t				idx, add, drop;
+	u_int64_t			ns;
+	struct litany_chat_entry	*ent;
+
+	if (pending.isEmpty())
+		return;
+
+	took.start();
+
+	/* More came in than we can hold, skip the oldest of those. */
+	while ((size_t)pending.size() > cap) {
+		entry_free(pending.takeFirst());
+		evicted++;
+	}
+
+	add = pending.size();
+
+	if (count + add > cap)
+		drop = count + add - cap;
+	else
+		drop = 0;
+
+	if (drop > 0) {
+		beginRemoveRows(QModelIndex(), 0, drop - 1);
+
+		for (idx = 0; idx < drop; idx++) {
+			entry_free(ring[head]);
+			ring[head] = NULL;
+			head = (head + 1) % cap;
+		}
+
+		count -= drop;
+		evicted += drop;
+
+		endRemoveRows();
+	}
+
+	beginInsertRows(QModelIndex(), count, count + add - 1);
+
+	for (idx = 0; idx < add; idx++) {
+		ent = pending.at(idx);
+		ring[(head + count) % cap] = ent;
+		count++;
+	}
+
+	pending.clear();
+
+	endInsertRows();
+
+	ns = took.nsecsElapsed();
+
+	frames++;
+	frame_ns += ns;
+	frame_rows += add;
+
+	if (ns > frame_ns_max)
+		frame_ns_max = ns;
+
+	last.start();
+}
+
+/*
+ * Returns the number of rows in the model.
+ */
+int
+ChatModel::rowCount(const QModelIndex &parent) const
+{
+	if (parent.isValid())
+		return (0);
+
+	return (count);
+}
+
+/*
+ * Returns the data for the given row and role, the text is only
+ * turned into a QString here.
+ */
+QVariant
+ChatModel::data(const QModelIndex &index, int role) const
+{
+	QString				text;
+	struct litany_chat_entry	*ent;
+	char				pfx[LITANY_CHAT_PREFIX_LEN];
+
+	if (!index.isValid() || index.row() < 0 ||
+	    (size_t)index.row() >= count)
+		return (QVariant());
+
+	ent = entry(index.row());
+
+	switch (role) {
+	case Qt::DisplayRole:
+		if (!(ent->flags & LITANY_CHAT_ENTRY_PEER))
+			return (QString::fromUtf8(ent->text, ent->len));
+
+		prefix(ent->peer, pfx);
+
+		text.reserve(sizeof(pfx) + ent->len);
+		text.append(QLatin1String(pfx, sizeof(pfx)));
+		text.append(QString::fromUtf8(ent->text, ent->len));
+
+		return (text);
+	case Qt::UserRole:
+		return ((qulonglong)ent->id);
+	case Qt::TextAlignmentRole:
+		return (Qt::AlignLeft);
+	case Qt::ForegroundRole:
+		return (QBrush((Qt::GlobalColor)ent->color));
+	}
+
+	return (QVariant());
+}
+
+/*
+ * Write the "<peer> " prefix for the given peer into buf, which holds
+ * LITANY_CHAT_PREFIX_LEN bytes. It is not nul-terminated.
+ */
+void
+ChatModel::prefix(u_int8_t peer, char *buf)
+{
+	PRECOND(buf != NULL);
+
+	buf[0] = '<';
+	buf[1] = "0123456789abcdef"[peer >> 4];
+	buf[2] = "0123456789abcdef"[peer & 0x0f];
+	buf[3] = '>';
+	buf[4] = ' ';
+}
+
+/*
+ * Format our statistics into the given buffer.
+ */
+void
+ChatModel::stats(char *buf, size_t len)
+{
+	int		ret;
+
+	PRECOND(buf != NULL);
+	PRECOND(len > 0);
+
+	ret = snprintf(buf, len,
+	    "%zu/%zu messages, %" PRIu64 " bytes of text, %" PRIu64
+	    " evicted, %" PRIu64 " frames, %" PRIu64 " rows/frame, "
+	    "frame time avg %" PRIu64 "us max %" PRIu64 "us",
+	    count, cap, bytes, evicted, frames,
+	    frames ? frame_rows / frames : 0,
+	    frames ? frame_ns / frames / 1000 : 0, frame_ns_max / 1000);
+	if (ret == -1 || (size_t)ret >= len)
+		fatal("model stats did not fit");
+}
+
+/*
+ * Returns the entry at the given row.
+ */
+struct litany_chat_entry *
+ChatModel::entry(size_t row) const
+{
+	PRECOND(row < count);
+
+	return (ring[(head + row) % cap]);
+}
+
+/*
+ * Forget the given entry, wipe it and free it.
+ */
+void
+ChatModel::entry_free(struct litany_chat_entry *ent)
+{
+	PRECOND(ent != NULL);
+	PRECOND(bytes >= ent->len);
+
+	if (ent->id != LITANY_MESSAGE_SYSTEM_ID)
+		seen.remove(ent->id);
+
+	bytes -= ent->len;
+
+	nyfe_mem_zero(ent, sizeof(*ent) + ent->len);
+	free(ent);
+}
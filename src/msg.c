@@ -18,12 +18,16 @@
 
 #if defined(PLATFORM_WINDOWS)
 #include <libkyrka/portable_win.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 #include <libkyrka/libkyrka.h>
 
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,13 +36,62 @@
 #include "util.h"
 #include "queue.h"
 
+/* The initial number of hash buckets in a message store. */
+#define MSG_STORE_BUCKETS	64
+
+/* The number of pages per slab in a message pool. */
+#define MSG_POOL_SLAB_PAGES	8
+
+/*
+ * A slab of pages in a message pool, the messages are carved out of
+ * the memory following this header.
+ */
+struct litany_msg_slab {
+	size_t				len;
+	int				locked;
+	LIST_ENTRY(litany_msg_slab)	list;
+};
+
+/* Where the first message starts in a slab. */
+#define MSG_POOL_SLAB_OFFSET	\
+    ((sizeof(struct litany_msg_slab) + 63) & ~(size_t)63)
+
+static u_int64_t	msg_hash(u_int64_t);
+static void		*msg_pool_get(struct litany_msg_pool *);
+static void		msg_pool_grow(struct litany_msg_pool *);
+static void		msg_pool_cleanup(struct litany_msg_pool *);
+static void		msg_pool_put(struct litany_msg_pool *, void *);
+static void		msg_pool_init(struct litany_msg_pool *, size_t);
+
+static void		msg_store_grow(struct litany_msg_store *);
+static void		msg_heap_up(struct litany_msg_store *, size_t);
+static void		msg_heap_down(struct litany_msg_store *, size_t);
+static void		msg_heap_remove(struct litany_msg_store *,
+			    struct litany_msg *);
+
 /* We can use libnyfe because its included in libkyrka. */
 void	nyfe_random_init(void);
+void	nyfe_mem_zero(void *, size_t);
 void	nyfe_random_bytes(void *, size_t);
 
-/* The message number for the next registered message. */
+/*
+ * The message number for the next registered message, this is shared
+ * by all tunnel shards and only ever updated atomically.
+ */
 static u_int64_t	msgno = 1;
 
+/*
+ * The pool all message bodies are allocated from, bodies are taken on
+ * the GUI thread and released on the tunnel shards so the pool is
+ * protected by a spinlock. It is only held for a freelist operation.
+ */
+static u_int8_t			body_lock = 0;
+static int			body_pool_ready = 0;
+static struct litany_msg_pool	body_pool;
+
+static void	body_pool_lock(void);
+static void	body_pool_unlock(void);
+
 /*
  * Set the message number to include the given peer id in the highest
  * bits and a set of 32 random bits following that.
@@ -54,56 +107,933 @@ litany_msg_number_reset(u_int8_t peer)
 	nyfe_random_init();
 	nyfe_random_bytes(&rand, sizeof(rand));
 
-	msgno = ((u_int64_t)peer << 56) | ((u_int64_t)rand << 24) | 1;
+	__atomic_store_n(&msgno,
+	    ((u_int64_t)peer << 56) | ((u_int64_t)rand << 24) | 1,
+	    __ATOMIC_RELAXED);
+}
+
+/*
+ * Reserve a message number that is not used for any message, this
+ * is used as the base id of a fragmented message.
+ */
+u_int64_t
+litany_msg_number_reserve(void)
+{
+	return (__atomic_fetch_add(&msgno, 1, __ATOMIC_RELAXED));
 }
 
 /*
- * Register a new message on the given list.
+ * Setup an empty message store.
+ */
+void
+litany_msg_store_init(struct litany_msg_store *store)
+{
+	size_t		idx;
+
+	PRECOND(store != NULL);
+
+	store->count = 0;
+	store->mask = MSG_STORE_BUCKETS - 1;
+
+	msg_pool_init(&store->pool, sizeof(struct litany_msg));
+
+	if ((store->buckets = calloc(MSG_STORE_BUCKETS,
+	    sizeof(*store->buckets))) == NULL)
+		fatal("calloc: failed to allocate buckets");
+
+	for (idx = 0; idx < MSG_STORE_BUCKETS; idx++)
+		LIST_INIT(&store->buckets[idx]);
+
+	store->heap_max = MSG_STORE_BUCKETS;
+
+	if ((store->heap = calloc(store->heap_max,
+	    sizeof(*store->heap))) == NULL)
+		fatal("calloc: failed to allocate heap");
+}
+
+/*
+ * Release all messages in the store and the store its resources.
+ */
+void
+litany_msg_store_cleanup(struct litany_msg_store *store)
+{
+	size_t		idx;
+
+	PRECOND(store != NULL);
+
+	for (idx = 0; idx < store->count; idx++)
+		litany_msg_body_release(store->heap[idx]->body);
+
+	msg_pool_cleanup(&store->pool);
+
+	free(store->heap);
+	free(store->buckets);
+
+	store->count = 0;
+	store->heap = NULL;
+	store->buckets = NULL;
+}
+
+/*
+ * Register a new message with the given body on the given store, it
+ * is due for retransmission timeout milliseconds from now. The store
+ * takes its own reference on the body.
  */
 struct litany_msg *
-litany_msg_register(struct litany_msg_list *list, const void *data, size_t len)
+litany_msg_register(struct litany_msg_store *store,
+    struct litany_msg_body *body, u_int64_t timeout)
 {
-	struct timespec		ts;
 	struct litany_msg	*msg;
 
-	PRECOND(list != NULL);
-	PRECOND(data != NULL);
-	PRECOND(len > 0 && len < LITANY_MESSAGE_MAX_SIZE);
+	PRECOND(store != NULL);
+	PRECOND(body != NULL);
+	msg = msg_pool_get(&store->pool);
 
-	if ((msg = calloc(1, sizeof(*msg))) == NULL)
-		fatal("calloc(%zu): %d", sizeof(*msg), errno);
+	litany_msg_body_ref(body);
 
-	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	msg->id = litany_msg_number_reserve();
+	msg->body = body;
+	msg->sent = litany_msec();
+	msg->timeout = timeout;
+	msg->deadline = msg->sent + timeout;
 
-	msg->id = msgno;
-	msg->age = ts.tv_sec;
-	memcpy(msg->data.data, data, len);
+	if (store->count >= store->mask + 1)
+		msg_store_grow(store);
 
-	msg->data.len = htobe16(len);
-	msg->data.id = htobe64(msg->id);
-	msg->data.type = LITANY_MESSAGE_TYPE_TEXT;
+	LIST_INSERT_HEAD(&store->buckets[msg_hash(msg->id) & store->mask],
+	    msg, hash);
 
-	TAILQ_INSERT_TAIL(list, msg, list);
-	msgno++;
+	msg->heap_idx = store->count;
+	store->heap[store->count++] = msg;
+	msg_heap_up(store, msg->heap_idx);
 
 	return (msg);
 }
 
 /*
- * Remove a message that matches the given ack message number from the list.
+ * Remove a message that matches the given ack message number from
+ * the store, if it is still present.
+ *
+ * Returns 1 if the message was found, 0 otherwise. If the message was
+ * never retransmitted its round-trip time is placed in rtt, otherwise
+ * rtt is set to 0 as the sample would be ambiguous (Karn's algorithm).
  */
-void
-litany_msg_ack(struct litany_msg_list *list, u_int64_t ack)
+int
+litany_msg_ack(struct litany_msg_store *store, u_int64_t ack, u_int64_t *rtt)
 {
 	struct litany_msg	*msg;
+	u_int64_t		now;
+
+	PRECOND(store != NULL);
+	PRECOND(rtt != NULL);
+
+	*rtt = 0;
+
+	LIST_FOREACH(msg, &store->buckets[msg_hash(ack) & store->mask], hash) {
+		if (msg->id == ack)
+			break;
+	}
+
+	if (msg == NULL)
+		return (0);
+
+	if (msg->retries == 0) {
+		now = litany_msec();
+		*rtt = (now > msg->sent) ? now - msg->sent : 1;
+	}
+
+	LIST_REMOVE(msg, hash);
+	msg_heap_remove(store, msg);
+
+	litany_msg_body_release(msg->body);
+	msg_pool_put(&store->pool, msg);
+
+	return (1);
+}
+
+/*
+ * Process a list of count big endian message ids that were ACK'd in
+ * one go, any valid round-trip time samples are fed into rtt.
+ *
+ * Returns the number of messages that were removed from the store.
+ */
+size_t
+litany_msg_acks(struct litany_msg_store *store, const void *data,
+    size_t count, struct litany_rtt *rtt)
+{
+	const u_int8_t		*p;
+	size_t			idx, acked;
+	u_int64_t		id, sample;
+
+	PRECOND(store != NULL);
+	PRECOND(data != NULL);
+	PRECOND(rtt != NULL);
+
+	p = data;
+	acked = 0;
+
+	for (idx = 0; idx < count; idx++) {
+		memcpy(&id, &p[idx * sizeof(id)], sizeof(id));
+		id = be64toh(id);
+
+		if (id == LITANY_MESSAGE_SYSTEM_ID)
+			continue;
+
+		if (litany_msg_ack(store, id, &sample)) {
+			acked++;
+			if (sample != 0)
+				litany_rtt_sample(rtt, sample);
+		}
+	}
+
+	return (acked);
+}
+
+/*
+ * Returns the message with the earliest deadline if that deadline
+ * has passed, NULL otherwise.
+ */
+struct litany_msg *
+litany_msg_expired(struct litany_msg_store *store, u_int64_t now)
+{
+	PRECOND(store != NULL);
+
+	if (store->count == 0 || store->heap[0]->deadline > now)
+		return (NULL);
+
+	return (store->heap[0]);
+}
+
+/*
+ * Returns the earliest deadline of all messages, 0 if there are none.
+ */
+u_int64_t
+litany_msg_next_deadline(struct litany_msg_store *store)
+{
+	PRECOND(store != NULL);
+
+	if (store->count == 0)
+		return (0);
+
+	return (store->heap[0]->deadline);
+}
+
+/*
+ * Move the given message to a new deadline.
+ */
+void
+litany_msg_reschedule(struct litany_msg_store *store,
+    struct litany_msg *msg, u_int64_t deadline)
+{
+	PRECOND(store != NULL);
+	PRECOND(msg != NULL);
+	PRECOND(msg->heap_idx < store->count);
+	PRECOND(store->heap[msg->heap_idx] == msg);
+
+	if (deadline < msg->deadline) {
+		msg->deadline = deadline;
+		msg_heap_up(store, msg->heap_idx);
+	} else {
+		msg->deadline = deadline;
+		msg_heap_down(store, msg->heap_idx);
+	}
+}
+
+/*
+ * The given message was resent at now, back off its timeout and
+ * move it to its next deadline.
+ */
+void
+litany_msg_retransmit(struct litany_msg_store *store,
+    struct litany_msg *msg, u_int64_t now)
+{
+	PRECOND(store != NULL);
+	PRECOND(msg != NULL);
+
+	msg->retries++;
+	msg->timeout *= 2;
+
+	if (msg->timeout > LITANY_RTO_MAX)
+		msg->timeout = LITANY_RTO_MAX;
+
+	litany_msg_reschedule(store, msg, now + msg->timeout);
+}
+
+/*
+ * Initialize a round-trip time estimate without any samples.
+ */
+void
+litany_rtt_init(struct litany_rtt *rtt)
+{
+	PRECOND(rtt != NULL);
+
+	rtt->srtt = 0;
+	rtt->rttvar = 0;
+	rtt->samples = 0;
+	rtt->rto = LITANY_RTO_INITIAL;
+}
+
+/*
+ * Feed a round-trip time sample into the estimate and recalculate
+ * the retransmission timeout as per RFC 6298 section 2.
+ */
+void
+litany_rtt_sample(struct litany_rtt *rtt, u_int64_t sample)
+{
+	u_int64_t	delta, var;
+
+	PRECOND(rtt != NULL);
+	PRECOND(sample > 0);
+
+	if (rtt->samples == 0) {
+		rtt->srtt = sample;
+		rtt->rttvar = sample / 2;
+	} else {
+		if (rtt->srtt > sample)
+			delta = rtt->srtt - sample;
+		else
+			delta = sample - rtt->srtt;
+
+		rtt->rttvar = ((3 * rtt->rttvar) + delta) / 4;
+		rtt->srtt = ((7 * rtt->srtt) + sample) / 8;
+	}
+
+	rtt->samples++;
+
+	var = 4 * rtt->rttvar;
+	if (var < LITANY_RTO_GRANULARITY)
+		var = LITANY_RTO_GRANULARITY;
+
+	rtt->rto = rtt->srtt + var;
+
+	if (rtt->rto < LITANY_RTO_MIN)
+		rtt->rto = LITANY_RTO_MIN;
+
+	if (rtt->rto > LITANY_RTO_MAX)
+		rtt->rto = LITANY_RTO_MAX;
+}
+
+/*
+ * Allocate a new body holding len bytes of data for a message of the
+ * given type, the caller holds the only reference to it.
+ */
+struct litany_msg_body *
+litany_msg_body_alloc(u_int8_t type, const void *data, size_t len)
+{
+	struct litany_msg_body		*body;
+
+	PRECOND(type == LITANY_MESSAGE_TYPE_TEXT ||
+	    type == LITANY_MESSAGE_TYPE_FRAGMENT);
+	PRECOND(data != NULL);
+	PRECOND(len > 0 && len <= LITANY_MESSAGE_TEXT_MAX);
+
+	body_pool_lock();
+
+	if (!body_pool_ready) {
+		msg_pool_init(&body_pool, sizeof(*body));
+		body_pool_ready = 1;
+	}
+
+	body = msg_pool_get(&body_pool);
+
+	body_pool_unlock();
+
+	body->refs = 1;
+	body->len = len;
+	body->type = type;
+	memcpy(body->data, data, len);
+
+	return (body);
+}
+
+/*
+ * Take an additional reference on the given body.
+ */
+void
+litany_msg_body_ref(struct litany_msg_body *body)
+{
+	u_int32_t	refs;
+
+	PRECOND(body != NULL);
+
+	refs = __atomic_fetch_add(&body->refs, 1, __ATOMIC_RELAXED);
+	if (refs == 0)
+		fatal("%s: body was already released", __func__);
+}
+
+/*
+ * Drop a reference on the given body, the last one returns it to
+ * the pool.
+ */
+void
+litany_msg_body_release(struct litany_msg_body *body)
+{
+	u_int32_t	refs;
+
+	PRECOND(body != NULL);
+
+	refs = __atomic_sub_fetch(&body->refs, 1, __ATOMIC_ACQ_REL);
+	if (refs == UINT_MAX)
+		fatal("%s: body was already released", __func__);
+
+	if (refs == 0) {
+		body_pool_lock();
+		msg_pool_put(&body_pool, body);
+		body_pool_unlock();
+	}
+}
+
+/*
+ * Returns the number of bodies in use and its high-water mark.
+ */
+void
+litany_msg_body_stats(size_t *inuse, size_t *highwater)
+{
+	PRECOND(inuse != NULL);
+	PRECOND(highwater != NULL);
+
+	body_pool_lock();
+	*inuse = body_pool.inuse;
+	*highwater = body_pool.highwater;
+	body_pool_unlock();
+}
+
+/*
+ * Build the bodies for the given text, which are placed in bodies.
+ * Text that does not fit in a single body is split up in fragments.
+ *
+ * Returns the number of bodies, the caller must release them.
+ */
+size_t
+litany_msg_text(const void *data, size_t len,
+    struct litany_msg_body **bodies, size_t max)
+{
+	size_t				off, chunk, count;
+	struct litany_fragment		frag;
+	u_int8_t			buf[LITANY_MESSAGE_TEXT_MAX];
+
+	PRECOND(data != NULL);
+	PRECOND(bodies != NULL);
+	PRECOND(len > 0 && len <= LITANY_MESSAGE_LONG_MAX);
+	PRECOND(max >= LITANY_FRAGMENT_MAX);
+
+	if (len <= LITANY_MESSAGE_TEXT_MAX) {
+		bodies[0] = litany_msg_body_alloc(LITANY_MESSAGE_TYPE_TEXT,
+		    data, len);
+		return (1);
+	}
+
+	frag.index = 0;
+	frag.base = htobe64(litany_msg_number_reserve());
+	frag.count = (len + LITANY_FRAGMENT_DATA - 1) / LITANY_FRAGMENT_DATA;
+
+	count = 0;
+
+	for (off = 0; off < len; off += chunk) {
+		chunk = len - off;
+		if (chunk > LITANY_FRAGMENT_DATA)
+			chunk = LITANY_FRAGMENT_DATA;
+
+		memcpy(buf, &frag, sizeof(frag));
+		memcpy(&buf[sizeof(frag)],
+		    (const u_int8_t *)data + off, chunk);
+
+		bodies[count++] = litany_msg_body_alloc(
+		    LITANY_MESSAGE_TYPE_FRAGMENT, buf, sizeof(frag) + chunk);
+
+		frag.index++;
+	}
+
+	nyfe_mem_zero(buf, sizeof(buf));
+
+	return (count);
+}
+
+/*
+ * Setup an empty reassembly buffer.
+ */
+void
+litany_reassembly_init(struct litany_reassembly *reasm)
+{
+	PRECOND(reasm != NULL);
+
+	memset(reasm, 0, sizeof(*reasm));
+}
+
+/*
+ * Release all partially reassembled messages.
+ */
+void
+litany_reassembly_cleanup(struct litany_reassembly *reasm)
+{
+	size_t		idx;
+
+	PRECOND(reasm != NULL);
+
+	for (idx = 0; idx < LITANY_REASSEMBLY_SLOTS; idx++) {
+		if (reasm->pending[idx].buf != NULL)
+			litany_reassembly_release(reasm, &reasm->pending[idx]);
+	}
+}
+
+/*
+ * Wipe and release the given slot so it can be used again.
+ */
+void
+litany_reassembly_release(struct litany_reassembly *reasm,
+    struct litany_reassembly_slot *slot)
+{
+	PRECOND(reasm != NULL);
+	PRECOND(slot != NULL);
+	PRECOND(slot->buf != NULL);
+	PRECOND(reasm->inuse > 0);
+
+	nyfe_mem_zero(slot->buf, LITANY_MESSAGE_LONG_MAX);
+	free(slot->buf);
+
+	memset(slot, 0, sizeof(*slot));
+	reasm->inuse--;
+}
+
+/*
+ * Release the slots of all messages that did not complete within
+ * LITANY_REASSEMBLY_TIMEOUT milliseconds.
+ */
+void
+litany_reassembly_expire(struct litany_reassembly *reasm, u_int64_t now)
+{
+	size_t				idx;
+	struct litany_reassembly_slot	*slot;
+
+	PRECOND(reasm != NULL);
+
+	for (idx = 0; idx < LITANY_REASSEMBLY_SLOTS; idx++) {
+		slot = &reasm->pending[idx];
+
+		if (slot->buf == NULL)
+			continue;
+
+		if (now - slot->started >= LITANY_REASSEMBLY_TIMEOUT) {
+			reasm->expired++;
+			litany_reassembly_release(reasm, slot);
+		}
+	}
+}
+
+/*
+ * Add the fragment with len bytes of data to the reassembly buffer.
+ *
+ * Returns -1 if the fragment was rejected because it was malformed or
+ * because we have no room for another message, 0 if it was accepted
+ * (or was a duplicate, also of a recently completed message) and 1 if
+ * it completed its message, in which case *out points to the slot
+ * holding the message. The caller must release that slot once it is
+ * done with it.
+ */
+int
+litany_reassembly_add(struct litany_reassembly *reasm,
+    const struct litany_fragment *frag, const void *data, size_t len,
+    u_int64_t now, struct litany_reassembly_slot **out)
+{
+	size_t				idx, max;
+	u_int32_t			bit;
+	struct litany_reassembly_slot	*slot, *empty;
+
+	PRECOND(reasm != NULL);
+	PRECOND(frag != NULL);
+	PRECOND(data != NULL);
+	PRECOND(out != NULL);
+
+	*out = NULL;
+
+	if (frag->count < 2 || frag->count > LITANY_FRAGMENT_MAX ||
+	    frag->index >= frag->count)
+		return (-1);
+
+	if (len == 0 || len > LITANY_FRAGMENT_DATA)
+		return (-1);
+
+	if (frag->index < frag->count - 1 && len != LITANY_FRAGMENT_DATA)
+		return (-1);
+
+	if (reasm->completed < LITANY_REASSEMBLY_DONE)
+		max = reasm->completed;
+	else
+		max = LITANY_REASSEMBLY_DONE;
+
+	for (idx = 0; idx < max; idx++) {
+		if (reasm->done[idx] == frag->base) {
+			reasm->late++;
+			return (0);
+		}
+	}
+
+	slot = NULL;
+	empty = NULL;
+
+	for (idx = 0; idx < LITANY_REASSEMBLY_SLOTS; idx++) {
+		if (reasm->pending[idx].buf == NULL) {
+			if (empty == NULL)
+				empty = &reasm->pending[idx];
+			continue;
+		}
 
-	PRECOND(list != NULL);
+		if (reasm->pending[idx].base == frag->base) {
+			slot = &reasm->pending[idx];
+			break;
+		}
+	}
 
-	TAILQ_FOREACH(msg, list, list) {
-		if (msg->id == ack) {
-			TAILQ_REMOVE(list, msg, list);
-			free(msg);
-			return;
+	if (slot == NULL) {
+		if (empty == NULL) {
+			reasm->dropped++;
+			return (-1);
 		}
+
+		slot = empty;
+		if ((slot->buf = calloc(1, LITANY_MESSAGE_LONG_MAX)) == NULL)
+			fatal("calloc: failed to allocate reassembly buffer");
+
+		slot->length = 0;
+		slot->received = 0;
+		slot->started = now;
+		slot->base = frag->base;
+		slot->count = frag->count;
+
+		reasm->inuse++;
 	}
+
+	if (slot->count != frag->count)
+		return (-1);
+
+	bit = 1U << frag->index;
+	if (slot->received & bit)
+		return (0);
+
+	memcpy(&slot->buf[frag->index * LITANY_FRAGMENT_DATA], data, len);
+
+	slot->length += len;
+	slot->received |= bit;
+
+	if (slot->received != (u_int32_t)((1ULL << slot->count) - 1))
+		return (0);
+
+	reasm->done[reasm->completed % LITANY_REASSEMBLY_DONE] = slot->base;
+	reasm->completed++;
+
+	*out = slot;
+
+	return (1);
+}
+
+/*
+ * Double the number of hash buckets and the heap capacity once the
+ * store holds as many messages as it has buckets.
+ */
+static void
+msg_store_grow(struct litany_msg_store *store)
+{
+	struct litany_msg		*msg;
+	struct litany_msg_bucket	*buckets;
+	size_t				idx, nbuckets;
+
+	PRECOND(store != NULL);
+
+	nbuckets = (store->mask + 1) * 2;
+
+	if ((buckets = calloc(nbuckets, sizeof(*buckets))) == NULL)
+		fatal("calloc: failed to allocate buckets");
+
+	for (idx = 0; idx < nbuckets; idx++)
+		LIST_INIT(&buckets[idx]);
+
+	for (idx = 0; idx < store->count; idx++) {
+		msg = store->heap[idx];
+		LIST_REMOVE(msg, hash);
+		LIST_INSERT_HEAD(&buckets[msg_hash(msg->id) & (nbuckets - 1)],
+		    msg, hash);
+	}
+
+	free(store->buckets);
+
+	store->buckets = buckets;
+	store->mask = nbuckets - 1;
+
+	if (nbuckets > store->heap_max) {
+		if ((store->heap = realloc(store->heap,
+		    nbuckets * sizeof(*store->heap))) == NULL)
+			fatal("realloc: failed to grow heap");
+		store->heap_max = nbuckets;
+	}
+}
+
+/*
+ * Setup an empty pool for objects of the given size, slabs are only
+ * allocated once needed.
+ */
+static void
+msg_pool_init(struct litany_msg_pool *pool, size_t size)
+{
+	PRECOND(pool != NULL);
+	PRECOND(size >= sizeof(void *));
+
+	pool->size = (size + 15) & ~(size_t)15;
+
+	pool->inuse = 0;
+	pool->total = 0;
+	pool->slabs = 0;
+	pool->unlocked = 0;
+	pool->highwater = 0;
+
+	pool->freelist = NULL;
+	LIST_INIT(&pool->slablist);
+}
+
+/*
+ * Take a zeroed object from the pool, growing it if required. Free
+ * objects are linked together through their first bytes.
+ */
+static void *
+msg_pool_get(struct litany_msg_pool *pool)
+{
+	void		*obj;
+
+	PRECOND(pool != NULL);
+
+	if (pool->freelist == NULL)
+		msg_pool_grow(pool);
+
+	obj = pool->freelist;
+	memcpy(&pool->freelist, obj, sizeof(void *));
+	memset(obj, 0, sizeof(void *));
+
+	pool->inuse++;
+	if (pool->inuse > pool->highwater)
+		pool->highwater = pool->inuse;
+
+	return (obj);
+}
+
+/*
+ * Wipe the given object and return it to the pool.
+ */
+static void
+msg_pool_put(struct litany_msg_pool *pool, void *obj)
+{
+	PRECOND(pool != NULL);
+	PRECOND(obj != NULL);
+	PRECOND(pool->inuse > 0);
+
+	nyfe_mem_zero(obj, pool->size);
+
+	memcpy(obj, &pool->freelist, sizeof(void *));
+	pool->freelist = obj;
+
+	pool->inuse--;
+}
+
+/*
+ * Add a new slab to the pool. We attempt to lock its pages in memory
+ * and exclude them from core dumps, if locking fails (RLIMIT_MEMLOCK)
+ * we carry on with an unlocked slab and count it as such.
+ */
+static void
+msg_pool_grow(struct litany_msg_pool *pool)
+{
+	u_int8_t			*p;
+	struct litany_msg_slab		*slab;
+	size_t				len, off;
+
+	PRECOND(pool != NULL);
+
+#if defined(PLATFORM_WINDOWS)
+	len = 4096 * MSG_POOL_SLAB_PAGES;
+
+	if ((p = calloc(1, len)) == NULL)
+		fatal("calloc: failed to allocate slab");
+
+	slab = (struct litany_msg_slab *)p;
+	slab->locked = 0;
+#else
+	len = (size_t)sysconf(_SC_PAGESIZE) * MSG_POOL_SLAB_PAGES;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED)
+		fatal("mmap: failed to allocate slab: %d", errno);
+
+#if defined(MADV_DONTDUMP)
+	(void)madvise(p, len, MADV_DONTDUMP);
+#endif
+
+	slab = (struct litany_msg_slab *)p;
+	slab->locked = (mlock(p, len) == 0);
+#endif
+
+	slab->len = len;
+	LIST_INSERT_HEAD(&pool->slablist, slab, list);
+
+	pool->slabs++;
+	if (!slab->locked)
+		pool->unlocked++;
+
+	for (off = MSG_POOL_SLAB_OFFSET;
+	    off + pool->size <= len; off += pool->size) {
+		memcpy(&p[off], &pool->freelist, sizeof(void *));
+		pool->freelist = &p[off];
+		pool->total++;
+	}
+}
+
+/*
+ * Wipe and release all slabs in the pool, including any messages
+ * that were still in use.
+ */
+static void
+msg_pool_cleanup(struct litany_msg_pool *pool)
+{
+	struct litany_msg_slab		*slab;
+	size_t				len;
+	int				locked;
+
+	PRECOND(pool != NULL);
+
+	while ((slab = LIST_FIRST(&pool->slablist)) != NULL) {
+		LIST_REMOVE(slab, list);
+
+		len = slab->len;
+		locked = slab->locked;
+		nyfe_mem_zero(slab, len);
+
+#if defined(PLATFORM_WINDOWS)
+		(void)locked;
+		free(slab);
+#else
+		if (locked)
+			(void)munlock(slab, len);
+		(void)munmap(slab, len);
+#endif
+	}
+
+	msg_pool_init(pool, pool->size);
+}
+
+/*
+ * Hash a message id onto a bucket, the lower bits of our message
+ * ids are sequential so mix them a bit first.
+ */
+static u_int64_t
+msg_hash(u_int64_t id)
+{
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+
+	return (id);
+}
+
+/*
+ * Remove the given message from the heap.
+ */
+static void
+msg_heap_remove(struct litany_msg_store *store, struct litany_msg *msg)
+{
+	size_t			idx;
+	struct litany_msg	*last;
+
+	PRECOND(store != NULL);
+	PRECOND(msg != NULL);
+	PRECOND(store->count > 0);
+	PRECOND(store->heap[msg->heap_idx] == msg);
+
+	idx = msg->heap_idx;
+	last = store->heap[--store->count];
+
+	if (last == msg)
+		return;
+
+	store->heap[idx] = last;
+	last->heap_idx = idx;
+
+	if (idx > 0 && last->deadline < store->heap[(idx - 1) / 2]->deadline)
+		msg_heap_up(store, idx);
+	else
+		msg_heap_down(store, idx);
+}
+
+/*
+ * Move the message at idx up the heap until its parent is earlier.
+ */
+static void
+msg_heap_up(struct litany_msg_store *store, size_t idx)
+{
+	size_t			parent;
+	struct litany_msg	*msg;
+
+	msg = store->heap[idx];
+
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (store->heap[parent]->deadline <= msg->deadline)
+			break;
+
+		store->heap[idx] = store->heap[parent];
+		store->heap[idx]->heap_idx = idx;
+		idx = parent;
+	}
+
+	store->heap[idx] = msg;
+	msg->heap_idx = idx;
+}
+
+/*
+ * Move the message at idx down the heap until its children are later.
+ */
+static void
+msg_heap_down(struct litany_msg_store *store, size_t idx)
+{
+	size_t			child;
+	struct litany_msg	*msg;
+
+	msg = store->heap[idx];
+
+	for (;;) {
+		child = (idx * 2) + 1;
+		if (child >= store->count)
+			break;
+
+		if (child + 1 < store->count &&
+		    store->heap[child + 1]->deadline <
+		    store->heap[child]->deadline)
+			child++;
+
+		if (msg->deadline <= store->heap[child]->deadline)
+			break;
+
+		store->heap[idx] = store->heap[child];
+		store->heap[idx]->heap_idx = idx;
+		idx = child;
+	}
+
+	store->heap[idx] = msg;
+	msg->heap_idx = idx;
+}
+
+/*
+ * Acquire the lock protecting the body pool.
+ */
+static void
+body_pool_lock(void)
+{
+	while (__atomic_test_and_set(&body_lock, __ATOMIC_ACQUIRE))
+		;
+}
+
+/*
+ * Release the lock protecting the body pool.
+ */
+static void
+body_pool_unlock(void)
+{
+	__atomic_clear(&body_lock, __ATOMIC_RELEASE);
 }
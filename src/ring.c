@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+/*
+ * Setup a ring that can hold elm pointers, elm must be a power of 2.
+ */
+void
+litany_ring_init(struct litany_ring *ring, size_t elm)
+{
+	PRECOND(ring != NULL);
+	PRECOND(elm > 0 && (elm & (elm - 1)) == 0);
+
+	if ((ring->data = calloc(elm, sizeof(void *))) == NULL)
+		fatal("calloc: failed to allocate ring");
+
+	ring->elm = elm;
+	ring->mask = elm - 1;
+
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+/*
+ * Release the ring its resources, anything still on it is the
+ * responsibility of the caller.
+ */
+void
+litany_ring_cleanup(struct litany_ring *ring)
+{
+	PRECOND(ring != NULL);
+
+	free(ring->data);
+	ring->data = NULL;
+}
+
+/*
+ * Called by the producer to place ptr on the ring.
+ * Returns 0 on success or -1 if the ring was full.
+ */
+int
+litany_ring_queue(struct litany_ring *ring, void *ptr)
+{
+	u_int64_t	head, tail;
+
+	PRECOND(ring != NULL);
+	PRECOND(ptr != NULL);
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail == ring->elm)
+		return (-1);
+
+	ring->data[head & ring->mask] = ptr;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return (0);
+}
+
+/*
+ * Called by the consumer to take the oldest pointer off the ring.
+ * Returns NULL if the ring was empty.
+ */
+void *
+litany_ring_dequeue(struct litany_ring *ring)
+{
+	void		*ptr;
+	u_int64_t	head, tail;
+
+	PRECOND(ring != NULL);
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return (NULL);
+
+	ptr = ring->data[tail & ring->mask];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return (ptr);
+}
+
+/*
+ * Returns the number of entries currently on the ring, this is only
+ * a snapshot if called from anywhere but the consumer.
+ */
+size_t
+litany_ring_pending(struct litany_ring *ring)
+{
+	u_int64_t	head, tail;
+
+	PRECOND(ring != NULL);
+
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	return (head - tail);
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "litany.h"
+
+/*
+ * Start a new shard, in group mode it gets its own socket before any
+ * tunnel is created on it.
+ *
+ * Messages from our tunnels are delivered to ifc on the GUI thread.
+ */
+TunnelShard::TunnelShard(TunnelInterface *ifc, QJsonObject *cfg,
+    int idx, bool shared)
+    : LitanyWorker(QString("shard-%1").arg(idx))
+{
+	PRECOND(ifc != NULL);
+	PRECOND(cfg != NULL);
+
+	owner = ifc;
+
+	config = *cfg;
+	index = idx;
+	group = shared;
+
+	mux = NULL;
+	memset(tunnels, 0, sizeof(tunnels));
+
+	post([this]() {
+		if (group)
+			mux = new LitanySocket();
+	});
+}
+
+/*
+ * Remove all tunnels on the shard from its own thread and wait for
+ * that to complete before stopping the thread.
+ */
+TunnelShard::~TunnelShard(void)
+{
+	post_wait([this]() {
+		for (Tunnel *tunnel : active)
+			delete tunnel;
+
+		active.clear();
+		memset(tunnels, 0, sizeof(tunnels));
+
+		delete mux;
+		mux = NULL;
+	});
+
+	stop();
+}
+
+/*
+ * Create a tunnel to the given peer on this shard.
+ */
+void
+TunnelShard::tunnel_create(u_int8_t id)
+{
+	post([this, id]() {
+		PRECOND(tunnels[id] == NULL);
+
+		tunnels[id] = new Tunnel(this, &config, mux, id, group);
+		active.append(tunnels[id]);
+	});
+}
+
+/*
+ * Remove the tunnel to the given peer from this shard.
+ */
+void
+TunnelShard::tunnel_remove(u_int8_t id)
+{
+	post([this, id]() {
+		if (tunnels[id] == NULL)
+			return;
+
+		active.removeOne(tunnels[id]);
+		delete tunnels[id];
+		tunnels[id] = NULL;
+	});
+}
+
+/*
+ * Send the given bodies to all tunnels on this shard. We take our own
+ * reference on the bodies so the caller can release theirs right away.
+ */
+void
+TunnelShard::send_text(struct litany_msg_body **bodies, size_t count)
+{
+	size_t					idx;
+	QList<struct litany_msg_body *>		list;
+
+	PRECOND(bodies != NULL);
+	PRECOND(count > 0 && count <= LITANY_FRAGMENT_MAX);
+
+	for (idx = 0; idx < count; idx++) {
+		litany_msg_body_ref(bodies[idx]);
+		list.append(bodies[idx]);
+	}
+
+	post([this, list]() mutable {
+		for (Tunnel *tunnel : active)
+			tunnel->send_text(list.data(), list.size());
+
+		for (struct litany_msg_body *body : list)
+			litany_msg_body_release(body);
+	});
+}
+
+/*
+ * Send the given file to all tunnels on this shard. We take our own
+ * reference on the source so the caller can release theirs right away.
+ */
+void
+TunnelShard::file_send(XferSource *src)
+{
+	PRECOND(src != NULL);
+
+	src->ref();
+
+	post([this, src]() {
+		for (Tunnel *tunnel : active)
+			tunnel->file_send(src);
+
+		src->release();
+	});
+}
+
+/*
+ * Accept or reject the file offered by the given peer on this shard.
+ */
+void
+TunnelShard::file_answer(u_int8_t id, bool accept)
+{
+	post([this, id, accept]() {
+		if (tunnels[id] != NULL)
+			tunnels[id]->file_answer(accept);
+	});
+}
+
+/*
+ * Show the statistics for our wheel, socket and all of our tunnels.
+ */
+void
+TunnelShard::stats_show(void)
+{
+	post([this]() {
+		char		buf[512];
+
+		timers->stats(buf, sizeof(buf));
+		message_show(QString("[stats shard %1 wheel]: %2 tunnels, %3")
+		    .arg(index).arg(active.size()).arg(buf).toUtf8().data(),
+		    LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+
+		if (mux != NULL) {
+			mux->stats(buf, sizeof(buf));
+			message_show(QString("[stats shard %1 mux]: %2")
+			    .arg(index).arg(buf).toUtf8().data(),
+			    LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+		}
+
+		for (Tunnel *tunnel : active)
+			tunnel->stats_show();
+	});
+}
+
+/*
+ * Called from our thread by our tunnels, the message is copied and
+ * shown by our owner once the GUI thread gets to it.
+ */
+void
+TunnelShard::message_show(const char *msg, u_int64_t id,
+    Qt::GlobalColor color)
+{
+	PRECOND(msg != NULL);
+
+	event_send(LITANY_EVENT_MESSAGE, 0, id, color, msg, strlen(msg));
+}
+
+/*
+ * Called from our thread by our tunnels for text from their peer, it
+ * is copied once onto the event and delivered as is.
+ */
+void
+TunnelShard::message_text(u_int8_t peer, u_int64_t id,
+    Qt::GlobalColor color, const u_int8_t *text, size_t len)
+{
+	PRECOND(text != NULL);
+
+	event_send(LITANY_EVENT_TEXT, peer, id, color, text, len);
+}
+
+/*
+ * Called on the GUI thread for each event from our thread.
+ */
+void
+TunnelShard::event_dispatch(struct litany_event *evt)
+{
+	PRECOND(evt != NULL);
+
+	switch (evt->type) {
+	case LITANY_EVENT_MESSAGE:
+		owner->message_show((const char *)evt->data,
+		    evt->id, evt->color);
+		break;
+	case LITANY_EVENT_TEXT:
+		owner->message_text(evt->peer, evt->id, evt->color,
+		    evt->data, evt->len);
+		break;
+	default:
+		fatal("%s: unexpected event %d", __func__, evt->type);
+	}
+}
@@ -0,0 +1,1331 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "litany.h"
+
+static int	socket_backend(void);
+
+#if defined(__linux__)
+/* The epoll instance for the calling thread, if any socket uses it. */
+static thread_local SocketPoller	*poller = NULL;
+
+/* The io_uring instance for the calling thread, if any socket uses it. */
+static thread_local SocketRing		*uring = NULL;
+
+/*
+ * The low bits of the user_data on our io_uring submissions say what
+ * they are, the rest is the socket or for sends the transmit slot.
+ */
+#define SOCKET_URING_RECV		1
+#define SOCKET_URING_SEND		2
+#define SOCKET_URING_CANCEL		3
+#define SOCKET_URING_MASK		3
+#define SOCKET_URING_SHIFT		2
+#endif
+
+/*
+ * The packet_read() function that consumers must re-implement.
+ */
+int
+SocketInterface::packet_read(const void *data, size_t len, bool broadcast)
+{
+	(void)data;
+	(void)len;
+	(void)broadcast;
+
+	fatal("SocketInterface::packet_read not overriden");
+}
+
+/*
+ * Create a new udp socket bound to any IPv4 address on an
+ * ephemeral port, datagrams are handed to endpoints attached to it.
+ */
+LitanySocket::LitanySocket(void)
+{
+#if defined(__linux__)
+	size_t			idx;
+	struct sockaddr_in	sin;
+#endif
+
+	rx_by_spi = 0;
+	rx_by_peer = 0;
+	rx_by_all = 0;
+	rx_by_all_drops = 0;
+
+	rx_packets = 0;
+	rx_wakeups = 0;
+	memset(rx_batches, 0, sizeof(rx_batches));
+
+	tx_drops = 0;
+	tx_packets = 0;
+	tx_flushes = 0;
+	memset(tx_batches, 0, sizeof(tx_batches));
+
+	backend = socket_backend();
+
+	if (backend == LITANY_SOCKET_BACKEND_QT) {
+		socket.bind(QHostAddress::AnyIPv4);
+		connect(&socket, &QUdpSocket::readyRead,
+		    this, &LitanySocket::packet_read);
+		return;
+	}
+
+#if defined(__linux__)
+	if ((fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) == -1)
+		fatal("socket: %d", errno);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		fatal("bind: %d", errno);
+
+	if (backend == LITANY_SOCKET_BACKEND_URING) {
+		if ((ring = (u_int8_t *)calloc(LITANY_SOCKET_URING_BUFS,
+		    LITANY_SOCKET_URING_BUF_SIZE)) == NULL)
+			fatal("calloc: failed to allocate receive ring");
+
+		rx_batch = 0;
+		rx_armed = false;
+		rx_bufs = NULL;
+
+		memset(&rx_msg, 0, sizeof(rx_msg));
+		rx_msg.msg_namelen = sizeof(struct sockaddr_in);
+	} else {
+		if ((ring = (u_int8_t *)calloc(LITANY_SOCKET_BATCH,
+		    LITANY_SOCKET_PACKET_MAX)) == NULL)
+			fatal("calloc: failed to allocate receive ring");
+
+		memset(rx_hdr, 0, sizeof(rx_hdr));
+
+		for (idx = 0; idx < LITANY_SOCKET_BATCH; idx++) {
+			rx_iov[idx].iov_len = LITANY_SOCKET_PACKET_MAX;
+			rx_iov[idx].iov_base =
+			    &ring[idx * LITANY_SOCKET_PACKET_MAX];
+
+			rx_hdr[idx].msg_hdr.msg_iov = &rx_iov[idx];
+			rx_hdr[idx].msg_hdr.msg_iovlen = 1;
+			rx_hdr[idx].msg_hdr.msg_name = &rx_addr[idx];
+		}
+	}
+
+	if ((tx_ring = (u_int8_t *)calloc(LITANY_SOCKET_BATCH,
+	    LITANY_SOCKET_PACKET_MAX)) == NULL)
+		fatal("calloc: failed to allocate transmit ring");
+
+	tx_count = 0;
+	memset(tx_hdr, 0, sizeof(tx_hdr));
+	memset(tx_addr, 0, sizeof(tx_addr));
+
+	for (idx = 0; idx < LITANY_SOCKET_BATCH; idx++) {
+		tx_iov[idx].iov_base = &tx_ring[idx * LITANY_SOCKET_PACKET_MAX];
+
+		tx_hdr[idx].msg_hdr.msg_iov = &tx_iov[idx];
+		tx_hdr[idx].msg_hdr.msg_iovlen = 1;
+		tx_hdr[idx].msg_hdr.msg_name = &tx_addr[idx];
+		tx_hdr[idx].msg_hdr.msg_namelen = sizeof(tx_addr[idx]);
+	}
+
+	tx_timer.setSingleShot(true);
+	connect(&tx_timer, &QTimer::timeout, this, &LitanySocket::packet_flush);
+
+	if (backend == LITANY_SOCKET_BACKEND_EPOLL) {
+		notifier = NULL;
+
+		if (poller == NULL)
+			poller = new SocketPoller();
+
+		poller->add(this);
+	} else if (backend == LITANY_SOCKET_BACKEND_URING) {
+		notifier = NULL;
+
+		if (uring == NULL)
+			uring = new SocketRing();
+
+		uring->add(this);
+	} else {
+		notifier = new QSocketNotifier(fd,
+		    QSocketNotifier::Read, this);
+		connect(notifier, &QSocketNotifier::activated,
+		    this, &LitanySocket::packet_read);
+	}
+#endif
+}
+
+/*
+ * Flush anything still queued, close the socket and release the rings.
+ */
+LitanySocket::~LitanySocket(void)
+{
+#if defined(__linux__)
+	if (backend == LITANY_SOCKET_BACKEND_QT)
+		return;
+
+	packet_flush();
+
+	if (backend == LITANY_SOCKET_BACKEND_EPOLL) {
+		PRECOND(poller != NULL);
+
+		poller->remove(this);
+		if (poller->refs == 0) {
+			delete poller;
+			poller = NULL;
+		}
+	} else if (backend == LITANY_SOCKET_BACKEND_URING) {
+		PRECOND(uring != NULL);
+
+		uring->remove(this);
+		if (uring->refs == 0) {
+			delete uring;
+			uring = NULL;
+		}
+	} else {
+		delete notifier;
+	}
+
+	(void)close(fd);
+
+	free(ring);
+	free(tx_ring);
+#endif
+}
+
+/*
+ * Attach an endpoint to this socket, it will start receiving datagrams.
+ */
+void
+LitanySocket::attach(SocketInterface *ep)
+{
+	PRECOND(ep != NULL);
+	PRECOND(!endpoints.contains(ep));
+
+	endpoints.append(ep);
+}
+
+/*
+ * Detach an endpoint from this socket and drop all routes to it.
+ */
+void
+LitanySocket::detach(SocketInterface *ep)
+{
+	QHash<u_int32_t, SocketInterface *>::iterator	it;
+
+	PRECOND(ep != NULL);
+
+	endpoints.removeOne(ep);
+
+	for (it = spis.begin(); it != spis.end();) {
+		if (it.value() == ep)
+			it = spis.erase(it);
+		else
+			++it;
+	}
+
+	if (peers.value(peer_last.value(ep, 0), NULL) == ep)
+		peers.remove(peer_last.value(ep, 0));
+
+	spi_last.remove(ep);
+	peer_last.remove(ep);
+}
+
+/*
+ * Route datagrams carrying the given SPI to the endpoint. The route
+ * for the previous SPI is kept so that packets still in flight under
+ * the old key arrive, anything older than that is dropped.
+ */
+void
+LitanySocket::route_spi(SocketInterface *ep, u_int32_t spi)
+{
+	QHash<u_int32_t, SocketInterface *>::iterator	it;
+	u_int32_t					prev;
+
+	PRECOND(ep != NULL);
+
+	if (spi == 0)
+		return;
+
+	prev = spi_last.value(ep, 0);
+	if (prev == spi)
+		return;
+
+	for (it = spis.begin(); it != spis.end();) {
+		if (it.value() == ep && it.key() != prev)
+			it = spis.erase(it);
+		else
+			++it;
+	}
+
+	spis.insert(spi, ep);
+	spi_last.insert(ep, spi);
+}
+
+/*
+ * Route datagrams coming from the given ip:port to the endpoint.
+ */
+void
+LitanySocket::route_peer(SocketInterface *ep, u_int32_t ip, u_int16_t port)
+{
+	u_int64_t	key;
+
+	PRECOND(ep != NULL);
+
+	key = ((u_int64_t)ip << 16) | port;
+
+	if (peers.value(peer_last.value(ep, 0), NULL) == ep)
+		peers.remove(peer_last.value(ep, 0));
+
+	peers.insert(key, ep);
+	peer_last.insert(ep, key);
+}
+
+/*
+ * Hand a single datagram to the endpoint it belongs too, we look
+ * at the SPI in the header first and at the source ip:port second.
+ * If neither match all endpoints get a copy, if none of them could
+ * use it the datagram is counted as dropped.
+ */
+void
+LitanySocket::dispatch(const void *data, size_t len,
+    u_int32_t ip, u_int16_t port)
+{
+	u_int32_t			spi;
+	bool				used;
+	SocketInterface			*ep;
+	QList<SocketInterface *>	all;
+
+	PRECOND(data != NULL);
+
+	if (endpoints.size() == 1) {
+		(void)endpoints.first()->packet_read(data, len, false);
+		return;
+	}
+
+	if (len >= sizeof(spi)) {
+		memcpy(&spi, data, sizeof(spi));
+		if ((ep = spis.value(be32toh(spi), NULL)) != NULL) {
+			rx_by_spi++;
+			(void)ep->packet_read(data, len, false);
+			return;
+		}
+	}
+
+	if ((ep = peers.value(((u_int64_t)ip << 16) | port, NULL)) != NULL) {
+		rx_by_peer++;
+		(void)ep->packet_read(data, len, false);
+		return;
+	}
+
+	rx_by_all++;
+
+	used = false;
+	all = endpoints;
+
+	for (SocketInterface *obj : all) {
+		if (obj->packet_read(data, len, true) != -1)
+			used = true;
+	}
+
+	if (!used)
+		rx_by_all_drops++;
+}
+
+/*
+ * Called when the socket becomes readable. On Linux we read as many
+ * datagrams as we can fit in the ring with a single recvmmsg() and
+ * dispatch them one by one.
+ */
+void
+LitanySocket::packet_read(void)
+{
+#if defined(__linux__)
+	int			idx, ret;
+#endif
+	qint64			len;
+	QHostAddress		ip;
+	quint16			port;
+	char			packet[LITANY_SOCKET_PACKET_MAX];
+
+	if (backend == LITANY_SOCKET_BACKEND_QT) {
+		len = socket.readDatagram(packet, sizeof(packet), &ip, &port);
+		if (len == -1) {
+			printf("failed to read packet: %d\n", socket.error());
+			return;
+		}
+
+		dispatch(packet, len, ip.toIPv4Address(), port);
+
+		rx_wakeups++;
+		rx_packets++;
+		batch_record(rx_batches, 1);
+		return;
+	}
+
+#if defined(__linux__)
+	for (idx = 0; idx < LITANY_SOCKET_BATCH; idx++)
+		rx_hdr[idx].msg_hdr.msg_namelen = sizeof(rx_addr[idx]);
+
+	if ((ret = recvmmsg(fd, rx_hdr, LITANY_SOCKET_BATCH, 0, NULL)) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			printf("failed to read packets: %d\n", errno);
+		return;
+	}
+
+	if (ret == 0)
+		return;
+
+	for (idx = 0; idx < ret; idx++) {
+		if (rx_hdr[idx].msg_hdr.msg_flags & MSG_TRUNC)
+			continue;
+		dispatch(rx_iov[idx].iov_base, rx_hdr[idx].msg_len,
+		    ntohl(rx_addr[idx].sin_addr.s_addr),
+		    ntohs(rx_addr[idx].sin_port));
+	}
+
+	rx_wakeups++;
+	rx_packets += ret;
+	batch_record(rx_batches, ret);
+
+	/* Anything sent in response can go out right away. */
+	packet_flush();
+#endif
+}
+
+/*
+ * Send a single datagram to the given ip:port.
+ *
+ * On Linux the datagram is copied into the transmit queue which is
+ * flushed when we return to the event loop or when it is full.
+ */
+void
+LitanySocket::send(const void *data, size_t len,
+    const QHostAddress &ip, quint16 port)
+{
+#if defined(__linux__)
+	struct sockaddr_in	*sin;
+#endif
+
+	PRECOND(data != NULL);
+	PRECOND(len > 0);
+
+	if (backend == LITANY_SOCKET_BACKEND_QT) {
+		if (socket.writeDatagram((const char *)data,
+		    len, ip, port) == -1) {
+			printf("failed to write to socket: %d\n",
+			    socket.error());
+		}
+
+		tx_flushes++;
+		tx_packets++;
+		batch_record(tx_batches, 1);
+		return;
+	}
+
+#if defined(__linux__)
+	if (len > LITANY_SOCKET_PACKET_MAX) {
+		printf("dropping oversized packet (%zu)\n", len);
+		return;
+	}
+
+	if (tx_count == LITANY_SOCKET_BATCH) {
+		packet_flush();
+		if (tx_count == LITANY_SOCKET_BATCH) {
+			tx_drops++;
+			return;
+		}
+	}
+
+	sin = &tx_addr[tx_count];
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	sin->sin_addr.s_addr = htonl(ip.toIPv4Address());
+
+	memcpy(tx_iov[tx_count].iov_base, data, len);
+	tx_iov[tx_count].iov_len = len;
+
+	tx_count++;
+
+	if (!tx_timer.isActive())
+		tx_timer.start(0);
+#endif
+}
+
+/*
+ * Write out all queued datagrams using as few sendmmsg() calls as
+ * possible, or in a single io_uring submission with the uring backend.
+ * A datagram the kernel refuses is dropped and we carry on with the
+ * ones after it, the protocol on top of us will retransmit where
+ * required. If the socket buffer is full we keep what is left queued
+ * and try again shortly.
+ */
+void
+LitanySocket::packet_flush(void)
+{
+#if defined(__linux__)
+	int		ret;
+	size_t		off, idx;
+	bool		keep[LITANY_SOCKET_BATCH];
+
+	if (backend == LITANY_SOCKET_BACKEND_QT || tx_count == 0)
+		return;
+
+	tx_timer.stop();
+	tx_flushes++;
+
+	off = 0;
+	memset(keep, 0, sizeof(keep));
+
+	if (backend == LITANY_SOCKET_BACKEND_URING) {
+		uring->send(this, keep);
+		off = tx_count;
+	}
+
+	while (off < tx_count) {
+		ret = sendmmsg(fd, &tx_hdr[off], tx_count - off, 0);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == ENOBUFS) {
+				for (idx = off; idx < tx_count; idx++)
+					keep[idx] = true;
+				break;
+			}
+			printf("failed to write to socket: %d\n", errno);
+			tx_drops++;
+			off++;
+			continue;
+		}
+
+		tx_packets += ret;
+		batch_record(tx_batches, ret);
+
+		off += ret;
+	}
+
+	/* Move what is left to the front of the queue and retry. */
+	for (idx = 0, off = 0; off < tx_count; off++) {
+		if (!keep[off])
+			continue;
+
+		if (idx != off) {
+			memcpy(tx_iov[idx].iov_base,
+			    tx_iov[off].iov_base, tx_iov[off].iov_len);
+			tx_iov[idx].iov_len = tx_iov[off].iov_len;
+			tx_addr[idx] = tx_addr[off];
+		}
+
+		idx++;
+	}
+
+	tx_count = idx;
+
+	if (tx_count > 0)
+		tx_timer.start(LITANY_SOCKET_TX_RETRY);
+#endif
+}
+
+/*
+ * Record how many datagrams were handled in a single syscall.
+ */
+void
+LitanySocket::batch_record(u_int64_t *hist, size_t count)
+{
+	size_t		bucket;
+
+	PRECOND(hist != NULL);
+	PRECOND(count > 0);
+
+	for (bucket = 0; bucket < LITANY_SOCKET_BUCKETS - 1 &&
+	    (count >> (bucket + 1)) != 0; bucket++)
+		;
+
+	hist[bucket]++;
+}
+
+/*
+ * Format our socket statistics into the given buffer.
+ */
+void
+LitanySocket::stats(char *buf, size_t len)
+{
+	int		ret;
+	const char	*name;
+
+	PRECOND(buf != NULL);
+	PRECOND(len > 0);
+
+	switch (backend) {
+	case LITANY_SOCKET_BACKEND_QT:
+		name = "qt";
+		break;
+	case LITANY_SOCKET_BACKEND_MMSG:
+		name = "mmsg";
+		break;
+	case LITANY_SOCKET_BACKEND_EPOLL:
+		name = "epoll";
+		break;
+	case LITANY_SOCKET_BACKEND_URING:
+		name = "uring";
+		break;
+	default:
+		fatal("unknown socket backend %d", backend);
+	}
+
+	ret = snprintf(buf, len, "%s: "
+	    "rx %" PRIu64 " pkts in %" PRIu64 " wakeups "
+	    "[%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+	    " %" PRIu64 "], tx %" PRIu64 " pkts in %" PRIu64 " flushes "
+	    "[%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+	    " %" PRIu64 "], dropped %" PRIu64 ", routed spi=%" PRIu64
+	    " peer=%" PRIu64 " all=%" PRIu64 " (%" PRIu64 " unused)", name,
+	    rx_packets, rx_wakeups, rx_batches[0], rx_batches[1],
+	    rx_batches[2], rx_batches[3], rx_batches[4], rx_batches[5],
+	    tx_packets, tx_flushes, tx_batches[0], tx_batches[1],
+	    tx_batches[2], tx_batches[3], tx_batches[4], tx_batches[5],
+	    tx_drops, rx_by_spi, rx_by_peer, rx_by_all, rx_by_all_drops);
+	if (ret == -1 || (size_t)ret >= len)
+		fatal("socket stats did not fit");
+}
+
+/*
+ * Returns the backend all sockets use, taken from the LITANY_IO
+ * environment variable the first time we are called.
+ */
+static int
+socket_backend(void)
+{
+	static const int	backend = []() {
+		const char	*env;
+
+		if ((env = getenv("LITANY_IO")) == NULL) {
+#if defined(__linux__)
+			return (LITANY_SOCKET_BACKEND_MMSG);
+#else
+			return (LITANY_SOCKET_BACKEND_QT);
+#endif
+		}
+
+		if (!strcmp(env, "qt"))
+			return (LITANY_SOCKET_BACKEND_QT);
+
+#if defined(__linux__)
+		if (!strcmp(env, "mmsg"))
+			return (LITANY_SOCKET_BACKEND_MMSG);
+
+		if (!strcmp(env, "epoll"))
+			return (LITANY_SOCKET_BACKEND_EPOLL);
+
+		if (!strcmp(env, "uring")) {
+			if (SocketRing::supported())
+				return (LITANY_SOCKET_BACKEND_URING);
+			printf("io_uring not available, using epoll\n");
+			return (LITANY_SOCKET_BACKEND_EPOLL);
+		}
+#endif
+
+		fatal("LITANY_IO: unsupported backend '%s'", env);
+	}();
+
+	return (backend);
+}
+
+#if defined(__linux__)
+/*
+ * Create the epoll instance for the calling thread, its event loop
+ * only watches the epoll descriptor itself.
+ */
+SocketPoller::SocketPoller(void)
+{
+	refs = 0;
+
+	if ((efd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		fatal("epoll_create1: %d", errno);
+
+	notifier = new QSocketNotifier(efd, QSocketNotifier::Read);
+	QObject::connect(notifier, &QSocketNotifier::activated,
+	    notifier, [this]() { run(); });
+}
+
+/*
+ * Close the epoll instance, all sockets must have been removed.
+ */
+SocketPoller::~SocketPoller(void)
+{
+	PRECOND(refs == 0);
+
+	delete notifier;
+	(void)close(efd);
+}
+
+/*
+ * Start watching the given socket for incoming datagrams.
+ */
+void
+SocketPoller::add(LitanySocket *sock)
+{
+	struct epoll_event	evt;
+
+	PRECOND(sock != NULL);
+
+	memset(&evt, 0, sizeof(evt));
+	evt.events = EPOLLIN;
+	evt.data.ptr = sock;
+
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, sock->fd, &evt) == -1)
+		fatal("epoll_ctl(add): %d", errno);
+
+	refs++;
+}
+
+/*
+ * Stop watching the given socket.
+ */
+void
+SocketPoller::remove(LitanySocket *sock)
+{
+	PRECOND(sock != NULL);
+	PRECOND(refs > 0);
+
+	if (epoll_ctl(efd, EPOLL_CTL_DEL, sock->fd, NULL) == -1)
+		fatal("epoll_ctl(del): %d", errno);
+
+	refs--;
+}
+
+/*
+ * Our epoll descriptor became readable, let every ready socket drain
+ * itself. We are level triggered, a socket that still has datagrams
+ * left after its batch shows up again on our next wakeup.
+ */
+void
+SocketPoller::run(void)
+{
+	int		idx, ret;
+
+	if ((ret = epoll_wait(efd, events,
+	    LITANY_SOCKET_POLL_EVENTS, 0)) == -1) {
+		if (errno != EINTR)
+			printf("epoll_wait: %d\n", errno);
+		return;
+	}
+
+	for (idx = 0; idx < ret; idx++)
+		((LitanySocket *)events[idx].data.ptr)->packet_read();
+}
+
+/*
+ * Create the io_uring instance for the calling thread and map its
+ * queues, the event loop only watches the eventfd it signals.
+ */
+SocketRing::SocketRing(void)
+{
+	struct io_uring_params		params;
+
+	refs = 0;
+	sq_local = 0;
+	bgid_next = 0;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = LITANY_SOCKET_URING_CQ;
+
+	if ((fd = syscall(__NR_io_uring_setup,
+	    LITANY_SOCKET_URING_SQ, &params)) == -1)
+		fatal("io_uring_setup: %d", errno);
+
+	sq_len = params.sq_off.array + params.sq_entries * sizeof(u_int32_t);
+	cq_len = params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_len > sq_len)
+			sq_len = cq_len;
+		cq_len = sq_len;
+	}
+
+	if ((sq_map = (u_int8_t *)mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+		fatal("mmap(sq): %d", errno);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_map = sq_map;
+	} else if ((cq_map = (u_int8_t *)mmap(NULL, cq_len,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		fatal("mmap(cq): %d", errno);
+	}
+
+	sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	if ((sqes = (struct io_uring_sqe *)mmap(NULL, sqes_len,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    fd, IORING_OFF_SQES)) == MAP_FAILED)
+		fatal("mmap(sqes): %d", errno);
+
+	sq_entries = params.sq_entries;
+	sq_head = (u_int32_t *)(sq_map + params.sq_off.head);
+	sq_tail = (u_int32_t *)(sq_map + params.sq_off.tail);
+	sq_flags = (u_int32_t *)(sq_map + params.sq_off.flags);
+	sq_array = (u_int32_t *)(sq_map + params.sq_off.array);
+	sq_mask = *(u_int32_t *)(sq_map + params.sq_off.ring_mask);
+
+	cq_head = (u_int32_t *)(cq_map + params.cq_off.head);
+	cq_tail = (u_int32_t *)(cq_map + params.cq_off.tail);
+	cq_flags = (u_int32_t *)(cq_map + params.cq_off.flags);
+	cqes = (struct io_uring_cqe *)(cq_map + params.cq_off.cqes);
+	cq_mask = *(u_int32_t *)(cq_map + params.cq_off.ring_mask);
+
+	sq_local = *sq_tail;
+
+	if ((evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		fatal("eventfd: %d", errno);
+
+	if (syscall(__NR_io_uring_register, fd,
+	    IORING_REGISTER_EVENTFD, &evfd, 1) == -1)
+		fatal("io_uring_register(eventfd): %d", errno);
+
+	notifier = new QSocketNotifier(evfd, QSocketNotifier::Read);
+	QObject::connect(notifier, &QSocketNotifier::activated,
+	    notifier, [this]() { run(); });
+}
+
+/*
+ * Tear down the io_uring instance, all sockets must have been removed.
+ */
+SocketRing::~SocketRing(void)
+{
+	PRECOND(refs == 0);
+
+	delete notifier;
+
+	(void)munmap(sqes, sqes_len);
+	if (cq_map != sq_map)
+		(void)munmap(cq_map, cq_len);
+	(void)munmap(sq_map, sq_len);
+
+	(void)close(fd);
+	(void)close(evfd);
+}
+
+/*
+ * Returns true if the kernel lets us use io_uring the way we want.
+ * Multishot recvmsg arrived in the same release as IORING_OP_SEND_ZC,
+ * so that is what we probe for.
+ */
+bool
+SocketRing::supported(void)
+{
+	int				fd;
+	bool				ok;
+	size_t				len;
+	struct io_uring_params		params;
+	struct io_uring_probe		*probe;
+
+	memset(&params, 0, sizeof(params));
+
+	if ((fd = syscall(__NR_io_uring_setup, 2, &params)) == -1)
+		return (false);
+
+	len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	if ((probe = (struct io_uring_probe *)calloc(1, len)) == NULL)
+		fatal("calloc: failed to allocate io_uring probe");
+
+	ok = syscall(__NR_io_uring_register, fd,
+	    IORING_REGISTER_PROBE, probe, 256) == 0 &&
+	    probe->last_op >= IORING_OP_SEND_ZC &&
+	    (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+	(void)close(fd);
+
+	return (ok);
+}
+
+/*
+ * Register a buffer group for the given socket, hand the kernel all
+ * of its receive buffers and start receiving on it.
+ */
+void
+SocketRing::add(LitanySocket *sock)
+{
+	u_int16_t			bid;
+	struct io_uring_buf_reg		reg;
+
+	PRECOND(sock != NULL);
+
+	if (!bgid_free.isEmpty())
+		sock->rx_bgid = bgid_free.takeLast();
+	else
+		sock->rx_bgid = bgid_next++;
+
+	if ((sock->rx_bufs = (struct io_uring_buf *)mmap(NULL,
+	    LITANY_SOCKET_URING_BUFS * sizeof(struct io_uring_buf),
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+	    -1, 0)) == MAP_FAILED)
+		fatal("mmap(bufs): %d", errno);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (u_int64_t)(uintptr_t)sock->rx_bufs;
+	reg.ring_entries = LITANY_SOCKET_URING_BUFS;
+	reg.bgid = sock->rx_bgid;
+
+	if (syscall(__NR_io_uring_register, fd,
+	    IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		fatal("io_uring_register(pbuf): %d", errno);
+
+	sock->rx_tail = 0;
+	for (bid = 0; bid < LITANY_SOCKET_URING_BUFS; bid++)
+		buffer_add(sock, bid);
+
+	sockets.append(sock);
+	refs++;
+
+	arm(sock);
+}
+
+/*
+ * Stop receiving on the given socket and release its buffer group.
+ * We wait for the final completion of its receive so that nothing
+ * on our queues refers to it anymore once we return.
+ */
+void
+SocketRing::remove(LitanySocket *sock)
+{
+	bool				armed;
+	struct io_uring_sqe		*sqe;
+	struct socket_cqe		cqe;
+	struct io_uring_buf_reg		reg;
+	QList<struct socket_cqe>::iterator	it;
+	u_int64_t			tag;
+
+	PRECOND(sock != NULL);
+	PRECOND(refs > 0);
+
+	armed = sock->rx_armed;
+	tag = (u_int64_t)(uintptr_t)sock | SOCKET_URING_RECV;
+
+	for (it = backlog.begin(); it != backlog.end();) {
+		if (it->user_data != tag) {
+			++it;
+			continue;
+		}
+
+		if (!(it->flags & IORING_CQE_F_MORE))
+			armed = false;
+
+		it = backlog.erase(it);
+	}
+
+	if (armed) {
+		sqe = sqe_get();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = tag;
+		sqe->user_data =
+		    (u_int64_t)(uintptr_t)sock | SOCKET_URING_CANCEL;
+
+		events_disable(true);
+		enter(0);
+
+		for (;;) {
+			if (!reap(&cqe)) {
+				enter(1);
+				continue;
+			}
+
+			if (cqe.user_data == tag) {
+				if (!(cqe.flags & IORING_CQE_F_MORE))
+					break;
+				continue;
+			}
+
+			if ((cqe.user_data & SOCKET_URING_MASK) ==
+			    SOCKET_URING_RECV)
+				backlog.append(cqe);
+		}
+
+		events_disable(false);
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = sock->rx_bgid;
+
+	if (syscall(__NR_io_uring_register, fd,
+	    IORING_UNREGISTER_PBUF_RING, &reg, 1) == -1)
+		fatal("io_uring_register(unpbuf): %d", errno);
+
+	(void)munmap(sock->rx_bufs,
+	    LITANY_SOCKET_URING_BUFS * sizeof(struct io_uring_buf));
+
+	sock->rx_bufs = NULL;
+	sock->rx_armed = false;
+
+	bgid_free.append(sock->rx_bgid);
+	sockets.removeOne(sock);
+	refs--;
+}
+
+/*
+ * Submit all datagrams queued on the given socket and wait for the
+ * kernel to tell us how each went. Sends are nonblocking so this
+ * does not take long. The datagrams that could not be sent because
+ * the socket buffer was full are marked in keep.
+ */
+void
+SocketRing::send(LitanySocket *sock, bool *keep)
+{
+	struct io_uring_sqe	*sqe;
+	struct socket_cqe	cqe;
+	size_t			idx, done, sent;
+
+	PRECOND(sock != NULL);
+	PRECOND(keep != NULL);
+	PRECOND(sock->tx_count <= LITANY_SOCKET_BATCH);
+
+	for (idx = 0; idx < sock->tx_count; idx++) {
+		sqe = sqe_get();
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = sock->fd;
+		sqe->addr = (u_int64_t)(uintptr_t)&sock->tx_hdr[idx].msg_hdr;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_DONTWAIT;
+		sqe->user_data =
+		    (idx << SOCKET_URING_SHIFT) | SOCKET_URING_SEND;
+	}
+
+	events_disable(true);
+	enter(sock->tx_count);
+
+	done = 0;
+	sent = 0;
+
+	while (done < sock->tx_count) {
+		if (!reap(&cqe)) {
+			enter(1);
+			continue;
+		}
+
+		switch (cqe.user_data & SOCKET_URING_MASK) {
+		case SOCKET_URING_SEND:
+			break;
+		case SOCKET_URING_RECV:
+			backlog.append(cqe);
+			continue;
+		default:
+			continue;
+		}
+
+		done++;
+		idx = cqe.user_data >> SOCKET_URING_SHIFT;
+
+		if (cqe.res >= 0) {
+			sent++;
+			continue;
+		}
+
+		if (cqe.res == -EAGAIN || cqe.res == -ENOBUFS) {
+			keep[idx] = true;
+			continue;
+		}
+
+		printf("failed to write to socket: %d\n", -cqe.res);
+		sock->tx_drops++;
+	}
+
+	events_disable(false);
+
+	if (sent > 0) {
+		sock->tx_packets += sent;
+		sock->batch_record(sock->tx_batches, sent);
+	}
+}
+
+/*
+ * Our eventfd became readable, handle all completions and flush
+ * whatever the sockets that received datagrams queued in response.
+ */
+void
+SocketRing::run(void)
+{
+	u_int64_t			count;
+	struct socket_cqe		cqe;
+	QList<LitanySocket *>		all;
+
+	(void)read(evfd, &count, sizeof(count));
+
+	while (next(&cqe)) {
+		if ((cqe.user_data & SOCKET_URING_MASK) != SOCKET_URING_RECV)
+			continue;
+
+		recv((LitanySocket *)(uintptr_t)
+		    (cqe.user_data & ~(u_int64_t)SOCKET_URING_MASK), &cqe);
+	}
+
+	all = sockets;
+	for (LitanySocket *sock : all) {
+		if (sock->rx_batch == 0)
+			continue;
+
+		sock->rx_wakeups++;
+		sock->batch_record(sock->rx_batches, sock->rx_batch);
+		sock->rx_batch = 0;
+
+		sock->packet_flush();
+	}
+}
+
+/*
+ * Arm a multishot recvmsg on the given socket, it keeps completing
+ * for each datagram until it runs out of buffers or fails.
+ */
+void
+SocketRing::arm(LitanySocket *sock)
+{
+	struct io_uring_sqe	*sqe;
+
+	PRECOND(sock != NULL);
+	PRECOND(!sock->rx_armed);
+
+	sqe = sqe_get();
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sock->fd;
+	sqe->addr = (u_int64_t)(uintptr_t)&sock->rx_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = sock->rx_bgid;
+	sqe->user_data = (u_int64_t)(uintptr_t)sock | SOCKET_URING_RECV;
+
+	sock->rx_armed = true;
+
+	enter(0);
+}
+
+/*
+ * Handle a receive completion for the given socket, dispatch the
+ * datagram it carries and give its buffer back to the kernel. When
+ * the receive is done we arm it again, unless it was cancelled.
+ */
+void
+SocketRing::recv(LitanySocket *sock, const struct socket_cqe *cqe)
+{
+	u_int16_t			bid;
+	size_t				hdr;
+	u_int8_t			*buf;
+	struct sockaddr_in		sin;
+	struct io_uring_recvmsg_out	*out;
+
+	PRECOND(sock != NULL);
+	PRECOND(cqe != NULL);
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		buf = &sock->ring[bid * LITANY_SOCKET_URING_BUF_SIZE];
+
+		out = (struct io_uring_recvmsg_out *)buf;
+		hdr = sizeof(*out) + sock->rx_msg.msg_namelen;
+
+		if (cqe->res > 0 && (size_t)cqe->res >= hdr &&
+		    !(out->flags & MSG_TRUNC) && out->namelen >= sizeof(sin)) {
+			memcpy(&sin, out + 1, sizeof(sin));
+			sock->dispatch(buf + hdr, cqe->res - hdr,
+			    ntohl(sin.sin_addr.s_addr), ntohs(sin.sin_port));
+
+			sock->rx_batch++;
+			sock->rx_packets++;
+		}
+
+		buffer_add(sock, bid);
+	}
+
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return;
+
+	sock->rx_armed = false;
+
+	if (cqe->res == -ECANCELED)
+		return;
+
+	if (cqe->res < 0 && cqe->res != -ENOBUFS)
+		printf("failed to read packets: %d\n", -cqe->res);
+
+	arm(sock);
+}
+
+/*
+ * Give the receive buffer with the given id back to the kernel.
+ *
+ * The ring tail overlays the resv field of the first entry, we do
+ * not use struct io_uring_buf_ring as its flexible array ends up at
+ * the wrong offset when compiled as C++.
+ */
+void
+SocketRing::buffer_add(LitanySocket *sock, u_int16_t bid)
+{
+	struct io_uring_buf	*buf;
+
+	PRECOND(sock != NULL);
+	PRECOND(bid < LITANY_SOCKET_URING_BUFS);
+
+	buf = &sock->rx_bufs[sock->rx_tail & (LITANY_SOCKET_URING_BUFS - 1)];
+
+	buf->bid = bid;
+	buf->len = LITANY_SOCKET_URING_BUF_SIZE;
+	buf->addr = (u_int64_t)(uintptr_t)
+	    &sock->ring[bid * LITANY_SOCKET_URING_BUF_SIZE];
+
+	sock->rx_tail++;
+	__atomic_store_n(&sock->rx_bufs[0].resv,
+	    sock->rx_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the next free submission queue entry, it is handed to the
+ * kernel on the next call to enter().
+ */
+struct io_uring_sqe *
+SocketRing::sqe_get(void)
+{
+	u_int32_t		idx;
+	struct io_uring_sqe	*sqe;
+
+	if (sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >=
+	    sq_entries)
+		fatal("io_uring submission queue full");
+
+	idx = sq_local & sq_mask;
+	sqe = &sqes[idx];
+	sq_array[idx] = idx;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sq_local++;
+
+	return (sqe);
+}
+
+/*
+ * Submit all pending entries and wait until there are at least
+ * the given number of completions on the completion queue.
+ */
+void
+SocketRing::enter(u_int32_t wait)
+{
+	u_int32_t	submit;
+
+	__atomic_store_n(sq_tail, sq_local, __ATOMIC_RELEASE);
+	submit = sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+	while (syscall(__NR_io_uring_enter, fd, submit, wait,
+	    IORING_ENTER_GETEVENTS, NULL, 0) == -1) {
+		if (errno != EINTR)
+			fatal("io_uring_enter: %d", errno);
+		submit = sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	}
+}
+
+/*
+ * Take the next completion off the completion queue, if any.
+ */
+bool
+SocketRing::reap(struct socket_cqe *out)
+{
+	u_int32_t		head;
+	struct io_uring_cqe	*cqe;
+
+	PRECOND(out != NULL);
+
+	head = *cq_head;
+
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		if (!(__atomic_load_n(sq_flags, __ATOMIC_RELAXED) &
+		    IORING_SQ_CQ_OVERFLOW))
+			return (false);
+
+		/* The kernel kept some for us, have it post them. */
+		enter(0);
+		if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+			return (false);
+	}
+
+	cqe = &cqes[head & cq_mask];
+
+	out->res = cqe->res;
+	out->flags = cqe->flags;
+	out->user_data = cqe->user_data;
+
+	__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return (true);
+}
+
+/*
+ * Returns the next completion to handle, those we set aside first.
+ */
+bool
+SocketRing::next(struct socket_cqe *out)
+{
+	PRECOND(out != NULL);
+
+	if (!backlog.isEmpty()) {
+		*out = backlog.takeFirst();
+		return (true);
+	}
+
+	return (reap(out));
+}
+
+/*
+ * Stop or resume signalling our eventfd for new completions, we stop
+ * while reaping completions ourselves outside of run(). On resume we
+ * signal it if anything is left, nothing would wake us up otherwise.
+ */
+void
+SocketRing::events_disable(bool disable)
+{
+	u_int64_t	one;
+
+	if (disable) {
+		__atomic_fetch_or(cq_flags,
+		    IORING_CQ_EVENTFD_DISABLED, __ATOMIC_RELEASE);
+		return;
+	}
+
+	__atomic_fetch_and(cq_flags,
+	    ~IORING_CQ_EVENTFD_DISABLED, __ATOMIC_RELEASE);
+
+	if (backlog.isEmpty() &&
+	    *cq_head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		return;
+
+	one = 1;
+	if (write(evfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		fatal("write(eventfd): %d", errno);
+}
+#endif
@@ -21,13 +21,32 @@
 #include <netinet/in.h>
 #endif
 
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "litany.h"
 
+/* We can use libnyfe because its included in libkyrka. */
+extern "C" void	nyfe_mem_zero(void *, size_t);
+
 static int	text_validate(const u_int8_t *, size_t);
+static void	frame_dispatch(Tunnel *, struct litany_msg_data *);
+static void	legacy_dispatch(Tunnel *, struct litany_msg_data *);
+static void	legacy_trailer(Tunnel *, struct litany_msg_data *);
+static void	record_dispatch(Tunnel *, u_int8_t, const u_int8_t *, size_t);
+
+static void	tunnel_ack(void *);
+static void	tunnel_keys(void *);
+static void	tunnel_frame(void *);
+static void	tunnel_xfer(void *);
+static void	tunnel_pacer(void *);
+static void	tunnel_reassembly(void *);
+static void	tunnel_notify(void *);
+static void	tunnel_resend(void *);
+static void	tunnel_offline(void *);
+static void	tunnel_heartbeat(void *);
 
 static void	kyrka_event(KYRKA *, union kyrka_event *, void *);
 static void	heaven_send(const void *, size_t, u_int64_t, void *);
@@ -48,17 +67,39 @@ TunnelInterface::message_show(const char *msg, u_int64_t id,
 	fatal("TunnelInterface::message_show not overriden");
 }
 
+/*
+ * The message_text() function that consumers must re-implement.
+ */
+void
+TunnelInterface::message_text(u_int8_t peer, u_int64_t id,
+    Qt::GlobalColor color, const u_int8_t *text, size_t len)
+{
+	(void)peer;
+	(void)id;
+	(void)color;
+	(void)text;
+	(void)len;
+
+	fatal("TunnelInterface::message_text not overriden");
+}
+
 /*
  * Setup a tunnel to the given target.
  *
  * This is entirely self-contained, multiple tunnel objects
  * can live in unison together with each other.
  *
+ * If sock is not NULL the tunnel becomes an endpoint on that shared
+ * socket, otherwise the tunnel creates its own socket.
+ *
  * The JSON config should contain the following:
  *	flock kek-id kek-path cs-id cs-path cathedral:port
+ *
+ * Optionally it contains xfer-max-size, the largest file in MiB we
+ * accept from our peer.
  */
 Tunnel::Tunnel(TunnelInterface *obj, QJsonObject *config,
-    u_int8_t peer, bool group)
+    LitanySocket *sock, u_int8_t peer, bool group)
 {
 	bool					ok;
 	struct kyrka_cathedral_cfg		cfg;
@@ -76,6 +117,16 @@ Tunnel::Tunnel(TunnelInterface *obj, QJsonObject *config,
 	owner = obj;
 	peer_id = peer;
 
+	if (sock == NULL) {
+		socket_shared = false;
+		socket = new LitanySocket();
+	} else {
+		socket = sock;
+		socket_shared = true;
+	}
+
+	socket->attach(this);
+
 	cfg.udata = this;
 	cfg.send = cathedral_send;
 
@@ -129,24 +180,60 @@ Tunnel::Tunnel(TunnelInterface *obj, QJsonObject *config,
 	free(cs_path);
 	free(kek_path);
 
-	socket.bind(QHostAddress::AnyIPv4);
-
-	last_notify = 0;
+	hb_sent = 0;
+	last_send = 0;
+	acks_count = 0;
 	last_update = 0;
-	last_heartbeat = 0;
-	TAILQ_INIT(&msgs);
-
-	flush.setInterval(1000);
-	manager.setInterval(500);
-
-	connect(&manager, &QTimer::timeout, this, &Tunnel::manage);
-	connect(&flush, &QTimer::timeout, this, &Tunnel::resend_pending);
-	connect(&socket, &QUdpSocket::readyRead, this, &Tunnel::packet_read);
-
-	last_notify = 0;
+	hb_suppressed = 0;
+	hb_interval = TUNNEL_HEARTBEAT_INTERVAL;
+	frame_len = 0;
+	frame_data = false;
+	peer_legacy = false;
+	tx_frames = 0;
+	tx_records = 0;
+	memset(&frame, 0, sizeof(frame));
+	litany_rtt_init(&rtt);
+	litany_msg_store_init(&msgs);
+	litany_reassembly_init(&reasm);
+
+	cc_acked = 0;
+	cc_losses = 0;
+	cc_recovery = 0;
+	cc_ssthresh = TUNNEL_CC_CWND_MAX;
+	cc_cwnd = TUNNEL_CC_CWND_INITIAL;
+
+	pacer_drops = 0;
+	pacer_queued = 0;
+	pacer_last = litany_msec();
+	pacer_tokens = TUNNEL_PACER_BURST * 1000;
+	TAILQ_INIT(&pacer_queue);
+
+	xfer_tx = NULL;
+	xfer_rx = NULL;
+	xfer_last_id = 0;
+	xfer_last_status = 0;
+
+	if (config->contains("xfer-max-size")) {
+		xfer_max = litany_json_number(config, "xfer-max-size",
+		    ULLONG_MAX / (1024 * 1024)) * 1024 * 1024;
+	} else {
+		xfer_max = (u_int64_t)XFER_SIZE_MAX * 1024 * 1024;
+	}
 
-	flush.start();
-	manager.start();
+	TimerWheel::timer_init(&ack_timer, tunnel_ack, this);
+	TimerWheel::timer_init(&keys_timer, tunnel_keys, this);
+	TimerWheel::timer_init(&frame_timer, tunnel_frame, this);
+	TimerWheel::timer_init(&xfer_timer, tunnel_xfer, this);
+	TimerWheel::timer_init(&pacer_timer, tunnel_pacer, this);
+	TimerWheel::timer_init(&reasm_timer, tunnel_reassembly, this);
+	TimerWheel::timer_init(&notify_timer, tunnel_notify, this);
+	TimerWheel::timer_init(&resend_timer, tunnel_resend, this);
+	TimerWheel::timer_init(&offline_timer, tunnel_offline, this);
+	TimerWheel::timer_init(&heartbeat_timer, tunnel_heartbeat, this);
+
+	wheel->timer_add(&notify_timer, 0);
+	wheel->timer_add(&keys_timer, TUNNEL_KEYS_INTERVAL);
+	wheel->timer_add(&heartbeat_timer, TUNNEL_HEARTBEAT_INTERVAL);
 
 	system_msg("[cathedral]: address %s:%u",
 	    cathedral_address.toString().toUtf8().data(), cathedral_port);
@@ -157,77 +244,164 @@ Tunnel::Tunnel(TunnelInterface *obj, QJsonObject *config,
  */
 Tunnel::~Tunnel(void)
 {
-	struct litany_msg	*msg;
+	struct tunnel_frame	*tf;
+
+	delete xfer_tx;
+	delete xfer_rx;
 
-	while ((msg = TAILQ_FIRST(&msgs)) != NULL) {
-		TAILQ_REMOVE(&msgs, msg, list);
-		free(msg);
+	ack_flush();
+	frame_flush();
+
+	while ((tf = TAILQ_FIRST(&pacer_queue)) != NULL) {
+		TAILQ_REMOVE(&pacer_queue, tf, list);
+		nyfe_mem_zero(tf, sizeof(*tf));
+		free(tf);
 	}
 
+	litany_msg_store_cleanup(&msgs);
+	litany_reassembly_cleanup(&reasm);
+
+	wheel->timer_cancel(&ack_timer);
+	wheel->timer_cancel(&keys_timer);
+	wheel->timer_cancel(&frame_timer);
+	wheel->timer_cancel(&xfer_timer);
+	wheel->timer_cancel(&pacer_timer);
+	wheel->timer_cancel(&reasm_timer);
+	wheel->timer_cancel(&notify_timer);
+	wheel->timer_cancel(&resend_timer);
+	wheel->timer_cancel(&offline_timer);
+	wheel->timer_cancel(&heartbeat_timer);
+
+	socket->detach(this);
+	if (!socket_shared)
+		delete socket;
+
 	kyrka_ctx_free(kyrka);
 }
 
 /*
- * Manage the tunnel by periodically sending a cathedral notification
- * or making forward progress on our keying.
- * 
- * We also send heartbeat packets every second to our peer, this helps
- * facilitate holepunching and to detect if a peer has gone "offline".
+ * Make forward progress on our keying, called from the timer wheel
+ * every TUNNEL_KEYS_INTERVAL milliseconds.
  */
 void
-Tunnel::manage(void)
+Tunnel::key_manage(void)
 {
-	struct timespec		ts;
-
-	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
-
 	if (kyrka_key_manage(kyrka) == -1 &&
 	    kyrka_last_error(kyrka) != KYRKA_ERROR_NO_SECRET)
 		fatal("kyrka_key_manage: %d", kyrka_last_error(kyrka));
 
-	if ((ts.tv_sec - last_notify) >= 5) {
-		last_notify = ts.tv_sec;
+	wheel->timer_add(&keys_timer, TUNNEL_KEYS_INTERVAL);
+}
 
-		if (kyrka_cathedral_notify(kyrka) == -1) {
-			fatal("kyrka_cathedral_notify: %d",
-			    kyrka_last_error(kyrka));
-		}
+/*
+ * Periodically send a cathedral notification and NAT detection
+ * so the cathedral knows where we are.
+ */
+void
+Tunnel::cathedral_notify(void)
+{
+	if (kyrka_cathedral_notify(kyrka) == -1)
+		fatal("kyrka_cathedral_notify: %d", kyrka_last_error(kyrka));
 
-		if (kyrka_cathedral_nat_detection(kyrka) == -1) {
-			fatal("kyrka_cathedral_nat_detection: %d",
-			    kyrka_last_error(kyrka));
-		}
+	if (kyrka_cathedral_nat_detection(kyrka) == -1) {
+		fatal("kyrka_cathedral_nat_detection: %d",
+		    kyrka_last_error(kyrka));
+	}
+
+	wheel->timer_add(&notify_timer, TUNNEL_NOTIFY_INTERVAL);
+}
+
+/*
+ * We send heartbeat packets to our peer, this helps facilitate
+ * holepunching and to detect if a peer has gone "offline".
+ *
+ * Any frame we send proves we are alive, so a heartbeat is only sent
+ * if nothing else went out in the last hb_interval or is about to go
+ * out. While our peer is offline we heartbeat every
+ * TUNNEL_HEARTBEAT_INTERVAL, once it is online the interval doubles
+ * each time we had to send one, up to TUNNEL_HEARTBEAT_IDLE.
+ */
+void
+Tunnel::heartbeat(void)
+{
+	u_int64_t	now;
+
+	now = litany_msec();
+
+	if (last_update == 0)
+		hb_interval = TUNNEL_HEARTBEAT_INTERVAL;
+
+	if (frame_len > 0) {
+		hb_suppressed++;
+		wheel->timer_add(&heartbeat_timer, hb_interval);
+		return;
 	}
 
-	if ((ts.tv_sec - last_heartbeat) >= 1) {
-		last_heartbeat = ts.tv_sec;
-		send_heartbeat();
+	if (last_send != 0 && (now - last_send) < hb_interval) {
+		hb_suppressed++;
+		wheel->timer_add(&heartbeat_timer,
+		    hb_interval - (now - last_send));
+		return;
 	}
 
-	if (last_update != 0 && (ts.tv_sec - last_update) >= 10) {
-		system_msg("[peer]: offline (peer closed window or timeout)");
-		last_update = 0;
+	hb_sent++;
+	send_heartbeat();
+
+	if (last_update != 0) {
+		hb_interval *= 2;
+		if (hb_interval > TUNNEL_HEARTBEAT_IDLE)
+			hb_interval = TUNNEL_HEARTBEAT_IDLE;
 	}
+
+	wheel->timer_add(&heartbeat_timer, hb_interval);
 }
 
 /*
- * Qt calls this when a packet can be read from the underlying udp socket.
- * We read it and feed it into libkyrka which will handle the rest.
+ * Check if we heard from our peer recently, this timer is only armed
+ * while the peer is considered online.
  */
 void
-Tunnel::packet_read(void)
+Tunnel::offline_check(void)
 {
-	qint64		len;
-	char		packet[1500];
+	u_int64_t	now;
 
-	if ((len = socket.readDatagram(packet, sizeof(packet))) == -1) {
-		printf("failed to read packet: %d\n", socket.error());
+	if (last_update == 0)
 		return;
+
+	now = litany_msec();
+
+	if ((now - last_update) >= TUNNEL_OFFLINE_TIMEOUT) {
+		system_msg("[peer]: offline (peer closed window or timeout)");
+		last_update = 0;
+		hb_interval = TUNNEL_HEARTBEAT_INTERVAL;
+		wheel->timer_add(&heartbeat_timer, hb_interval);
+	} else {
+		wheel->timer_add(&offline_timer,
+		    TUNNEL_OFFLINE_TIMEOUT - (now - last_update));
+	}
+}
+
+/*
+ * Our socket calls this for each datagram it read, we feed it
+ * into libkyrka which will handle the rest. A broadcast datagram
+ * that libkyrka rejects was most likely meant for another tunnel.
+ */
+int
+Tunnel::packet_read(const void *packet, size_t len, bool broadcast)
+{
+	PRECOND(packet != NULL);
+
+	if (kyrka_purgatory_input(kyrka, packet, len) == -1) {
+		if (broadcast)
+			return (-1);
+
+		if (kyrka_last_error(kyrka) != KYRKA_ERROR_NO_RX_KEY) {
+			fatal("kyrka_purgatory_input: %d",
+			    kyrka_last_error(kyrka));
+		}
 	}
 
-	if (kyrka_purgatory_input(kyrka, packet, len) == -1 &&
-	    kyrka_last_error(kyrka) != KYRKA_ERROR_NO_RX_KEY)
-		fatal("kyrka_purgatory_input: %d", kyrka_last_error(kyrka));
+	return (0);
 }
 
 /*
@@ -256,303 +430,1339 @@ Tunnel::socket_send(const void *data, size_t len, int is_cathedral, int is_nat)
 		dport = peer_port;
 	}
 
-	if (socket.writeDatagram((const char *)data, len, ip, dport) == -1)
-		printf("failed to write to socket: %d\n", socket.error());
+	socket->send(data, len, ip, dport);
 }
 
 /*
- * Send a text packet to our peer.
+ * Send a text message to our peer, made up out of the given bodies.
+ * These are shared with the other tunnels the message is sent on,
+ * only the message ids are our own.
  */
 void
-Tunnel::send_text(const void *data, size_t len)
+Tunnel::send_text(struct litany_msg_body **bodies, size_t count)
 {
+	size_t			idx;
 	struct litany_msg	*msg;
 
-	PRECOND(data != NULL);
-	PRECOND(len > 0 && len < LITANY_MESSAGE_MAX_SIZE);
+	PRECOND(bodies != NULL);
+	PRECOND(count > 0 && count <= LITANY_FRAGMENT_MAX);
+
+	if (peer_legacy && count > 1) {
+		system_msg("[%02x] message too long for the old message "
+		    "format of this peer", peer_id);
+		return;
+	}
+
+	for (idx = 0; idx < count; idx++) {
+		msg = litany_msg_register(&msgs, bodies[idx], rtt.rto);
+		frame_msg(msg);
+	}
 
-	msg = litany_msg_register(&msgs, data, len);
-	send_msg(&msg->data);
+	if (!resend_timer.armed)
+		resend_schedule();
 }
 
 /*
- * Send an ack for the given id to our peer.
+ * Queue an ack for the given id to our peer. Queued acks ride along
+ * with the next frame we send, if none goes out within
+ * TUNNEL_ACK_DELAY they are sent in a frame of their own.
+ *
+ * A peer using the old message format gets a bare ACK right away.
  */
 void
 Tunnel::send_ack(u_int64_t id)
 {
-	struct litany_msg_data		data;
-
 	PRECOND(id != LITANY_MESSAGE_SYSTEM_ID);
 
-	memset(&data, 0, sizeof(data));
+	if (peer_legacy) {
+		legacy_send(LITANY_MESSAGE_TYPE_ACK, id, NULL, 0);
+		return;
+	}
+
+	if (acks_count == LITANY_MESSAGE_ACKS_MAX)
+		ack_flush();
 
-	data.id = htobe64(id);
-	data.type = LITANY_MESSAGE_TYPE_ACK;
+	acks[acks_count++] = htobe64(id);
 
-	send_msg(&data);
+	if (!ack_timer.armed)
+		wheel->timer_add(&ack_timer, TUNNEL_ACK_DELAY);
 }
 
 /*
- * Send a simple heartbeat to our peer.
+ * Send all queued acks to our peer, together with anything else
+ * that is waiting in the current frame.
  */
 void
-Tunnel::send_heartbeat(void)
+Tunnel::ack_flush(void)
 {
-	struct litany_msg_data		data;
-
-	memset(&data, 0, sizeof(data));
-
-	data.id = ULONG_MAX;
-	data.type = LITANY_MESSAGE_TYPE_HEARTBEAT;
+	wheel->timer_cancel(&ack_timer);
 
-	send_msg(&data);
+	while (acks_count > 0) {
+		frame_acks();
+		frame_flush();
+	}
 }
 
 /*
- * Submit a message to our peer, if we are required to record it for
- * delivery we do so and we will retransmit it after a few seconds
- * unless we received an ack for it.
+ * Queue a heartbeat record to our peer.
  */
 void
-Tunnel::send_msg(struct litany_msg_data *msg)
+Tunnel::send_heartbeat(void)
 {
-	PRECOND(msg != NULL);
+	if (peer_legacy) {
+		legacy_send(LITANY_MESSAGE_TYPE_HEARTBEAT,
+		    ULONG_MAX, NULL, 0);
+		return;
+	}
 
-	if (kyrka_heaven_input(kyrka, msg, sizeof(*msg)) == -1 &&
-	    kyrka_last_error(kyrka) != KYRKA_ERROR_NO_TX_KEY)
-		fatal("kyrka_heaven_input: %d", kyrka_last_error(kyrka));
+	(void)frame_record(LITANY_MESSAGE_TYPE_HEARTBEAT, 0);
 }
 
 /*
- * We received a message, place it in a buffer and pass it along to
- * the chat window which will add the message if it was not already seen.
+ * Send a bare message of the given type to a peer that uses the old
+ * message format. Text goes through our pacer like a data frame.
  */
 void
-Tunnel::recv_msg(Qt::GlobalColor color, u_int64_t id, const char *fmt, ...)
+Tunnel::legacy_send(u_int8_t type, u_int64_t id, const void *data,
+    size_t len)
 {
-	int			len;
-	va_list			args;
-	TunnelInterface		*ifc;
-	char			buf[2048];
+	struct litany_msg_data		msg;
 
-	PRECOND(fmt != NULL);
-	PRECOND(id != LITANY_MESSAGE_SYSTEM_ID);
+	PRECOND(peer_legacy);
+	PRECOND(len <= LITANY_MESSAGE_TEXT_MAX);
+	PRECOND(len == 0 || data != NULL);
 
-	va_start(args, fmt);
-	len = vsnprintf(buf, sizeof(buf), fmt, args);
-	va_end(args);
+	memset(&msg, 0, sizeof(msg));
 
-	if (len == -1 || (size_t)len >= sizeof(buf))
-		fatal("message did not fit");
+	msg.type = type;
+	msg.len = htobe16(len);
 
-	ifc = (TunnelInterface *)owner;
-	ifc->message_show(buf, id, color);
-}
+	if (id == ULONG_MAX)
+		msg.id = id;
+	else
+		msg.id = htobe64(id);
 
-/*
- * We received an ack from our peer, forward it to the chat window
- * so it can remove it from the list of messages that needs to be
- * sent still.
- */
-void
-Tunnel::recv_ack(u_int64_t id)
-{
-	PRECOND(id != LITANY_MESSAGE_SYSTEM_ID);
+	if (len > 0)
+		memcpy(msg.data, data, len);
 
-	litany_msg_ack(&msgs, id);
+	if (type == LITANY_MESSAGE_TYPE_TEXT)
+		pacer_send(&msg);
+	else
+		send_msg(&msg);
 }
 
 /*
- * Send pending messages to our peer again if they are old enough to
- * warrant a new send. Any message in the msgs list is not ACK'd by
- * the peer.
+ * Switch between frames and the old message format depending on what
+ * our peer last sent us, we let the user know when it has the latter
+ * as long messages and file transfers will not reach it.
  */
 void
-Tunnel::resend_pending(void)
+Tunnel::legacy_set(bool on)
 {
-	struct timespec		ts;
-	struct litany_msg	*msg;
+	size_t		idx;
 
-	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (peer_legacy == on)
+		return;
+
+	peer_legacy = on;
 
-	TAILQ_FOREACH(msg, &msgs, list) {
-		if ((ts.tv_sec - msg->age) >= 5) {
-			msg->age = ts.tv_sec;
-			send_msg(&msg->data);
+	if (peer_legacy) {
+		wheel->timer_cancel(&ack_timer);
+
+		for (idx = 0; idx < acks_count; idx++) {
+			legacy_send(LITANY_MESSAGE_TYPE_ACK,
+			    be64toh(acks[idx]), NULL, 0);
 		}
+
+		acks_count = 0;
+		frame_flush();
+
+		system_msg("[%02x] peer uses the old message format, long "
+		    "messages and file transfers are unavailable", peer_id);
 	}
 }
 
 /*
- * Potentially update the peer its ip address and port.
+ * Queue a text or fragment record for the given message, this is used
+ * for both the first transmission and any retransmissions of a message.
  */
 void
-Tunnel::peer_update(struct kyrka_event_peer *peer)
+Tunnel::frame_msg(struct litany_msg *msg)
 {
-	struct in_addr		in;
+	u_int8_t		*rec;
+	u_int64_t		id;
+	struct litany_msg_body	*body;
 
-	PRECOND(peer != NULL);
+	PRECOND(msg != NULL);
+	PRECOND(msg->body != NULL);
 
-	in.s_addr = peer->ip;
-	peer->ip = be32toh(peer->ip);
-	peer->port = be16toh(peer->port);
+	body = msg->body;
+	id = htobe64(msg->id);
 
-	if (peer->ip != peer_address.toIPv4Address() ||
-	    peer->port != peer_port) {
-		system_msg("[p2p]: peer address %s:%u",
-		    inet_ntoa(in), peer->port);
+	PRECOND(body->type == LITANY_MESSAGE_TYPE_TEXT ||
+	    body->type == LITANY_MESSAGE_TYPE_FRAGMENT);
+	PRECOND(body->len > 0 && body->len <= LITANY_MESSAGE_TEXT_MAX);
 
-		peer_port = peer->port;
-		peer_address = QHostAddress(peer->ip);
+	if (peer_legacy && body->type == LITANY_MESSAGE_TYPE_TEXT) {
+		legacy_send(body->type, msg->id, body->data, body->len);
+		return;
 	}
-}
 
-/*
- * Update the peer its last_update timestamp.
- */
-void
-Tunnel::peer_alive(void)
-{
-	struct timespec		ts;
+	rec = frame_record(body->type, sizeof(id) + body->len);
 
-	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
-	last_update = ts.tv_sec;
+	memcpy(rec, &id, sizeof(id));
+	memcpy(rec + sizeof(id), body->data, body->len);
 }
 
 /*
- * Called when a new libkyrka event triggers.
+ * Add a record of the given type and length to the current frame and
+ * return a pointer to where the caller must write its value.
+ *
+ * If the record does not fit, the current frame is sent first. A new
+ * frame arms the frame timer so that everything queued within the
+ * next TUNNEL_FRAME_DELAY milliseconds goes out together.
  */
-static void
-kyrka_event(KYRKA *ctx, union kyrka_event *evt, void *udata)
+u_int8_t *
+Tunnel::frame_record(u_int8_t type, size_t len)
 {
-	Tunnel		*tunnel;
+	struct litany_record	rec;
+	u_int8_t		*ptr;
 
-	PRECOND(ctx != NULL);
-	PRECOND(evt != NULL);
-	PRECOND(udata != NULL);
+	PRECOND(len <= LITANY_RECORD_MAX_SIZE);
 
-	tunnel = (Tunnel *)udata;
+	if (frame_len + sizeof(rec) + len > sizeof(frame.data))
+		frame_flush();
 
-	switch (evt->type) {
-	case KYRKA_EVENT_LOGMSG:
-		tunnel->system_msg("[log]: %s", evt->logmsg.log);
-		break;
-	case KYRKA_EVENT_KEYS_INFO:
-		tunnel->peer_alive();
-		tunnel->system_msg("[tunnel]: tx=%08x rx=%08x",
-		    evt->keys.tx_spi, evt->keys.rx_spi);
-		if (evt->keys.tx_spi != 0 && evt->keys.rx_spi != 0)
-			tunnel->system_msg("[tunnel]: established");
-		break;
-	case KYRKA_EVENT_EXCHANGE_INFO:
-		tunnel->system_msg("[exchange]: %s", evt->exchange.reason);
-		break;
-	case KYRKA_EVENT_AMBRY_RECEIVED:
-		tunnel->system_msg("[cathedral]: got ambry 0x%08x",
-		    evt->ambry.generation);
-		break;
-	case KYRKA_EVENT_PEER_DISCOVERY:
-		tunnel->peer_update(&evt->peer);
+	if (frame_len == 0) {
+		frame.data[0] = LITANY_FRAME_VERSION;
+		frame_len = 1;
+	}
+
+	rec.type = type;
+	rec.len = htobe16(len);
+
+	memcpy(&frame.data[frame_len], &rec, sizeof(rec));
+	ptr = &frame.data[frame_len + sizeof(rec)];
+
+	frame_len += sizeof(rec) + len;
+	tx_records++;
+
+	switch (type) {
+	case LITANY_MESSAGE_TYPE_TEXT:
+	case LITANY_MESSAGE_TYPE_FRAGMENT:
+	case LITANY_MESSAGE_TYPE_XFER_DATA:
+		frame_data = true;
 		break;
 	default:
-		printf("event 0x%02x\n", evt->type);
 		break;
 	}
+
+	if (!frame_timer.armed)
+		wheel->timer_add(&frame_timer, TUNNEL_FRAME_DELAY);
+
+	return (ptr);
 }
 
 /*
- * Log a system message to our chat window.
+ * Place as many queued acks as fit into the current frame. We do not
+ * put them into a data frame that will sit behind others in our pacer,
+ * they go out in a control frame of their own instead.
  */
 void
-Tunnel::system_msg(const char *fmt, ...)
+Tunnel::frame_acks(void)
 {
-	int			len;
-	va_list			args;
-	TunnelInterface		*ifc;
-	char			buf[2048];
+	u_int8_t	*rec;
+	size_t		space, count;
 
-	PRECOND(fmt != NULL);
+	if (acks_count == 0)
+		return;
 
-	va_start(args, fmt);
-	len = vsnprintf(buf, sizeof(buf), fmt, args);
-	va_end(args);
+	if (frame_data && !TAILQ_EMPTY(&pacer_queue))
+		return;
 
-	if (len == -1 || (size_t)len >= sizeof(buf))
-		fatal("message did not fit");
+	if (frame_len == 0)
+		space = sizeof(frame.data) - 1;
+	else
+		space = sizeof(frame.data) - frame_len;
 
-	ifc = (TunnelInterface *)owner;
-	ifc->message_show(buf, LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+	if (space < sizeof(struct litany_record) + sizeof(acks[0]))
+		return;
+
+	count = (space - sizeof(struct litany_record)) / sizeof(acks[0]);
+	if (count > acks_count)
+		count = acks_count;
+
+	rec = frame_record(LITANY_MESSAGE_TYPE_ACK, count * sizeof(acks[0]));
+	memcpy(rec, acks, count * sizeof(acks[0]));
+
+	acks_count -= count;
+
+	if (acks_count > 0)
+		memmove(acks, &acks[count], acks_count * sizeof(acks[0]));
+	else
+		wheel->timer_cancel(&ack_timer);
 }
 
 /*
- * Called when libkyrka makes a decrypted litany_msg packet available to us.
+ * Send the current frame to our peer, any queued acks are put into
+ * the space that is left in it. The frame is always sent at its full
+ * size, unused space is zero.
+ *
+ * Frames carrying text or file data go through our pacer, control
+ * frames (acks, heartbeats, transfer control) skip it and go out now.
  */
-static void
-heaven_send(const void *data, size_t len, u_int64_t seq, void *udata)
+void
+Tunnel::frame_flush(void)
 {
-	struct litany_msg_data	*msg;
-	Tunnel			*tunnel;
-
-	PRECOND(data != NULL);
-	PRECOND(len > 0);
-	PRECOND(seq != 0);
-	PRECOND(udata != NULL);
-
-	tunnel = (Tunnel *)udata;
-
-	if (len != sizeof(*msg)) {
-		tunnel->system_msg("[%02x] malformed packet (%zu vs %zu)",
-		    tunnel->peer_id, len, sizeof(*msg));
-		return;
-	}
+	if (frame_len > 0)
+		frame_acks();
 
-	msg = (struct litany_msg_data *)data;
-	msg->len = be16toh(msg->len);
-	msg->id = be64toh(msg->id);
+	wheel->timer_cancel(&frame_timer);
 
-	if (msg->id == LITANY_MESSAGE_SYSTEM_ID) {
-		tunnel->system_msg("[%02x] tried sending a system message",
-		    tunnel->peer_id);
+	if (frame_len == 0)
 		return;
-	}
 
-	if (msg->len > sizeof(msg->data)) {
-		tunnel->system_msg("[%02x] got msg with invalid length (%u)",
-		    tunnel->peer_id, msg->len);
-		return;
-	}
+	frame.id = ULONG_MAX;
+	frame.len = htobe16(frame_len);
+	frame.type = LITANY_MESSAGE_TYPE_FRAME;
 
-	tunnel->peer_alive();
+	tx_frames++;
 
-	switch (msg->type) {
-	case LITANY_MESSAGE_TYPE_TEXT:
-		if (text_validate(msg->data, msg->len) == -1) {
-			tunnel->system_msg("[%02x] malformed utf8 data",
-			    tunnel->peer_id);
-			break;
-		}
+	if (frame_data)
+		pacer_send(&frame);
+	else
+		send_msg(&frame);
 
-		tunnel->recv_msg(Qt::gray, msg->id, "<%02x> %.*s",
-		    tunnel->peer_id, (int)msg->len, (const char *)msg->data);
-		tunnel->send_ack(msg->id);
-		break;
-	case LITANY_MESSAGE_TYPE_ACK:
-		tunnel->recv_ack(msg->id);
-		break;
-	case LITANY_MESSAGE_TYPE_HEARTBEAT:
-		break;
-	default:
-		printf("unknown packet %u\n", msg->type);
-		break;
-	}
+	frame_len = 0;
+	frame_data = false;
+	memset(&frame, 0, sizeof(frame));
 }
 
 /*
- * Called when libkyrka gives us ciphertext to send.
+ * Our peer acknowledged count messages, grow our window by one frame
+ * per acked message while in slow start and by one frame per window
+ * worth of acked messages after that.
  */
-static void
-purgatory_send(const void *data, size_t len, u_int64_t seq, void *udata)
+void
+Tunnel::cc_ack(u_int64_t count)
+{
+	if (cc_cwnd < cc_ssthresh) {
+		cc_cwnd += count;
+	} else {
+		cc_acked += count;
+		while (cc_acked >= cc_cwnd) {
+			cc_acked -= cc_cwnd;
+			cc_cwnd++;
+		}
+	}
+
+	if (cc_cwnd > TUNNEL_CC_CWND_MAX)
+		cc_cwnd = TUNNEL_CC_CWND_MAX;
+}
+
+/*
+ * We had to retransmit, halve our window. We only do this once per
+ * round-trip as a single burst of loss often hits several messages.
+ */
+void
+Tunnel::cc_loss(void)
+{
+	u_int64_t	now, srtt;
+
+	now = litany_msec();
+	if (now < cc_recovery)
+		return;
+
+	cc_losses++;
+	cc_acked = 0;
+
+	cc_ssthresh = cc_cwnd / 2;
+	if (cc_ssthresh < TUNNEL_CC_CWND_MIN)
+		cc_ssthresh = TUNNEL_CC_CWND_MIN;
+
+	cc_cwnd = cc_ssthresh;
+
+	srtt = rtt.samples > 0 ? rtt.srtt : TUNNEL_CC_RTT_DEFAULT;
+	if (srtt < TUNNEL_CC_RTT_MIN)
+		srtt = TUNNEL_CC_RTT_MIN;
+
+	cc_recovery = now + srtt;
+}
+
+/*
+ * Returns our pacing rate in frames per second.
+ */
+u_int64_t
+Tunnel::cc_rate(void)
+{
+	u_int64_t	srtt, rate;
+
+	srtt = rtt.samples > 0 ? rtt.srtt : TUNNEL_CC_RTT_DEFAULT;
+	if (srtt < TUNNEL_CC_RTT_MIN)
+		srtt = TUNNEL_CC_RTT_MIN;
+
+	rate = (cc_cwnd * 1000) / srtt;
+	if (rate == 0)
+		rate = 1;
+
+	return (rate);
+}
+
+/*
+ * Hand a data frame to our pacer, it is sent right away if we have a
+ * token for it and nothing is waiting, otherwise it is queued.
+ */
+void
+Tunnel::pacer_send(struct litany_msg_data *msg)
+{
+	struct tunnel_frame	*tf;
+
+	PRECOND(msg != NULL);
+
+	if (TAILQ_EMPTY(&pacer_queue)) {
+		pacer_run();
+		if (pacer_tokens >= 1000) {
+			pacer_tokens -= 1000;
+			send_msg(msg);
+			return;
+		}
+	}
+
+	if (pacer_queued >= TUNNEL_PACER_QUEUE_MAX) {
+		pacer_drops++;
+		return;
+	}
+
+	if ((tf = (struct tunnel_frame *)calloc(1, sizeof(*tf))) == NULL)
+		fatal("calloc: failed to allocate frame");
+
+	memcpy(&tf->data, msg, sizeof(*msg));
+	TAILQ_INSERT_TAIL(&pacer_queue, tf, list);
+	pacer_queued++;
+
+	pacer_run();
+}
+
+/*
+ * Refill our tokens at our current pacing rate and send as many of
+ * the queued frames as we can. If frames remain we come back once
+ * we will have earned a token for the next one.
+ */
+void
+Tunnel::pacer_run(void)
+{
+	struct tunnel_frame	*tf;
+	u_int64_t		now, rate, burst, wait;
+
+	now = litany_msec();
+	rate = cc_rate();
+
+	burst = (rate * LITANY_WHEEL_TICK) / 1000 + 1;
+	if (burst < TUNNEL_PACER_BURST)
+		burst = TUNNEL_PACER_BURST;
+
+	pacer_tokens += (now - pacer_last) * rate;
+	if (pacer_tokens > burst * 1000)
+		pacer_tokens = burst * 1000;
+
+	pacer_last = now;
+
+	while ((tf = TAILQ_FIRST(&pacer_queue)) != NULL) {
+		if (pacer_tokens < 1000)
+			break;
+
+		pacer_tokens -= 1000;
+		TAILQ_REMOVE(&pacer_queue, tf, list);
+		pacer_queued--;
+
+		send_msg(&tf->data);
+
+		nyfe_mem_zero(tf, sizeof(*tf));
+		free(tf);
+	}
+
+	if (TAILQ_EMPTY(&pacer_queue)) {
+		wheel->timer_cancel(&pacer_timer);
+		return;
+	}
+
+	wait = (1000 - pacer_tokens + rate - 1) / rate;
+	wheel->timer_add(&pacer_timer, wait);
+}
+
+/*
+ * Submit a message to our peer.
+ */
+void
+Tunnel::send_msg(struct litany_msg_data *msg)
+{
+	PRECOND(msg != NULL);
+
+	if (kyrka_heaven_input(kyrka, msg, sizeof(*msg)) == -1) {
+		if (kyrka_last_error(kyrka) != KYRKA_ERROR_NO_TX_KEY)
+			fatal("kyrka_heaven_input: %d",
+			    kyrka_last_error(kyrka));
+		return;
+	}
+
+	last_send = litany_msec();
+}
+
+/*
+ * We received a message from our peer, hand it to the chat window
+ * as is, which will add the message if it was not already seen.
+ */
+void
+Tunnel::recv_text(Qt::GlobalColor color, u_int64_t id, const u_int8_t *text,
+    size_t len)
+{
+	TunnelInterface		*ifc;
+
+	PRECOND(text != NULL);
+	PRECOND(id != LITANY_MESSAGE_SYSTEM_ID);
+	PRECOND(len <= LITANY_MESSAGE_LONG_MAX);
+
+	ifc = (TunnelInterface *)owner;
+	ifc->message_text(peer_id, id, color, text, len);
+}
+
+/*
+ * We received an ack record from our peer carrying count ids,
+ * process them all in one go and update our round-trip time
+ * estimate from any valid samples.
+ */
+void
+Tunnel::recv_acks(const void *ids, size_t count)
+{
+	PRECOND(ids != NULL);
+	PRECOND(count <= LITANY_MESSAGE_ACKS_MAX);
+
+	if ((count = litany_msg_acks(&msgs, ids, count, &rtt)) > 0)
+		cc_ack(count);
+}
+
+/*
+ * We received a fragment of a long message from our peer, add it to
+ * our reassembly buffer and show the message once it is complete.
+ *
+ * Fragments we have no room for are not ACK'd so that our peer will
+ * send them again later. Late fragments of a message we completed
+ * recently are ACK'd again, their earlier ACK got lost.
+ */
+void
+Tunnel::recv_fragment(u_int64_t id, const struct litany_fragment *frag,
+    const void *data, size_t len)
+{
+	struct litany_reassembly_slot	*slot;
+
+	PRECOND(id != LITANY_MESSAGE_SYSTEM_ID);
+	PRECOND(frag != NULL);
+	PRECOND(data != NULL);
+
+	switch (litany_reassembly_add(&reasm, frag, data, len,
+	    litany_msec(), &slot)) {
+	case -1:
+		return;
+	case 0:
+		send_ack(id);
+		break;
+	case 1:
+		send_ack(id);
+
+		if (text_validate(slot->buf, slot->length) == -1) {
+			system_msg("[%02x] malformed utf8 data", peer_id);
+		} else {
+			recv_text(Qt::gray, slot->base,
+			    slot->buf, slot->length);
+		}
+
+		litany_reassembly_release(&reasm, slot);
+		break;
+	default:
+		fatal("litany_reassembly_add: unexpected return value");
+	}
+
+	if (reasm.inuse > 0 && !reasm_timer.armed)
+		wheel->timer_add(&reasm_timer, LITANY_REASSEMBLY_TIMEOUT);
+}
+
+/*
+ * Drop any long messages that did not complete in time.
+ */
+void
+Tunnel::reassembly_expire(void)
+{
+	litany_reassembly_expire(&reasm, litany_msec());
+
+	if (reasm.inuse > 0)
+		wheel->timer_add(&reasm_timer, LITANY_REASSEMBLY_TIMEOUT / 4);
+}
+
+/*
+ * Start sending the given file to our peer, we only have a single
+ * outgoing transfer per peer at a time.
+ */
+void
+Tunnel::file_send(XferSource *src)
+{
+	PRECOND(src != NULL);
+
+	if (xfer_tx != NULL) {
+		system_msg("[xfer]: already sending a file to %02x", peer_id);
+		return;
+	}
+
+	if (peer_legacy) {
+		system_msg("[xfer]: %02x does not support file transfers",
+		    peer_id);
+		return;
+	}
+
+	xfer_tx = new FileSend(this, src);
+
+	if (xfer_tx->failed) {
+		delete xfer_tx;
+		xfer_tx = NULL;
+		return;
+	}
+
+	xfer_tx->start();
+	xfer_reap();
+}
+
+/*
+ * The user answered the offer our peer made.
+ */
+void
+Tunnel::file_answer(bool accept)
+{
+	if (xfer_rx == NULL || xfer_rx->accepted || xfer_rx->finished) {
+		system_msg("[xfer]: no offer from %02x", peer_id);
+		return;
+	}
+
+	if (accept)
+		xfer_rx->accept();
+	else
+		xfer_rx->reject();
+
+	xfer_reap();
+}
+
+/*
+ * We received a file transfer record from our peer.
+ */
+void
+Tunnel::recv_xfer(u_int8_t type, const u_int8_t *data, size_t len)
+{
+	struct litany_xfer_ack		ack;
+	struct litany_xfer_offer	off;
+	struct litany_xfer_done		done;
+	struct litany_xfer_data		hdr;
+
+	PRECOND(data != NULL);
+
+	switch (type) {
+	case LITANY_MESSAGE_TYPE_XFER_OFFER:
+		if (len <= sizeof(off))
+			break;
+
+		memcpy(&off, data, sizeof(off));
+		off.id = be64toh(off.id);
+		off.size = be64toh(off.size);
+
+		if (xfer_rx != NULL && xfer_rx->id == off.id) {
+			xfer_rx->ack_send();
+		} else if (off.id == xfer_last_id) {
+			xfer_done(off.id, xfer_last_status);
+		} else if (xfer_rx != NULL) {
+			xfer_done(off.id, LITANY_XFER_STATUS_REFUSED);
+		} else {
+			xfer_rx = new FileRecv(this, &off,
+			    (const char *)data + sizeof(off),
+			    len - sizeof(off), xfer_max);
+		}
+		break;
+	case LITANY_MESSAGE_TYPE_XFER_DATA:
+		if (len <= sizeof(hdr))
+			break;
+
+		memcpy(&hdr, data, sizeof(hdr));
+		hdr.id = be64toh(hdr.id);
+		hdr.index = be32toh(hdr.index);
+
+		if (xfer_rx != NULL && xfer_rx->id == hdr.id) {
+			xfer_rx->data(hdr.index, data + sizeof(hdr),
+			    len - sizeof(hdr));
+		} else if (hdr.id == xfer_last_id) {
+			xfer_done(hdr.id, xfer_last_status);
+		}
+		break;
+	case LITANY_MESSAGE_TYPE_XFER_ACK:
+		if (len != sizeof(ack))
+			break;
+
+		memcpy(&ack, data, sizeof(ack));
+		ack.id = be64toh(ack.id);
+		ack.next = be32toh(ack.next);
+		ack.sack = be64toh(ack.sack);
+
+		if (xfer_tx != NULL && xfer_tx->id == ack.id)
+			xfer_tx->ack(&ack);
+		break;
+	case LITANY_MESSAGE_TYPE_XFER_DONE:
+		if (len != sizeof(done))
+			break;
+
+		memcpy(&done, data, sizeof(done));
+		done.id = be64toh(done.id);
+
+		if (xfer_tx != NULL && xfer_tx->id == done.id)
+			xfer_tx->done(done.status);
+		break;
+	default:
+		fatal("%s: unknown type %u", __func__, type);
+	}
+
+	xfer_reap();
+}
+
+/*
+ * Tell our peer how the incoming transfer with the given id ended.
+ */
+void
+Tunnel::xfer_done(u_int64_t id, u_int8_t status)
+{
+	u_int8_t			*rec;
+	struct litany_xfer_done		done;
+
+	done.id = htobe64(id);
+	done.status = status;
+
+	rec = frame_record(LITANY_MESSAGE_TYPE_XFER_DONE, sizeof(done));
+	memcpy(rec, &done, sizeof(done));
+}
+
+/*
+ * Get rid of finished transfers and make sure our transfer timer
+ * runs while we still have any.
+ */
+void
+Tunnel::xfer_reap(void)
+{
+	if (xfer_tx != NULL && xfer_tx->finished) {
+		delete xfer_tx;
+		xfer_tx = NULL;
+	}
+
+	if (xfer_rx != NULL && xfer_rx->finished) {
+		xfer_last_id = xfer_rx->id;
+		xfer_last_status = xfer_rx->status;
+
+		delete xfer_rx;
+		xfer_rx = NULL;
+	}
+
+	if ((xfer_tx != NULL || xfer_rx != NULL) && !xfer_timer.armed)
+		wheel->timer_add(&xfer_timer, XFER_TICK);
+}
+
+/*
+ * Let our transfers make progress, called from the timer wheel.
+ */
+void
+Tunnel::xfer_tick(void)
+{
+	if (xfer_tx != NULL)
+		xfer_tx->tick();
+
+	if (xfer_rx != NULL)
+		xfer_rx->tick();
+
+	xfer_reap();
+}
+
+/*
+ * Send pending messages to our peer again if their deadline passed.
+ * Any message in the msgs store is not ACK'd by the peer, we only
+ * look at the ones that are due. Each resend doubles the timeout
+ * of that message so we back off from peers that went away.
+ */
+void
+Tunnel::resend_pending(void)
+{
+	u_int64_t		now;
+	struct litany_msg	*msg;
+	bool			lost;
+
+	lost = false;
+	now = litany_msec();
+
+	while ((msg = litany_msg_expired(&msgs, now)) != NULL) {
+		lost = true;
+		frame_msg(msg);
+		litany_msg_retransmit(&msgs, msg, now);
+	}
+
+	if (lost)
+		cc_loss();
+
+	resend_schedule();
+}
+
+/*
+ * Returns our current retransmission timeout in milliseconds.
+ */
+u_int64_t
+Tunnel::resend_timeout(void)
+{
+	return (rtt.rto);
+}
+
+/*
+ * Arm our resend timer for the earliest deadline of our pending
+ * messages, or disarm it if there are none.
+ */
+void
+Tunnel::resend_schedule(void)
+{
+	u_int64_t	now, deadline;
+
+	if ((deadline = litany_msg_next_deadline(&msgs)) == 0) {
+		wheel->timer_cancel(&resend_timer);
+		return;
+	}
+
+	now = litany_msec();
+
+	if (deadline > now)
+		wheel->timer_add(&resend_timer, deadline - now);
+	else
+		wheel->timer_add(&resend_timer, 0);
+}
+
+/*
+ * Potentially update the peer its ip address and port.
+ */
+void
+Tunnel::peer_update(struct kyrka_event_peer *peer)
+{
+	struct in_addr		in;
+
+	PRECOND(peer != NULL);
+
+	in.s_addr = peer->ip;
+	peer->ip = be32toh(peer->ip);
+	peer->port = be16toh(peer->port);
+
+	if (peer->ip != peer_address.toIPv4Address() ||
+	    peer->port != peer_port) {
+		system_msg("[p2p]: peer address %s:%u",
+		    inet_ntoa(in), peer->port);
+
+		peer_port = peer->port;
+		peer_address = QHostAddress(peer->ip);
+
+		socket->route_peer(this, peer->ip, peer->port);
+	}
+}
+
+/*
+ * Our keys changed, make sure our socket routes packets carrying
+ * the new RX SPI to us.
+ */
+void
+Tunnel::keys_update(u_int32_t rx_spi)
+{
+	socket->route_spi(this, rx_spi);
+}
+
+/*
+ * Update the peer its last_update timestamp and make sure we will
+ * check on it again later.
+ */
+void
+Tunnel::peer_alive(void)
+{
+	last_update = litany_msec();
+
+	if (!offline_timer.armed)
+		wheel->timer_add(&offline_timer, TUNNEL_OFFLINE_TIMEOUT);
+}
+
+/*
+ * The timer wheel callbacks for our tunnels.
+ */
+static void
+tunnel_ack(void *udata)
+{
+	PRECOND(udata != NULL);
+
+	((Tunnel *)udata)->ack_flush();
+}
+
+static void
+tunnel_keys(void *udata)
+{
+	PRECOND(udata != NULL);
+
+	((Tunnel *)udata)->key_manage();
+}
+
+static void
+tunnel_frame(void *udata)
+{
+	PRECOND(udata != NULL);
+
+	((Tunnel *)udata)->frame_flush();
+}
+
+static void
+tunnel_xfer(void *udata)
+{
+	PRECOND(udata != NULL);
+
+	((Tunnel *)udata)->xfer_tick();
+}
+
+static void
+tunnel_pacer(void *udata)
+{
+	PRECOND(udata != NULL);
+
+	((Tunnel *)udata)->pacer_run();
+}
+
+static void
+tunnel_reassembly(void *udata)
+{
+	PRECOND(udata != NULL);
+
+	((Tunnel *)udata)->reassembly_expire();
+}
+
+static void
+tunnel_notify(void *udata)
+{
+	PRECOND(udata != NULL);
+
+	((Tunnel *)udata)->cathedral_notify();
+}
+
+static void
+tunnel_resend(void *udata)
+{
+	PRECOND(udata != NULL);
+
+	((Tunnel *)udata)->resend_pending();
+}
+
+static void
+tunnel_offline(void *udata)
+{
+	PRECOND(udata != NULL);
+
+	((Tunnel *)udata)->offline_check();
+}
+
+static void
+tunnel_heartbeat(void *udata)
+{
+	PRECOND(udata != NULL);
+
+	((Tunnel *)udata)->heartbeat();
+}
+
+/*
+ * Called when a new libkyrka event triggers.
+ */
+static void
+kyrka_event(KYRKA *ctx, union kyrka_event *evt, void *udata)
+{
+	Tunnel		*tunnel;
+
+	PRECOND(ctx != NULL);
+	PRECOND(evt != NULL);
+	PRECOND(udata != NULL);
+
+	tunnel = (Tunnel *)udata;
+
+	switch (evt->type) {
+	case KYRKA_EVENT_LOGMSG:
+		tunnel->system_msg("[log]: %s", evt->logmsg.log);
+		break;
+	case KYRKA_EVENT_KEYS_INFO:
+		tunnel->peer_alive();
+		tunnel->keys_update(evt->keys.rx_spi);
+		tunnel->system_msg("[tunnel]: tx=%08x rx=%08x",
+		    evt->keys.tx_spi, evt->keys.rx_spi);
+		if (evt->keys.tx_spi != 0 && evt->keys.rx_spi != 0)
+			tunnel->system_msg("[tunnel]: established");
+		break;
+	case KYRKA_EVENT_EXCHANGE_INFO:
+		tunnel->system_msg("[exchange]: %s", evt->exchange.reason);
+		break;
+	case KYRKA_EVENT_AMBRY_RECEIVED:
+		tunnel->system_msg("[cathedral]: got ambry 0x%08x",
+		    evt->ambry.generation);
+		break;
+	case KYRKA_EVENT_PEER_DISCOVERY:
+		tunnel->peer_update(&evt->peer);
+		break;
+	default:
+		printf("event 0x%02x\n", evt->type);
+		break;
+	}
+}
+
+/*
+ * Log a system message to our chat window.
+ */
+void
+Tunnel::system_msg(const char *fmt, ...)
+{
+	int			len;
+	va_list			args;
+	TunnelInterface		*ifc;
+	char			buf[2048];
+
+	PRECOND(fmt != NULL);
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if (len == -1 || (size_t)len >= sizeof(buf))
+		fatal("message did not fit");
+
+	ifc = (TunnelInterface *)owner;
+	ifc->message_show(buf, LITANY_MESSAGE_SYSTEM_ID, Qt::yellow);
+}
+
+/*
+ * Show our tunnel statistics in the chat window.
+ */
+void
+Tunnel::stats_show(void)
+{
+	char		buf[512];
+
+	if (!socket_shared) {
+		socket->stats(buf, sizeof(buf));
+		system_msg("[stats %02x]: %s", peer_id, buf);
+	}
+
+	system_msg("[stats %02x]: srtt=%" PRIu64 "ms rttvar=%" PRIu64
+	    "ms rto=%" PRIu64 "ms (%" PRIu64 " samples), %zu unacked",
+	    peer_id, rtt.srtt, rtt.rttvar, rtt.rto, rtt.samples, msgs.count);
+
+	system_msg("[stats %02x]: msg pool %zu in use, %zu high-water, "
+	    "%zu total in %zu slabs (%zu unlocked)", peer_id,
+	    msgs.pool.inuse, msgs.pool.highwater, msgs.pool.total,
+	    msgs.pool.slabs, msgs.pool.unlocked);
+
+	system_msg("[stats %02x]: %" PRIu64 " frames carrying %" PRIu64
+	    " records, %zu acks queued", peer_id, tx_frames, tx_records,
+	    acks_count);
+
+	system_msg("[stats %02x]: cwnd=%" PRIu64 " ssthresh=%" PRIu64
+	    " frames, pacing %" PRIu64 " frames/s, %zu queued, %" PRIu64
+	    " losses, %" PRIu64 " dropped", peer_id, cc_cwnd, cc_ssthresh,
+	    cc_rate(), pacer_queued, cc_losses, pacer_drops);
+
+	system_msg("[stats %02x]: reassembly %zu pending, %" PRIu64
+	    " completed, %" PRIu64 " expired, %" PRIu64 " dropped, %" PRIu64
+	    " late", peer_id, reasm.inuse, reasm.completed, reasm.expired,
+	    reasm.dropped, reasm.late);
+
+	if (xfer_tx != NULL) {
+		xfer_tx->stats(buf, sizeof(buf));
+		system_msg("[stats %02x]: %s", peer_id, buf);
+	}
+
+	if (xfer_rx != NULL) {
+		xfer_rx->stats(buf, sizeof(buf));
+		system_msg("[stats %02x]: %s", peer_id, buf);
+	}
+
+	system_msg("[stats %02x]: %" PRIu64 " heartbeats sent, %" PRIu64
+	    " suppressed, interval %" PRIu64 "ms", peer_id, hb_sent,
+	    hb_suppressed, hb_interval);
+}
+
+/*
+ * Called when libkyrka makes a decrypted litany_msg packet available to us.
+ */
+static void
+heaven_send(const void *data, size_t len, u_int64_t seq, void *udata)
+{
+	struct litany_msg_data	*msg;
+	Tunnel			*tunnel;
+
+	PRECOND(data != NULL);
+	PRECOND(len > 0);
+	PRECOND(seq != 0);
+	PRECOND(udata != NULL);
+
+	tunnel = (Tunnel *)udata;
+
+	if (len != sizeof(*msg)) {
+		tunnel->system_msg("[%02x] malformed packet (%zu vs %zu)",
+		    tunnel->peer_id, len, sizeof(*msg));
+		return;
+	}
+
+	msg = (struct litany_msg_data *)data;
+	msg->len = be16toh(msg->len);
+	msg->id = be64toh(msg->id);
+
+	if (msg->id == LITANY_MESSAGE_SYSTEM_ID) {
+		tunnel->system_msg("[%02x] tried sending a system message",
+		    tunnel->peer_id);
+		return;
+	}
+
+	if (msg->len > sizeof(msg->data)) {
+		tunnel->system_msg("[%02x] got msg with invalid length (%u)",
+		    tunnel->peer_id, msg->len);
+		return;
+	}
+
+	tunnel->peer_alive();
+
+	if (msg->type == LITANY_MESSAGE_TYPE_FRAME)
+		frame_dispatch(tunnel, msg);
+	else
+		legacy_dispatch(tunnel, msg);
+}
+
+/*
+ * Handle a bare message from a peer that uses the old message format,
+ * from before we packed records into frames.
+ */
+static void
+legacy_dispatch(Tunnel *tunnel, struct litany_msg_data *msg)
+{
+	u_int64_t	id;
+
+	PRECOND(tunnel != NULL);
+	PRECOND(msg != NULL);
+	PRECOND(msg->len <= sizeof(msg->data));
+
+	switch (msg->type) {
+	case LITANY_MESSAGE_TYPE_TEXT:
+		tunnel->legacy_set(true);
+
+		if (msg->len == 0 || msg->len > LITANY_MESSAGE_TEXT_MAX) {
+			tunnel->system_msg("[%02x] malformed text message",
+			    tunnel->peer_id);
+			break;
+		}
+
+		if (text_validate(msg->data, msg->len) == -1) {
+			tunnel->system_msg("[%02x] malformed utf8 data",
+			    tunnel->peer_id);
+			break;
+		}
+
+		tunnel->recv_text(Qt::gray, msg->id, msg->data, msg->len);
+		tunnel->send_ack(msg->id);
+		legacy_trailer(tunnel, msg);
+		break;
+	case LITANY_MESSAGE_TYPE_ACK:
+		tunnel->legacy_set(true);
+
+		id = htobe64(msg->id);
+		tunnel->recv_acks(&id, 1);
+		break;
+	case LITANY_MESSAGE_TYPE_ACKS:
+		tunnel->legacy_set(true);
+
+		if (msg->len % sizeof(u_int64_t)) {
+			tunnel->system_msg("[%02x] malformed acks (%u)",
+			    tunnel->peer_id, msg->len);
+			break;
+		}
+
+		tunnel->recv_acks(msg->data, msg->len / sizeof(u_int64_t));
+		break;
+	case LITANY_MESSAGE_TYPE_HEARTBEAT:
+		tunnel->legacy_set(true);
+		legacy_trailer(tunnel, msg);
+		break;
+	default:
+		tunnel->system_msg("[%02x] unknown message type %u",
+		    tunnel->peer_id, msg->type);
+		break;
+	}
+}
+
+/*
+ * Old text and heartbeat messages may carry acks in the space after
+ * msg->len: a single byte with the number of acks followed by them.
+ */
+static void
+legacy_trailer(Tunnel *tunnel, struct litany_msg_data *msg)
+{
+	size_t		count;
+
+	PRECOND(tunnel != NULL);
+	PRECOND(msg != NULL);
+	PRECOND(msg->len <= sizeof(msg->data));
+
+	if (msg->len == sizeof(msg->data))
+		return;
+
+	if ((count = msg->data[msg->len]) == 0)
+		return;
+
+	if (count > (sizeof(msg->data) - msg->len - 1) / sizeof(u_int64_t)) {
+		tunnel->system_msg("[%02x] malformed piggybacked acks (%zu)",
+		    tunnel->peer_id, count);
+		return;
+	}
+
+	tunnel->recv_acks(&msg->data[msg->len + 1], count);
+}
+
+/*
+ * Walk all records in the given frame and handle each of them.
+ */
+static void
+frame_dispatch(Tunnel *tunnel, struct litany_msg_data *msg)
+{
+	struct litany_record	rec;
+	size_t			off;
+
+	PRECOND(tunnel != NULL);
+	PRECOND(msg != NULL);
+	PRECOND(msg->len <= sizeof(msg->data));
+
+	if (msg->len == 0 || msg->data[0] != LITANY_FRAME_VERSION) {
+		tunnel->system_msg("[%02x] unsupported frame version",
+		    tunnel->peer_id);
+		return;
+	}
+
+	tunnel->legacy_set(false);
+
+	off = 1;
+
+	while (off < msg->len) {
+		if (msg->len - off < sizeof(rec)) {
+			tunnel->system_msg("[%02x] truncated record header",
+			    tunnel->peer_id);
+			return;
+		}
+
+		memcpy(&rec, &msg->data[off], sizeof(rec));
+		off += sizeof(rec);
+
+		rec.len = be16toh(rec.len);
+		if (rec.len > msg->len - off) {
+			tunnel->system_msg("[%02x] record with invalid "
+			    "length (%u)", tunnel->peer_id, rec.len);
+			return;
+		}
+
+		record_dispatch(tunnel, rec.type, &msg->data[off], rec.len);
+		off += rec.len;
+	}
+}
+
+/*
+ * Handle a single record from a frame.
+ */
+static void
+record_dispatch(Tunnel *tunnel, u_int8_t type, const u_int8_t *data,
+    size_t len)
+{
+	u_int64_t		id;
+	struct litany_fragment	frag;
+
+	PRECOND(tunnel != NULL);
+	PRECOND(data != NULL);
+	PRECOND(len <= LITANY_RECORD_MAX_SIZE);
+
+	switch (type) {
+	case LITANY_MESSAGE_TYPE_TEXT:
+		if (len <= sizeof(id)) {
+			tunnel->system_msg("[%02x] malformed text record",
+			    tunnel->peer_id);
+			break;
+		}
+
+		memcpy(&id, data, sizeof(id));
+		id = be64toh(id);
+
+		data += sizeof(id);
+		len -= sizeof(id);
+
+		if (id == LITANY_MESSAGE_SYSTEM_ID) {
+			tunnel->system_msg("[%02x] tried sending a system "
+			    "message", tunnel->peer_id);
+			break;
+		}
+
+		if (text_validate(data, len) == -1) {
+			tunnel->system_msg("[%02x] malformed utf8 data",
+			    tunnel->peer_id);
+			break;
+		}
+
+		tunnel->recv_text(Qt::gray, id, data, len);
+		tunnel->send_ack(id);
+		break;
+	case LITANY_MESSAGE_TYPE_FRAGMENT:
+		if (len <= sizeof(id) + sizeof(frag)) {
+			tunnel->system_msg("[%02x] malformed fragment record",
+			    tunnel->peer_id);
+			break;
+		}
+
+		memcpy(&id, data, sizeof(id));
+		memcpy(&frag, data + sizeof(id), sizeof(frag));
+
+		id = be64toh(id);
+		frag.base = be64toh(frag.base);
+
+		if (id == LITANY_MESSAGE_SYSTEM_ID ||
+		    frag.base == LITANY_MESSAGE_SYSTEM_ID) {
+			tunnel->system_msg("[%02x] tried sending a system "
+			    "message", tunnel->peer_id);
+			break;
+		}
+
+		tunnel->recv_fragment(id, &frag, data + sizeof(id) +
+		    sizeof(frag), len - sizeof(id) - sizeof(frag));
+		break;
+	case LITANY_MESSAGE_TYPE_ACK:
+		if (len % sizeof(u_int64_t)) {
+			tunnel->system_msg("[%02x] malformed acks (%zu)",
+			    tunnel->peer_id, len);
+			break;
+		}
+
+		tunnel->recv_acks(data, len / sizeof(u_int64_t));
+		break;
+	case LITANY_MESSAGE_TYPE_XFER_OFFER:
+	case LITANY_MESSAGE_TYPE_XFER_DATA:
+	case LITANY_MESSAGE_TYPE_XFER_ACK:
+	case LITANY_MESSAGE_TYPE_XFER_DONE:
+		tunnel->recv_xfer(type, data, len);
+		break;
+	case LITANY_MESSAGE_TYPE_HEARTBEAT:
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Called when libkyrka gives us ciphertext to send.
+ */
+static void
+purgatory_send(const void *data, size_t len, u_int64_t seq, void *udata)
 {
 	Tunnel		*tunnel;
 
@@ -597,21 +1807,10 @@ cathedral_send(const void *data, size_t len, u_int64_t magic, void *udata)
 static int
 text_validate(const u_int8_t *text, size_t len)
 {
-	size_t		off, seqlen;
-
-	off = 0;
-
-	while (off < len) {
-		if (litany_utf8_sequence(text, len, off, &seqlen) == 0)
-			return (-1);
-
-		if (off + seqlen > len)
-			return (-1);
-
-		off += seqlen;
-	}
+	PRECOND(text != NULL);
 
-	PRECOND(off == len);
+	if (litany_utf8_valid(text, len) == 0)
+		return (-1);
 
 	return (0);
 }
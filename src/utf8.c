@@ -14,75 +14,366 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/*
+ * Strict UTF-8 validation as per the Unicode standard (table 3-7),
+ * overlong encodings, surrogates and anything above U+10FFFF are
+ * rejected.
+ *
+ * On x86 with AVX2 we validate 32 bytes per step using the lookup
+ * approach by Keiser and Lemire ("Validating UTF-8 in less than one
+ * instruction per byte"), otherwise we skip over ascii 16 bytes at
+ * a time (SSE2 or NEON) or 8 bytes at a time and validate anything
+ * else with the scalar code.
+ */
+
 #include <sys/types.h>
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UTF8_X86		1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define UTF8_NEON		1
+#include <arm_neon.h>
+#endif
 
 #include "util.h"
 
-static int	utf8_continuation_byte(u_int8_t);
+static size_t	utf8_ascii(const u_int8_t *, size_t);
+static int	utf8_scalar(const u_int8_t *, size_t);
 
+#if defined(UTF8_X86)
+static int	utf8_avx2(const u_int8_t *, size_t);
+#endif
+
+/*
+ * Returns 1 if the given data is valid UTF-8 or 0 if it is not.
+ */
 int
-litany_utf8_sequence(const void *data, size_t len, size_t off, size_t *seqlen)
+litany_utf8_valid(const void *data, size_t len)
 {
-	const u_int8_t		*p;
-	size_t			slen, valid, idx;
+#if defined(UTF8_X86)
+	static int	avx2 = -1;
+	int		have;
 
-	if (off > len)
-		fatal("%s: off %zu > len %zu", __func__, off, len);
+	/* Tunnels call us from several threads, any of them may do this. */
+	if ((have = __atomic_load_n(&avx2, __ATOMIC_RELAXED)) == -1) {
+		have = __builtin_cpu_supports("avx2") ? 1 : 0;
+		__atomic_store_n(&avx2, have, __ATOMIC_RELAXED);
+	}
 
-	slen = 0;
-	valid = 0;
+	if (have)
+		return (utf8_avx2(data, len));
+#endif
 
-	p = data;
+	return (utf8_scalar(data, len));
+}
 
-	/* 1-byte sequence (0xxx xxxx). */
-	if ((p[off] >> 7) == 0) {
-		*seqlen = 1;
-		return (1);
+/*
+ * Returns the length of the leading run of ascii in the given data,
+ * rounded down to the block size we look at.
+ */
+static size_t
+utf8_ascii(const u_int8_t *p, size_t len)
+{
+	size_t		off;
+	u_int64_t	word;
+
+	off = 0;
+
+#if defined(UTF8_X86) && defined(__SSE2__)
+	while (off + 16 <= len) {
+		if (_mm_movemask_epi8(_mm_loadu_si128(
+		    (const __m128i *)&p[off])) != 0)
+			return (off);
+		off += 16;
 	}
+#elif defined(UTF8_NEON)
+	while (off + 16 <= len) {
+		if (vmaxvq_u8(vld1q_u8(&p[off])) >= 0x80)
+			return (off);
+		off += 16;
+	}
+#endif
+
+	while (off + sizeof(word) <= len) {
+		memcpy(&word, &p[off], sizeof(word));
+		if (word & 0x8080808080808080ULL)
+			return (off);
+		off += sizeof(word);
+	}
+
+	return (off);
+}
+
+/*
+ * Validate the given data one sequence at a time, skipping over any
+ * runs of ascii.
+ */
+static int
+utf8_scalar(const u_int8_t *p, size_t len)
+{
+	size_t		off;
+	u_int8_t	lo, hi;
 
-	/* 2-byte sequence (110x xxxx). */
-	if ((p[off] & (1 << 7)) && (p[off] & (1 << 6))) {
-		slen = 2;
+	off = 0;
 
-		/* 3-byte sequence (1110 xxxx). */
-		if (p[off] & (1 << 5)) {
-			slen = 3;
+	while (off < len) {
+		off += utf8_ascii(&p[off], len - off);
+		if (off == len)
+			break;
 
-			/* 4-byte sequence (1111 0xxx). */
-			if (p[off] & (1 << 4)) {
-				/* check next bit is clear. */
-				if ((p[off] & (1 << 3)) == 0)
-					slen = 4;
-			}
+		/* 1-byte sequence (0xxx xxxx). */
+		if (p[off] < 0x80) {
+			off++;
+			continue;
 		}
-	}
 
-	/* If there are not enough bytes left for the sequence, its bad. */
-	if (off + slen > len || slen == 0)
-		return (0);
+		/* 2-byte sequence, 0xc0 and 0xc1 would be overlong. */
+		if (p[off] >= 0xc2 && p[off] <= 0xdf) {
+			if (off + 2 > len || (p[off + 1] & 0xc0) != 0x80)
+				return (0);
+			off += 2;
+			continue;
+		}
+
+		/* 3-byte sequence, no overlongs and no surrogates. */
+		if (p[off] >= 0xe0 && p[off] <= 0xef) {
+			lo = p[off] == 0xe0 ? 0xa0 : 0x80;
+			hi = p[off] == 0xed ? 0x9f : 0xbf;
 
-	/* Check that all following bytes look like continuation bytes. */
-	for (idx = 1; idx < slen; idx++) {
-		if (utf8_continuation_byte(p[off + idx]))
-			valid++;
+			if (off + 3 > len ||
+			    p[off + 1] < lo || p[off + 1] > hi ||
+			    (p[off + 2] & 0xc0) != 0x80)
+				return (0);
+
+			off += 3;
+			continue;
+		}
+
+		/* 4-byte sequence, no overlongs and nothing > U+10FFFF. */
+		if (p[off] >= 0xf0 && p[off] <= 0xf4) {
+			lo = p[off] == 0xf0 ? 0x90 : 0x80;
+			hi = p[off] == 0xf4 ? 0x8f : 0xbf;
+
+			if (off + 4 > len ||
+			    p[off + 1] < lo || p[off + 1] > hi ||
+			    (p[off + 2] & 0xc0) != 0x80 ||
+			    (p[off + 3] & 0xc0) != 0x80)
+				return (0);
+
+			off += 4;
+			continue;
+		}
+
+		/* A continuation byte or 0xc0, 0xc1, 0xf5 - 0xff. */
+		return (0);
 	}
 
-	*seqlen = slen;
+	return (1);
+}
+
+#if defined(UTF8_X86)
+
+/*
+ * The error classes for the AVX2 validator, each byte pair is looked
+ * up in three tables (high and low nibble of the previous byte, high
+ * nibble of the current byte) and the pair is bad if a class is set
+ * in all three.
+ */
+#define UTF8_TOO_SHORT		(1 << 0)
+#define UTF8_TOO_LONG		(1 << 1)
+#define UTF8_OVERLONG_3		(1 << 2)
+#define UTF8_TOO_LARGE		(1 << 3)
+#define UTF8_SURROGATE		(1 << 4)
+#define UTF8_OVERLONG_2		(1 << 5)
+#define UTF8_TOO_LARGE_1000	(1 << 6)
+#define UTF8_OVERLONG_4		(1 << 6)
+#define UTF8_TWO_CONTS		(1 << 7)
+#define UTF8_CARRY		\
+    (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+/* A 16 entry lookup table, repeated for both 128-bit lanes. */
+#define UTF8_TABLE(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)	\
+    _mm256_setr_epi8(UTF8_LANE(a, b, c, d, e, f, g, h,			\
+    i, j, k, l, m, n, o, p), UTF8_LANE(a, b, c, d, e, f, g, h,		\
+    i, j, k, l, m, n, o, p))
+
+#define UTF8_LANE(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)	\
+    (char)(a), (char)(b), (char)(c), (char)(d), (char)(e), (char)(f),	\
+    (char)(g), (char)(h), (char)(i), (char)(j), (char)(k), (char)(l),	\
+    (char)(m), (char)(n), (char)(o), (char)(p)
+
+/*
+ * Returns the given input shifted by n bytes with the last bytes of
+ * prev shifted in.
+ */
+#define UTF8_PREV(input, prev, n)					\
+    _mm256_alignr_epi8(input,						\
+    _mm256_permute2x128_si256(prev, input, 0x21), 16 - (n))
+
+/* Returns the high nibble of every byte. */
+#define UTF8_HIGH(v)							\
+    _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0f))
+
+/*
+ * Returns the error bits for the given 32 bytes of input, prev holds
+ * the 32 bytes before them.
+ */
+__attribute__((target("avx2")))
+static __m256i
+utf8_avx2_check(__m256i input, __m256i prev)
+{
+	__m256i		prev1, prev2, prev3, sc, must23;
+	__m256i		byte_1_high, byte_1_low, byte_2_high;
+
+	const __m256i	table_1_high = UTF8_TABLE(
+	    /* 0_______ ________ */
+	    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	    /* 10______ ________ */
+	    UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+	    /* 1100____ ________ */
+	    UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+	    /* 1101____ ________ */
+	    UTF8_TOO_SHORT,
+	    /* 1110____ ________ */
+	    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+	    /* 1111____ ________ */
+	    UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+	    UTF8_OVERLONG_4);
+
+	const __m256i	table_1_low = UTF8_TABLE(
+	    /* ____0000 ________ */
+	    UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+	    /* ____0001 ________ */
+	    UTF8_CARRY | UTF8_OVERLONG_2,
+	    /* ____001_ ________ */
+	    UTF8_CARRY,
+	    UTF8_CARRY,
+	    /* ____0100 ________ */
+	    UTF8_CARRY | UTF8_TOO_LARGE,
+	    /* ____0101 ________ */
+	    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	    /* ____011_ ________ */
+	    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	    /* ____1___ ________ */
+	    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	    /* ____1101 ________ */
+	    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 |
+	    UTF8_SURROGATE,
+	    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	    UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000);
+
+	const __m256i	table_2_high = UTF8_TABLE(
+	    /* ________ 0_______ */
+	    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	    /* ________ 1000____ */
+	    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+	    UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+	    /* ________ 1001____ */
+	    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+	    UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+	    /* ________ 101_____ */
+	    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+	    UTF8_SURROGATE | UTF8_TOO_LARGE,
+	    UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS |
+	    UTF8_SURROGATE | UTF8_TOO_LARGE,
+	    /* ________ 11______ */
+	    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+
+	prev1 = UTF8_PREV(input, prev, 1);
+
+	byte_1_high = _mm256_shuffle_epi8(table_1_high, UTF8_HIGH(prev1));
+	byte_1_low = _mm256_shuffle_epi8(table_1_low,
+	    _mm256_and_si256(prev1, _mm256_set1_epi8(0x0f)));
+	byte_2_high = _mm256_shuffle_epi8(table_2_high, UTF8_HIGH(input));
 
-	return (valid == (slen - 1));
+	sc = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low),
+	    byte_2_high);
+
+	/*
+	 * A byte two or three positions after a 3 or 4 byte lead must be
+	 * a continuation byte, the tables above flag two continuations
+	 * in a row (TWO_CONTS) so those cancel each other out.
+	 */
+	prev2 = UTF8_PREV(input, prev, 2);
+	prev3 = UTF8_PREV(input, prev, 3);
+
+	must23 = _mm256_or_si256(
+	    _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80))),
+	    _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80))));
+	must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80));
+
+	return (_mm256_xor_si256(must23, sc));
+}
+
+/*
+ * Returns non-zero bytes if the given 32 bytes end in the middle of a
+ * multibyte sequence.
+ */
+__attribute__((target("avx2")))
+static __m256i
+utf8_avx2_incomplete(__m256i input)
+{
+	const __m256i	max = _mm256_setr_epi8(
+	    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	    (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+
+	return (_mm256_subs_epu8(input, max));
 }
 
+/*
+ * Validate the given data 32 bytes at a time, blocks of pure ascii
+ * only need to check that the previous block was complete.
+ */
+__attribute__((target("avx2")))
 static int
-utf8_continuation_byte(u_int8_t byte)
+utf8_avx2(const u_int8_t *p, size_t len)
 {
-	if (byte & (1 << 7)) {
-		if ((byte & (1 << 6)) == 0)
-			return (1);
+	size_t		off;
+	u_int8_t	tail[32];
+	__m256i		input, prev, error, incomplete;
+
+	off = 0;
+	prev = _mm256_setzero_si256();
+	error = _mm256_setzero_si256();
+	incomplete = _mm256_setzero_si256();
+
+	while (off < len) {
+		if (off + sizeof(tail) <= len) {
+			input = _mm256_loadu_si256((const __m256i *)&p[off]);
+		} else {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, &p[off], len - off);
+			input = _mm256_loadu_si256((const __m256i *)tail);
+		}
+
+		if (_mm256_movemask_epi8(input) == 0) {
+			error = _mm256_or_si256(error, incomplete);
+		} else {
+			error = _mm256_or_si256(error,
+			    utf8_avx2_check(input, prev));
+			incomplete = utf8_avx2_incomplete(input);
+		}
+
+		prev = input;
+		off += sizeof(tail);
 	}
 
-	return (0);
+	error = _mm256_or_si256(error, incomplete);
+
+	return (_mm256_testz_si256(error, error));
 }
+
+#endif
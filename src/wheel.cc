@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "litany.h"
+
+/*
+ * Setup an empty wheel starting at the current time.
+ */
+TimerWheel::TimerWheel(void)
+{
+	size_t		idx;
+
+	for (idx = 0; idx < LITANY_WHEEL_L0_SIZE; idx++)
+		TAILQ_INIT(&l0[idx]);
+
+	for (idx = 0; idx < LITANY_WHEEL_LN_SIZE; idx++) {
+		TAILQ_INIT(&l1[idx]);
+		TAILQ_INIT(&l2[idx]);
+	}
+
+	next = 0;
+	count = 0;
+	wakeups = 0;
+	wakeups_rate = 0;
+	wakeups_second = 0;
+	tick = litany_msec() / LITANY_WHEEL_TICK;
+
+	timer.setSingleShot(true);
+	connect(&timer, &QTimer::timeout, this, &TimerWheel::run);
+}
+
+/*
+ * Initialize a timer so it can be added to a wheel.
+ */
+void
+TimerWheel::timer_init(struct litany_timer *t, void (*cb)(void *), void *udata)
+{
+	PRECOND(t != NULL);
+	PRECOND(cb != NULL);
+
+	memset(t, 0, sizeof(*t));
+
+	t->cb = cb;
+	t->udata = udata;
+}
+
+/*
+ * Arm the timer to fire in msec milliseconds, if the timer was already
+ * armed it is moved to its new deadline.
+ */
+void
+TimerWheel::timer_add(struct litany_timer *t, u_int64_t msec)
+{
+	PRECOND(t != NULL);
+	PRECOND(t->cb != NULL);
+
+	if (t->armed)
+		timer_cancel(t);
+
+	/* Nothing is pending, so we can skip ahead to the current tick. */
+	if (count == 0)
+		tick = litany_msec() / LITANY_WHEEL_TICK;
+
+	t->expires = (litany_msec() + msec) / LITANY_WHEEL_TICK;
+	if (t->expires <= tick)
+		t->expires = tick + 1;
+
+	place(t);
+
+	t->armed = 1;
+	count++;
+
+	if (!timer.isActive() || t->expires < next)
+		rearm();
+}
+
+/*
+ * Disarm the given timer, this is a no-op if it was not armed.
+ */
+void
+TimerWheel::timer_cancel(struct litany_timer *t)
+{
+	PRECOND(t != NULL);
+
+	if (!t->armed)
+		return;
+
+	PRECOND(count > 0);
+
+	TAILQ_REMOVE(t->head, t, list);
+
+	t->armed = 0;
+	t->head = NULL;
+	count--;
+}
+
+/*
+ * Format the wheel statistics into the given buffer.
+ */
+void
+TimerWheel::stats(char *buf, size_t len)
+{
+	int		ret;
+	u_int64_t	second;
+
+	PRECOND(buf != NULL);
+	PRECOND(len > 0);
+
+	second = litany_msec() / 1000;
+	if (second > wakeups_second + 1)
+		wakeups_rate = 0;
+
+	ret = snprintf(buf, len,
+	    "%" PRIu64 " timers, %" PRIu64 " wakeups/sec",
+	    count, wakeups_rate);
+	if (ret == -1 || (size_t)ret >= len)
+		fatal("wheel stats did not fit");
+}
+
+/*
+ * Our QTimer fired, walk the wheel up to the current tick and run
+ * all timers that are due. Every time the first level wraps we
+ * cascade the timers from the next level down.
+ */
+void
+TimerWheel::run(void)
+{
+	struct litany_timer_list	*head;
+	struct litany_timer		*t;
+	u_int64_t			now, second;
+
+	now = litany_msec();
+	second = now / 1000;
+
+	if (second != wakeups_second) {
+		if (second == wakeups_second + 1)
+			wakeups_rate = wakeups;
+		else
+			wakeups_rate = 0;
+
+		wakeups = 0;
+		wakeups_second = second;
+	}
+
+	wakeups++;
+	now = now / LITANY_WHEEL_TICK;
+
+	while (tick < now) {
+		tick++;
+
+		if ((tick & LITANY_WHEEL_L0_MASK) == 0) {
+			if (((tick >> LITANY_WHEEL_L1_SHIFT) &
+			    LITANY_WHEEL_LN_MASK) == 0) {
+				cascade(&l2[(tick >> LITANY_WHEEL_L2_SHIFT) &
+				    LITANY_WHEEL_LN_MASK]);
+			}
+
+			cascade(&l1[(tick >> LITANY_WHEEL_L1_SHIFT) &
+			    LITANY_WHEEL_LN_MASK]);
+		}
+
+		head = &l0[tick & LITANY_WHEEL_L0_MASK];
+
+		while ((t = TAILQ_FIRST(head)) != NULL) {
+			timer_cancel(t);
+			t->cb(t->udata);
+		}
+	}
+
+	rearm();
+}
+
+/*
+ * Arm our QTimer for the next tick that has timers due, or the next
+ * time the first level wraps so we can cascade the higher levels.
+ */
+void
+TimerWheel::rearm(void)
+{
+	u_int64_t	idx, wrap, msec, now;
+
+	timer.stop();
+
+	if (count == 0)
+		return;
+
+	wrap = (tick | LITANY_WHEEL_L0_MASK) + 1;
+
+	for (idx = tick + 1; idx < wrap; idx++) {
+		if (!TAILQ_EMPTY(&l0[idx & LITANY_WHEEL_L0_MASK]))
+			break;
+	}
+
+	next = idx;
+	now = litany_msec();
+	msec = next * LITANY_WHEEL_TICK;
+
+	if (msec > now)
+		timer.start(msec - now);
+	else
+		timer.start(0);
+}
+
+/*
+ * Place the timer on the level and slot that matches its deadline.
+ */
+void
+TimerWheel::place(struct litany_timer *t)
+{
+	u_int64_t	delta;
+
+	PRECOND(t != NULL);
+	PRECOND(t->expires >= tick);
+
+	delta = t->expires - tick;
+
+	if (delta >= LITANY_WHEEL_MAX_SPAN) {
+		delta = LITANY_WHEEL_MAX_SPAN - 1;
+		t->expires = tick + delta;
+	}
+
+	if (delta < LITANY_WHEEL_L1_SPAN) {
+		t->head = &l0[t->expires & LITANY_WHEEL_L0_MASK];
+	} else if (delta < LITANY_WHEEL_L2_SPAN) {
+		t->head = &l1[(t->expires >> LITANY_WHEEL_L1_SHIFT) &
+		    LITANY_WHEEL_LN_MASK];
+	} else {
+		t->head = &l2[(t->expires >> LITANY_WHEEL_L2_SHIFT) &
+		    LITANY_WHEEL_LN_MASK];
+	}
+
+	TAILQ_INSERT_TAIL(t->head, t, list);
+}
+
+/*
+ * Move all timers from the given slot down to where they belong now.
+ */
+void
+TimerWheel::cascade(struct litany_timer_list *head)
+{
+	struct litany_timer		*t;
+
+	PRECOND(head != NULL);
+
+	while ((t = TAILQ_FIRST(head)) != NULL) {
+		TAILQ_REMOVE(head, t, list);
+		place(t);
+	}
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "litany.h"
+
+/* We can use libnyfe because its included in libkyrka. */
+extern "C" void	nyfe_mem_zero(void *, size_t);
+
+static void	worker_backlog(void *);
+static void	worker_event_free(struct litany_event *);
+
+/*
+ * The event_dispatch() function that consumers must re-implement.
+ */
+void
+LitanyWorker::event_dispatch(struct litany_event *evt)
+{
+	(void)evt;
+
+	fatal("LitanyWorker::event_dispatch not overriden");
+}
+
+/*
+ * Start a new worker thread with the given name, its timer wheel is
+ * created on the thread itself before any other work runs there.
+ */
+LitanyWorker::LitanyWorker(const QString &name)
+{
+	wakeup = 0;
+	timers = NULL;
+	stopped = false;
+
+	TAILQ_INIT(&backlog);
+	litany_ring_init(&ring, LITANY_WORKER_RING_SIZE);
+	TimerWheel::timer_init(&backlog_timer, worker_backlog, this);
+
+	ctx = new QObject();
+	ctx->moveToThread(&thread);
+
+	thread.setObjectName(name);
+	thread.start();
+
+	post([this]() {
+		timers = new TimerWheel();
+		wheel = timers;
+	});
+}
+
+/*
+ * Release any events the GUI thread never got to.
+ */
+LitanyWorker::~LitanyWorker(void)
+{
+	struct litany_event	*evt;
+
+	PRECOND(stopped);
+
+	while ((evt = (struct litany_event *)
+	    litany_ring_dequeue(&ring)) != NULL)
+		worker_event_free(evt);
+
+	while ((evt = TAILQ_FIRST(&backlog)) != NULL) {
+		TAILQ_REMOVE(&backlog, evt, list);
+		worker_event_free(evt);
+	}
+
+	litany_ring_cleanup(&ring);
+	delete ctx;
+}
+
+/*
+ * Stop the worker thread, anything the subclass runs on it must have
+ * been torn down by the time this is called.
+ */
+void
+LitanyWorker::stop(void)
+{
+	PRECOND(!stopped);
+
+	post_wait([this]() {
+		timers->timer_cancel(&backlog_timer);
+
+		delete timers;
+		timers = NULL;
+		wheel = NULL;
+	});
+
+	thread.quit();
+	thread.wait();
+
+	stopped = true;
+}
+
+/*
+ * Called from our thread, queue an event for the GUI thread. The
+ * event carries a copy of the given data.
+ */
+void
+LitanyWorker::event_send(int type, u_int8_t peer, u_int64_t id,
+    Qt::GlobalColor color, const void *data, size_t len)
+{
+	struct litany_event	*evt;
+
+	PRECOND(data != NULL);
+	PRECOND(type == LITANY_EVENT_MESSAGE || type == LITANY_EVENT_TEXT ||
+	    type == LITANY_EVENT_LITURGY);
+
+	if ((evt = (struct litany_event *)calloc(1,
+	    sizeof(*evt) + len + 1)) == NULL)
+		fatal("calloc: failed to allocate event");
+
+	evt->id = id;
+	evt->len = len;
+	evt->type = type;
+	evt->peer = peer;
+	evt->color = color;
+	evt->data = (u_int8_t *)(evt + 1);
+
+	memcpy(evt->data, data, len);
+
+	TAILQ_INSERT_TAIL(&backlog, evt, list);
+	event_retry();
+}
+
+/*
+ * Called from our thread, move as many events from our backlog onto
+ * the ring as fit and wake up the GUI thread if it was not already.
+ * Whatever does not fit is retried on the next tick.
+ */
+void
+LitanyWorker::event_retry(void)
+{
+	bool			queued;
+	struct litany_event	*evt;
+
+	queued = false;
+
+	while ((evt = TAILQ_FIRST(&backlog)) != NULL) {
+		if (litany_ring_queue(&ring, evt) == -1)
+			break;
+
+		TAILQ_REMOVE(&backlog, evt, list);
+		queued = true;
+	}
+
+	if (!TAILQ_EMPTY(&backlog) && !backlog_timer.armed)
+		timers->timer_add(&backlog_timer, LITANY_WHEEL_TICK);
+
+	if (queued && __atomic_exchange_n(&wakeup, 1, __ATOMIC_SEQ_CST) == 0) {
+		QMetaObject::invokeMethod(&gui, [this]() {
+			events_drain();
+		}, Qt::QueuedConnection);
+	}
+}
+
+/*
+ * Called on the GUI thread, dispatch all events on the ring. The
+ * wakeup flag is cleared first so that an event queued while we
+ * are draining causes another wakeup instead of getting lost.
+ */
+void
+LitanyWorker::events_drain(void)
+{
+	struct litany_event	*evt;
+
+	__atomic_store_n(&wakeup, 0, __ATOMIC_SEQ_CST);
+
+	while ((evt = (struct litany_event *)
+	    litany_ring_dequeue(&ring)) != NULL) {
+		event_dispatch(evt);
+		worker_event_free(evt);
+	}
+}
+
+/*
+ * The timer wheel callback for our backlog.
+ */
+static void
+worker_backlog(void *arg)
+{
+	LitanyWorker	*worker;
+
+	PRECOND(arg != NULL);
+
+	worker = (LitanyWorker *)arg;
+	worker->event_retry();
+}
+
+/*
+ * Wipe and free the given event, it may hold a decrypted message.
+ */
+static void
+worker_event_free(struct litany_event *evt)
+{
+	PRECOND(evt != NULL);
+
+	nyfe_mem_zero(evt, sizeof(*evt) + evt->len + 1);
+	free(evt);
+}
@@ -0,0 +1,870 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <QDir>
+#include <QFileInfo>
+#include <QStorageInfo>
+#include <QStandardPaths>
+
+#if !defined(PLATFORM_WINDOWS)
+#include <fcntl.h>
+#endif
+
+#include <inttypes.h>
+#include <sodium.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "litany.h"
+
+static u_int64_t	xfer_rate(u_int64_t, u_int64_t);
+
+/* The states of an XferSource. */
+#define XFER_SOURCE_NEW		0
+#define XFER_SOURCE_READY	1
+#define XFER_SOURCE_FAILED	2
+
+/*
+ * Create a source for the file at the given path, the caller holds
+ * the first reference. Nothing is opened until prepare() is called.
+ */
+XferSource::XferSource(const QString &fpath)
+{
+	refs = 1;
+	path = fpath;
+
+	map = NULL;
+	size = 0;
+	chunks = 0;
+	state = XFER_SOURCE_NEW;
+	memset(digest, 0, sizeof(digest));
+
+	name = QFileInfo(path).fileName();
+}
+
+/*
+ * Release the mapping of our file.
+ */
+XferSource::~XferSource(void)
+{
+	if (map != NULL)
+		file.unmap((uchar *)map);
+
+	file.close();
+}
+
+/*
+ * Take a reference on the source.
+ */
+void
+XferSource::ref(void)
+{
+	u_int32_t	prev;
+
+	prev = __atomic_fetch_add(&refs, 1, __ATOMIC_RELAXED);
+	if (prev == 0)
+		fatal("%s: source was already released", __func__);
+}
+
+/*
+ * Drop a reference on the source, the last one gets rid of it.
+ */
+void
+XferSource::release(void)
+{
+	u_int32_t	left;
+
+	left = __atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL);
+	if (left == UINT_MAX)
+		fatal("%s: source was already released", __func__);
+
+	if (left == 0)
+		delete this;
+}
+
+/*
+ * Open, map and hash the file if nobody did so yet. Any problem is
+ * reported on the given tunnel by the caller that ran into it, the
+ * others only get false back.
+ */
+bool
+XferSource::prepare(Tunnel *tunnel)
+{
+	u_int64_t	count;
+	bool		ready;
+
+	PRECOND(tunnel != NULL);
+
+	mtx.lock();
+
+	if (state != XFER_SOURCE_NEW) {
+		ready = state == XFER_SOURCE_READY;
+		mtx.unlock();
+		return (ready);
+	}
+
+	state = XFER_SOURCE_FAILED;
+
+	if (name.toUtf8().length() == 0 ||
+	    name.toUtf8().length() > LITANY_XFER_NAME_MAX) {
+		tunnel->system_msg("[xfer]: invalid file name");
+		mtx.unlock();
+		return (false);
+	}
+
+	file.setFileName(path);
+
+	if (!file.open(QFile::ReadOnly)) {
+		tunnel->system_msg("[xfer]: failed to open %s",
+		    path.toUtf8().data());
+		mtx.unlock();
+		return (false);
+	}
+
+	size = file.size();
+	count = (size + LITANY_XFER_CHUNK - 1) / LITANY_XFER_CHUNK;
+
+	if (size == 0 || count > UINT_MAX) {
+		tunnel->system_msg("[xfer]: %s is empty or too large",
+		    name.toUtf8().data());
+		mtx.unlock();
+		return (false);
+	}
+
+	chunks = (u_int32_t)count;
+
+	if ((map = file.map(0, size)) == NULL) {
+		tunnel->system_msg("[xfer]: failed to map %s",
+		    name.toUtf8().data());
+		mtx.unlock();
+		return (false);
+	}
+
+	if (sodium_init() == -1)
+		fatal("sodium_init failed");
+
+	crypto_generichash(digest, sizeof(digest), map, size, NULL, 0);
+
+	state = XFER_SOURCE_READY;
+	mtx.unlock();
+
+	return (true);
+}
+
+/*
+ * Prepare sending the given source to the peer of the given tunnel,
+ * we take our own reference on it. If the source could not be used
+ * the failed member is set and the caller should get rid of us.
+ */
+FileSend::FileSend(Tunnel *t, XferSource *source)
+{
+	PRECOND(t != NULL);
+	PRECOND(source != NULL);
+
+	tunnel = t;
+
+	src = source;
+	src->ref();
+
+	base = 0;
+	next = 0;
+	acked = 0;
+	memset(sent, 0, sizeof(sent));
+
+	offered = 0;
+	started = 0;
+	reported = 0;
+	progressed = 0;
+	retransmits = 0;
+
+	accepted = false;
+	finished = false;
+
+	id = litany_msg_number_reserve();
+	failed = !src->prepare(tunnel);
+}
+
+/*
+ * Drop our reference on the source.
+ */
+FileSend::~FileSend(void)
+{
+	src->release();
+}
+
+/*
+ * Offer the file to our peer, we start sending data once it accepts.
+ */
+void
+FileSend::start(void)
+{
+	PRECOND(!failed);
+
+	started = litany_msec();
+	progressed = started;
+
+	tunnel->system_msg("[xfer]: offering %s (%" PRIu64 " bytes)",
+	    src->name.toUtf8().data(), src->size);
+
+	offer();
+}
+
+/*
+ * Called every XFER_TICK milliseconds by our tunnel. Resend our offer
+ * if it was not answered, or resend the chunks in our window that were
+ * not acknowledged within the retransmission timeout. The user on the
+ * other end gets XFER_ACCEPT_TIMEOUT to accept our offer.
+ *
+ * Once all chunks are acknowledged we keep offering the file until
+ * the receiver tells us the result, as that done record may get lost.
+ */
+void
+FileSend::tick(void)
+{
+	u_int32_t	idx;
+	u_int64_t	now, rto, limit;
+
+	if (finished)
+		return;
+
+	now = litany_msec();
+	rto = tunnel->resend_timeout();
+	limit = accepted ? XFER_STALL_TIMEOUT : XFER_ACCEPT_TIMEOUT;
+
+	if ((now - progressed) >= limit) {
+		tunnel->system_msg("[xfer]: %s stalled, giving up",
+		    src->name.toUtf8().data());
+		finished = true;
+		return;
+	}
+
+	if (!accepted || base == src->chunks) {
+		if ((now - offered) >= rto)
+			offer();
+		return;
+	}
+
+	for (idx = base; idx < next; idx++) {
+		if (acked & (1ULL << (idx - base)))
+			continue;
+
+		if ((now - sent[idx % XFER_WINDOW]) >= rto) {
+			retransmits++;
+			chunk_send(idx);
+			tunnel->cc_loss();
+		}
+	}
+}
+
+/*
+ * The receiver acknowledged chunks, slide our window forward and
+ * fill it up again. The ack fields are in host order.
+ */
+void
+FileSend::ack(const struct litany_xfer_ack *ack)
+{
+	u_int32_t	shift, inflight;
+
+	PRECOND(ack != NULL);
+
+	if (finished)
+		return;
+
+	if (!accepted) {
+		accepted = true;
+		tunnel->system_msg("[xfer]: %s accepted",
+		    src->name.toUtf8().data());
+	}
+
+	if (ack->next < base || ack->next > next)
+		return;
+
+	shift = ack->next - base;
+	if (shift > 0) {
+		progressed = litany_msec();
+		tunnel->cc_ack(shift);
+	}
+
+	if (shift >= XFER_WINDOW)
+		acked = 0;
+	else
+		acked >>= shift;
+
+	base = ack->next;
+	inflight = next - base;
+
+	acked |= ack->sack;
+	if (inflight < XFER_WINDOW)
+		acked &= (1ULL << inflight) - 1;
+
+	fill();
+	progress();
+}
+
+/*
+ * The receiver told us how the transfer ended.
+ */
+void
+FileSend::done(u_int8_t status)
+{
+	u_int64_t	elapsed;
+
+	if (finished)
+		return;
+
+	finished = true;
+	elapsed = litany_msec() - started;
+
+	switch (status) {
+	case LITANY_XFER_STATUS_OK:
+		tunnel->system_msg("[xfer]: %s delivered, %" PRIu64
+		    " bytes in %" PRIu64 "ms (%" PRIu64 " KiB/s, %" PRIu64
+		    " retransmits)", src->name.toUtf8().data(), src->size,
+		    elapsed, xfer_rate(src->size, elapsed), retransmits);
+		break;
+	case LITANY_XFER_STATUS_REFUSED:
+		tunnel->system_msg("[xfer]: %s refused by peer",
+		    src->name.toUtf8().data());
+		break;
+	case LITANY_XFER_STATUS_CORRUPT:
+		tunnel->system_msg("[xfer]: %s failed integrity check",
+		    src->name.toUtf8().data());
+		break;
+	default:
+		tunnel->system_msg("[xfer]: %s failed on peer (%u)",
+		    src->name.toUtf8().data(), status);
+		break;
+	}
+}
+
+/*
+ * Write a short summary of this transfer into buf.
+ */
+void
+FileSend::stats(char *buf, size_t len)
+{
+	int		ret;
+
+	PRECOND(buf != NULL);
+	PRECOND(len > 0);
+
+	ret = snprintf(buf, len, "sending %s, %u/%u chunks acked, "
+	    "%u in flight, %" PRIu64 " retransmits, %" PRIu64 " KiB/s",
+	    src->name.toUtf8().data(), base, src->chunks, next - base,
+	    retransmits, xfer_rate((u_int64_t)base * LITANY_XFER_CHUNK,
+	    litany_msec() - started));
+	if (ret == -1 || (size_t)ret >= len)
+		fatal("failed to format transfer stats");
+}
+
+/*
+ * Send as many new chunks as our window allows.
+ */
+void
+FileSend::fill(void)
+{
+	while (next < src->chunks && (next - base) < XFER_WINDOW) {
+		chunk_send(next);
+		next++;
+	}
+}
+
+/*
+ * Queue our offer record.
+ */
+void
+FileSend::offer(void)
+{
+	u_int8_t			*rec;
+	QByteArray			utf8;
+	struct litany_xfer_offer	off;
+
+	utf8 = src->name.toUtf8();
+
+	off.id = htobe64(id);
+	off.size = htobe64(src->size);
+	memcpy(off.digest, src->digest, sizeof(off.digest));
+
+	rec = tunnel->frame_record(LITANY_MESSAGE_TYPE_XFER_OFFER,
+	    sizeof(off) + utf8.length());
+
+	memcpy(rec, &off, sizeof(off));
+	memcpy(rec + sizeof(off), utf8.data(), utf8.length());
+
+	offered = litany_msec();
+}
+
+/*
+ * Report our progress in the chat window at every 25%.
+ */
+void
+FileSend::progress(void)
+{
+	u_int32_t	pct;
+
+	pct = (u_int32_t)(((u_int64_t)base * 100) / src->chunks);
+
+	if (pct / 25 <= reported || pct == 100)
+		return;
+
+	reported = pct / 25;
+
+	tunnel->system_msg("[xfer]: %s %u%% (%" PRIu64 " KiB/s)",
+	    src->name.toUtf8().data(), pct,
+	    xfer_rate((u_int64_t)base * LITANY_XFER_CHUNK,
+	    litany_msec() - started));
+}
+
+/*
+ * Queue the chunk at the given index straight from our mapping.
+ */
+void
+FileSend::chunk_send(u_int32_t idx)
+{
+	u_int8_t			*rec;
+	u_int64_t			off, len;
+	struct litany_xfer_data		hdr;
+
+	PRECOND(idx < src->chunks);
+
+	off = (u_int64_t)idx * LITANY_XFER_CHUNK;
+	len = src->size - off;
+	if (len > LITANY_XFER_CHUNK)
+		len = LITANY_XFER_CHUNK;
+
+	hdr.id = htobe64(id);
+	hdr.index = htobe32(idx);
+
+	rec = tunnel->frame_record(LITANY_MESSAGE_TYPE_XFER_DATA,
+	    sizeof(hdr) + len);
+
+	memcpy(rec, &hdr, sizeof(hdr));
+	memcpy(rec + sizeof(hdr), src->map + off, len);
+
+	sent[idx % XFER_WINDOW] = litany_msec();
+}
+
+/*
+ * Take note of an offer from our peer, the offer fields are in host
+ * order. Offers for files larger than max bytes are refused.
+ *
+ * Nothing is created until the user accepts the offer, if it is not
+ * answered within XFER_ACCEPT_TIMEOUT we refuse it. If we cannot take
+ * the offer at all we finish right away and tell our peer.
+ */
+FileRecv::FileRecv(Tunnel *t, const struct litany_xfer_offer *off,
+    const char *fname, size_t fname_len, u_int64_t max)
+{
+	u_int64_t	total;
+	QString		dir;
+	bool		ok;
+
+	PRECOND(t != NULL);
+	PRECOND(off != NULL);
+	PRECOND(fname != NULL);
+
+	tunnel = t;
+
+	map = NULL;
+	received = NULL;
+
+	count = 0;
+	next = 0;
+	chunks = 0;
+	pending = 0;
+	reported = 0;
+	created = false;
+	accepted = false;
+	finished = false;
+
+	id = off->id;
+	size = off->size;
+	status = LITANY_XFER_STATUS_FAILED;
+	memcpy(digest, off->digest, sizeof(digest));
+
+	started = litany_msec();
+	progressed = started;
+
+	ok = true;
+	total = (size + LITANY_XFER_CHUNK - 1) / LITANY_XFER_CHUNK;
+
+	if (fname_len == 0 || fname_len > LITANY_XFER_NAME_MAX ||
+	    memchr(fname, '/', fname_len) != NULL ||
+	    memchr(fname, '\\', fname_len) != NULL ||
+	    memchr(fname, '\0', fname_len) != NULL)
+		ok = false;
+
+	name = QString::fromUtf8(fname, fname_len);
+	if (name == "." || name == "..")
+		ok = false;
+
+	if (!ok || size == 0 || total > UINT_MAX) {
+		tunnel->system_msg("[xfer]: refusing invalid offer");
+		finish(LITANY_XFER_STATUS_REFUSED);
+		return;
+	}
+
+	if (size > max) {
+		tunnel->system_msg("[xfer]: refusing %s from %02x, %" PRIu64
+		    " bytes is over the %" PRIu64 " byte limit",
+		    name.toUtf8().data(), tunnel->peer_id, size, max);
+		finish(LITANY_XFER_STATUS_REFUSED);
+		return;
+	}
+
+	chunks = (u_int32_t)total;
+
+	dir = QStandardPaths::writableLocation(
+	    QStandardPaths::DownloadLocation);
+	path = QDir(dir).filePath(name);
+
+	if (dir.isEmpty() || QFile::exists(path)) {
+		tunnel->system_msg("[xfer]: refusing %s, it already exists",
+		    name.toUtf8().data());
+		finish(LITANY_XFER_STATUS_REFUSED);
+		return;
+	}
+
+	tunnel->system_msg("[xfer]: %02x offers %s (%" PRIu64 " bytes), "
+	    "type /accept %02x or /reject %02x", tunnel->peer_id,
+	    name.toUtf8().data(), size, tunnel->peer_id, tunnel->peer_id);
+}
+
+/*
+ * The user accepted the offer, create the destination file and start
+ * asking our peer for its chunks.
+ */
+void
+FileRecv::accept(void)
+{
+	QStorageInfo	disk;
+
+	if (finished || accepted)
+		return;
+
+	if (QFile::exists(path)) {
+		tunnel->system_msg("[xfer]: refusing %s, it already exists",
+		    name.toUtf8().data());
+		finish(LITANY_XFER_STATUS_REFUSED);
+		return;
+	}
+
+	/*
+	 * Make sure the file fits with room to spare before we create
+	 * it, a write into a mapping on a full disk gives us a SIGBUS
+	 * instead of an error.
+	 */
+	disk.setPath(QFileInfo(path).absolutePath());
+	if (!disk.isValid() || disk.bytesAvailable() < 0 ||
+	    (u_int64_t)disk.bytesAvailable() < size + XFER_SPACE_RESERVE) {
+		tunnel->system_msg("[xfer]: no space for %s",
+		    name.toUtf8().data());
+		finish(LITANY_XFER_STATUS_FAILED);
+		return;
+	}
+
+	file.setFileName(path + ".part");
+
+	if (!file.open(QFile::ReadWrite | QFile::NewOnly)) {
+		tunnel->system_msg("[xfer]: failed to create %s",
+		    file.fileName().toUtf8().data());
+		finish(LITANY_XFER_STATUS_FAILED);
+		return;
+	}
+
+	created = true;
+
+	if (!file.resize(size)) {
+		tunnel->system_msg("[xfer]: failed to size %s",
+		    file.fileName().toUtf8().data());
+		finish(LITANY_XFER_STATUS_FAILED);
+		return;
+	}
+
+#if defined(__linux__)
+	/* Also make sure the blocks are really there. */
+	if (posix_fallocate(file.handle(), 0, size) != 0) {
+		tunnel->system_msg("[xfer]: no space for %s",
+		    name.toUtf8().data());
+		finish(LITANY_XFER_STATUS_FAILED);
+		return;
+	}
+#endif
+
+	if ((map = file.map(0, size)) == NULL) {
+		tunnel->system_msg("[xfer]: failed to map %s",
+		    file.fileName().toUtf8().data());
+		finish(LITANY_XFER_STATUS_FAILED);
+		return;
+	}
+
+	if ((received = (u_int8_t *)calloc(1, (chunks + 7) / 8)) == NULL)
+		fatal("calloc: failed to allocate transfer bitmap");
+
+	accepted = true;
+	progressed = litany_msec();
+
+	tunnel->system_msg("[xfer]: receiving %s (%" PRIu64 " bytes)",
+	    name.toUtf8().data(), size);
+
+	ack_send();
+}
+
+/*
+ * The user rejected the offer.
+ */
+void
+FileRecv::reject(void)
+{
+	if (finished || accepted)
+		return;
+
+	tunnel->system_msg("[xfer]: rejected %s", name.toUtf8().data());
+	finish(LITANY_XFER_STATUS_REFUSED);
+}
+
+/*
+ * Release the mapping and our bitmap, the file is removed unless
+ * it was moved into place.
+ */
+FileRecv::~FileRecv(void)
+{
+	if (map != NULL)
+		file.unmap(map);
+
+	free(received);
+	file.close();
+}
+
+/*
+ * Called every XFER_TICK milliseconds by our tunnel, send any pending
+ * acks and give up if the sender went away or the user never answered
+ * the offer.
+ */
+void
+FileRecv::tick(void)
+{
+	if (finished)
+		return;
+
+	if (!accepted) {
+		if ((litany_msec() - started) >= XFER_ACCEPT_TIMEOUT) {
+			tunnel->system_msg("[xfer]: offer of %s expired",
+			    name.toUtf8().data());
+			finish(LITANY_XFER_STATUS_REFUSED);
+		}
+		return;
+	}
+
+	if ((litany_msec() - progressed) >= XFER_STALL_TIMEOUT) {
+		tunnel->system_msg("[xfer]: %s stalled, giving up",
+		    name.toUtf8().data());
+		finish(LITANY_XFER_STATUS_FAILED);
+		return;
+	}
+
+	if (pending > 0)
+		ack_send();
+}
+
+/*
+ * A chunk arrived, copy it into place in our mapping.
+ */
+void
+FileRecv::data(u_int32_t idx, const u_int8_t *chunk, size_t len)
+{
+	u_int64_t	off, expect, elapsed;
+	u_int32_t	pct;
+
+	PRECOND(chunk != NULL);
+
+	if (finished || !accepted || idx >= chunks)
+		return;
+
+	off = (u_int64_t)idx * LITANY_XFER_CHUNK;
+	expect = size - off;
+	if (expect > LITANY_XFER_CHUNK)
+		expect = LITANY_XFER_CHUNK;
+
+	if (len != expect)
+		return;
+
+	pending++;
+
+	if (received[idx / 8] & (1 << (idx % 8))) {
+		if (pending >= XFER_ACK_EVERY)
+			ack_send();
+		return;
+	}
+
+	memcpy(map + off, chunk, len);
+	received[idx / 8] |= 1 << (idx % 8);
+
+	count++;
+	progressed = litany_msec();
+
+	while (next < chunks && (received[next / 8] & (1 << (next % 8))))
+		next++;
+
+	if (count == chunks) {
+		complete();
+		return;
+	}
+
+	if (pending >= XFER_ACK_EVERY)
+		ack_send();
+
+	pct = (u_int32_t)(((u_int64_t)count * 100) / chunks);
+	if (pct / 25 > reported) {
+		reported = pct / 25;
+		elapsed = progressed - started;
+		tunnel->system_msg("[xfer]: %s %u%% (%" PRIu64 " KiB/s)",
+		    name.toUtf8().data(), pct,
+		    xfer_rate((u_int64_t)count * LITANY_XFER_CHUNK, elapsed));
+	}
+}
+
+/*
+ * Write a short summary of this transfer into buf.
+ */
+void
+FileRecv::stats(char *buf, size_t len)
+{
+	int		ret;
+
+	PRECOND(buf != NULL);
+	PRECOND(len > 0);
+
+	ret = snprintf(buf, len, "receiving %s, %u/%u chunks, "
+	    "%" PRIu64 " KiB/s", name.toUtf8().data(), count, chunks,
+	    xfer_rate((u_int64_t)count * LITANY_XFER_CHUNK,
+	    litany_msec() - started));
+	if (ret == -1 || (size_t)ret >= len)
+		fatal("failed to format transfer stats");
+}
+
+/*
+ * Tell our peer which chunk we need next and which of the chunks
+ * following it we already have.
+ */
+void
+FileRecv::ack_send(void)
+{
+	u_int32_t		idx;
+	u_int8_t		*rec;
+	struct litany_xfer_ack	ack;
+
+	/* An ack tells our peer we accepted, so none before that. */
+	if (!accepted || finished)
+		return;
+
+	ack.sack = 0;
+
+	for (idx = 0; idx < XFER_WINDOW && next + idx < chunks; idx++) {
+		if (received[(next + idx) / 8] & (1 << ((next + idx) % 8)))
+			ack.sack |= 1ULL << idx;
+	}
+
+	ack.id = htobe64(id);
+	ack.next = htobe32(next);
+	ack.sack = htobe64(ack.sack);
+
+	rec = tunnel->frame_record(LITANY_MESSAGE_TYPE_XFER_ACK, sizeof(ack));
+	memcpy(rec, &ack, sizeof(ack));
+
+	pending = 0;
+}
+
+/*
+ * All chunks are in, verify the digest and move the file into place.
+ */
+void
+FileRecv::complete(void)
+{
+	u_int64_t	elapsed;
+	u_int8_t	check[LITANY_XFER_DIGEST_LEN];
+
+	ack_send();
+
+	if (sodium_init() == -1)
+		fatal("sodium_init failed");
+
+	crypto_generichash(check, sizeof(check), map, size, NULL, 0);
+
+	file.unmap(map);
+	map = NULL;
+
+	if (sodium_memcmp(check, digest, sizeof(check)) != 0) {
+		tunnel->system_msg("[xfer]: %s failed integrity check",
+		    name.toUtf8().data());
+		finish(LITANY_XFER_STATUS_CORRUPT);
+		return;
+	}
+
+	file.close();
+
+	if (!file.rename(path)) {
+		tunnel->system_msg("[xfer]: failed to move %s into place",
+		    name.toUtf8().data());
+		finish(LITANY_XFER_STATUS_FAILED);
+		return;
+	}
+
+	created = false;
+	elapsed = litany_msec() - started;
+
+	tunnel->system_msg("[xfer]: received %s, %" PRIu64 " bytes in %"
+	    PRIu64 "ms (%" PRIu64 " KiB/s)", path.toUtf8().data(), size,
+	    elapsed, xfer_rate(size, elapsed));
+
+	finish(LITANY_XFER_STATUS_OK);
+}
+
+/*
+ * Finish this transfer and tell our peer how it went. If we did not
+ * complete it, the partial file is removed.
+ */
+void
+FileRecv::finish(u_int8_t result)
+{
+	status = result;
+	finished = true;
+
+	if (created) {
+		if (map != NULL) {
+			file.unmap(map);
+			map = NULL;
+		}
+
+		file.remove();
+		created = false;
+	}
+
+	tunnel->xfer_done(id, status);
+}
+
+/*
+ * Calculate a rate in KiB/s for the given bytes in msec milliseconds.
+ */
+static u_int64_t
+xfer_rate(u_int64_t bytes, u_int64_t msec)
+{
+	if (msec == 0)
+		msec = 1;
+
+	return ((bytes * 1000) / msec / 1024);
+}
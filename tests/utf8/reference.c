@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2020-2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The validators we compare src/utf8.c against.
+ *
+ * reference_old() is the sequence walker litany used before the strict
+ * validator, kept as is. It does not reject overlong encodings,
+ * surrogates or code points above U+10FFFF.
+ *
+ * reference_strict() decodes every code point and checks it against
+ * the rules of the Unicode standard, it shares no code with either.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+
+#include "reference.h"
+
+static int	old_sequence(const void *, size_t, size_t, size_t *);
+static int	old_continuation_byte(u_int8_t);
+
+/*
+ * Returns 1 if the given data is valid as per the old validator.
+ */
+int
+reference_old(const u_int8_t *p, size_t len)
+{
+	size_t		off, slen;
+
+	off = 0;
+
+	while (off < len) {
+		if (old_sequence(p, len, off, &slen) == 0)
+			return (0);
+		off += slen;
+	}
+
+	return (1);
+}
+
+/*
+ * Returns 1 if the given data is valid UTF-8.
+ */
+int
+reference_strict(const u_int8_t *p, size_t len)
+{
+	size_t		off, idx, n;
+	u_int32_t	cp;
+
+	off = 0;
+
+	while (off < len) {
+		cp = p[off];
+
+		if (cp < 0x80) {
+			off++;
+			continue;
+		}
+
+		if ((cp & 0xe0) == 0xc0) {
+			n = 1;
+			cp &= 0x1f;
+		} else if ((cp & 0xf0) == 0xe0) {
+			n = 2;
+			cp &= 0x0f;
+		} else if ((cp & 0xf8) == 0xf0) {
+			n = 3;
+			cp &= 0x07;
+		} else {
+			return (0);
+		}
+
+		if (off + n >= len)
+			return (0);
+
+		for (idx = 1; idx <= n; idx++) {
+			if ((p[off + idx] & 0xc0) != 0x80)
+				return (0);
+			cp = (cp << 6) | (p[off + idx] & 0x3f);
+		}
+
+		if ((n == 1 && cp < 0x80) || (n == 2 && cp < 0x800) ||
+		    (n == 3 && cp < 0x10000))
+			return (0);
+
+		if (cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+			return (0);
+
+		off += n + 1;
+	}
+
+	return (1);
+}
+
+/*
+ * The old litany_utf8_sequence(), unchanged apart from its name.
+ */
+static int
+old_sequence(const void *data, size_t len, size_t off, size_t *seqlen)
+{
+	const u_int8_t		*p;
+	size_t			slen, valid, idx;
+
+	if (off > len)
+		abort();
+
+	slen = 0;
+	valid = 0;
+
+	p = data;
+
+	/* 1-byte sequence (0xxx xxxx). */
+	if ((p[off] >> 7) == 0) {
+		*seqlen = 1;
+		return (1);
+	}
+
+	/* 2-byte sequence (110x xxxx). */
+	if ((p[off] & (1 << 7)) && (p[off] & (1 << 6))) {
+		slen = 2;
+
+		/* 3-byte sequence (1110 xxxx). */
+		if (p[off] & (1 << 5)) {
+			slen = 3;
+
+			/* 4-byte sequence (1111 0xxx). */
+			if (p[off] & (1 << 4)) {
+				/* check next bit is clear. */
+				if ((p[off] & (1 << 3)) == 0)
+					slen = 4;
+			}
+		}
+	}
+
+	/* If there are not enough bytes left for the sequence, its bad. */
+	if (off + slen > len || slen == 0)
+		return (0);
+
+	/* Check that all following bytes look like continuation bytes. */
+	for (idx = 1; idx < slen; idx++) {
+		if (old_continuation_byte(p[off + idx]))
+			valid++;
+	}
+
+	*seqlen = slen;
+
+	return (valid == (slen - 1));
+}
+
+static int
+old_continuation_byte(u_int8_t byte)
+{
+	if (byte & (1 << 7)) {
+		if ((byte & (1 << 6)) == 0)
+			return (1);
+	}
+
+	return (0);
+}
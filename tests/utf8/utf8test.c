@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2025 Joris Vink <joris@sanctorum.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Differential fuzzer and benchmark for the utf8 validator.
+ *
+ * Every input is run through the scalar and (if the cpu has it) the
+ * AVX2 path of src/utf8.c, the independent strict reference decoder
+ * and the old validator. The new paths must agree with the strict
+ * reference on every input, and anything they accept must have been
+ * accepted by the old validator too.
+ *
+ * We include src/utf8.c directly so that we can reach both of its
+ * paths, not only the one litany_utf8_valid() picks.
+ */
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../src/utf8.c"
+
+#include "reference.h"
+
+/* The size of the benchmark buffers and how often we run over them. */
+#define BENCH_SIZE		(1024 * 1024)
+#define BENCH_ROUNDS		200
+
+/* The number of random inputs we try by default. */
+#define FUZZ_RANDOM		20000000
+
+static void	usage(void) __attribute__((noreturn));
+
+static void	fuzz(u_int64_t);
+static void	fuzz_check(const u_int8_t *, size_t);
+static void	fuzz_blocks(void);
+static void	fuzz_four(void);
+static void	fuzz_random(u_int64_t);
+
+static void	bench(void);
+static double	bench_run(int (*)(const u_int8_t *, size_t),
+		    const u_int8_t *, size_t);
+
+static int	valid_api(const u_int8_t *, size_t);
+static size_t	encode(u_int32_t, u_int8_t *);
+static u_int64_t	prng(void);
+
+static int		have_avx2 = 0;
+static u_int64_t	prng_state = 88172645463325252ULL;
+
+static u_int64_t	cases = 0;
+static u_int64_t	failed = 0;
+static u_int64_t	stricter = 0;
+
+int
+main(int argc, char **argv)
+{
+	int		ch, bflag;
+	u_int64_t	count;
+	char		*ep;
+
+	bflag = 0;
+	count = FUZZ_RANDOM;
+
+	while ((ch = getopt(argc, argv, "bn:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bflag = 1;
+			break;
+		case 'n':
+			count = strtoull(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0')
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc)
+		usage();
+
+#if defined(UTF8_X86)
+	have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif
+
+	printf("avx2: %s\n", have_avx2 ? "yes" : "no");
+
+	if (bflag) {
+		bench();
+		return (0);
+	}
+
+	fuzz(count);
+
+	return (failed == 0 ? 0 : 1);
+}
+
+void
+fatal(const char *fmt, ...)
+{
+	va_list		args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: utf8test [-b] [-n random-inputs]\n");
+	exit(1);
+}
+
+/*
+ * Run all fuzzing phases and report.
+ */
+static void
+fuzz(u_int64_t count)
+{
+	fuzz_blocks();
+	fuzz_four();
+	fuzz_random(count);
+
+	printf("%" PRIu64 " inputs, %" PRIu64 " mismatches, %" PRIu64
+	    " only accepted by the old validator\n", cases, failed, stricter);
+}
+
+/*
+ * Every 3 byte pattern at offsets around the 32 byte block edges of
+ * the AVX2 path, with and without a trailing ascii byte.
+ */
+static void
+fuzz_blocks(void)
+{
+	size_t			idx, off;
+	u_int32_t		val, step;
+	u_int8_t		buf[128];
+	static const size_t	offsets[] = { 0, 13, 29, 30, 31, 32, 61 };
+
+	for (idx = 0; idx < sizeof(offsets) / sizeof(offsets[0]); idx++) {
+		off = offsets[idx];
+		step = idx < 2 ? 1 : 7;
+
+		memset(buf, 'a', off);
+
+		for (val = 0; val < (1U << 24); val += step) {
+			buf[off] = val >> 16;
+			buf[off + 1] = val >> 8;
+			buf[off + 2] = val;
+			fuzz_check(buf, off + 3);
+
+			buf[off + 3] = 'b';
+			fuzz_check(buf, off + 4);
+		}
+	}
+}
+
+/*
+ * All lead bytes from 0xf0 with all second bytes and random tails,
+ * this is where the overlong and too large 4 byte sequences live.
+ */
+static void
+fuzz_four(void)
+{
+	int		round;
+	size_t		off;
+	u_int32_t	lead, second;
+	u_int8_t	buf[64];
+
+	for (lead = 0xf0; lead <= 0xff; lead++) {
+		for (second = 0; second < 256; second++) {
+			for (round = 0; round < 64; round++) {
+				off = prng() % 40;
+				memset(buf, 'x', off);
+
+				buf[off] = lead;
+				buf[off + 1] = second;
+				buf[off + 2] = prng();
+
+				if (prng() & 1)
+					buf[off + 3] = 0x80 | (prng() & 0x3f);
+				else
+					buf[off + 3] = prng();
+
+				fuzz_check(buf, off + 4 + (prng() % 3));
+			}
+		}
+	}
+}
+
+/*
+ * Random valid text of up to 250 bytes with a few random mutations.
+ */
+static void
+fuzz_random(u_int64_t count)
+{
+	u_int64_t	iter;
+	u_int32_t	cp;
+	size_t		len, max;
+	int		mutations, idx;
+	u_int8_t	buf[256];
+
+	for (iter = 0; iter < count; iter++) {
+		len = 0;
+		max = prng() % 250;
+
+		while (len + 4 < max) {
+			switch (prng() % 4) {
+			case 0:
+				cp = prng() % 0x80;
+				break;
+			case 1:
+				cp = 0x80 + prng() % 0x780;
+				break;
+			case 2:
+				cp = 0x800 + prng() % 0xf800;
+				if (cp >= 0xd800 && cp <= 0xdfff)
+					cp = 'z';
+				break;
+			default:
+				cp = 0x10000 + prng() % 0x100000;
+				break;
+			}
+
+			if (prng() % 3 == 0)
+				cp = prng() % 0x80;
+
+			len += encode(cp, &buf[len]);
+		}
+
+		mutations = prng() % 4;
+
+		for (idx = 0; idx < mutations && len > 0; idx++) {
+			switch (prng() % 3) {
+			case 0:
+				buf[prng() % len] = prng();
+				break;
+			case 1:
+				len--;
+				break;
+			default:
+				buf[prng() % len] ^= 1 << (prng() % 8);
+				break;
+			}
+		}
+
+		fuzz_check(buf, len);
+	}
+}
+
+/*
+ * Compare all validators on the given input.
+ */
+static void
+fuzz_check(const u_int8_t *p, size_t len)
+{
+	size_t		idx;
+	int		strict, scalar, avx2, old;
+
+	cases++;
+
+	old = reference_old(p, len);
+	strict = reference_strict(p, len);
+	scalar = utf8_scalar(p, len);
+
+#if defined(UTF8_X86)
+	avx2 = have_avx2 ? utf8_avx2(p, len) : strict;
+#else
+	avx2 = strict;
+#endif
+
+	if (old && !strict)
+		stricter++;
+
+	if (strict == scalar && strict == avx2 && (!strict || old))
+		return;
+
+	if (failed++ >= 10)
+		return;
+
+	printf("mismatch: strict=%d scalar=%d avx2=%d old=%d len=%zu:",
+	    strict, scalar, avx2, old, len);
+
+	for (idx = 0; idx < len; idx++)
+		printf(" %02x", p[idx]);
+
+	printf("\n");
+}
+
+/*
+ * Measure the old validator, the scalar path and whatever path
+ * litany_utf8_valid() picks on mixed text and on pure ascii.
+ */
+static void
+bench(void)
+{
+	int		mode;
+	u_int32_t	cp;
+	size_t		len;
+	u_int8_t	*mixed, *ascii, *buf;
+
+	if ((mixed = malloc(BENCH_SIZE)) == NULL ||
+	    (ascii = malloc(BENCH_SIZE)) == NULL)
+		fatal("malloc");
+
+	/* Mostly ascii letters with a quarter of 2 and 3 byte sequences. */
+	len = 0;
+	while (len + 4 < BENCH_SIZE) {
+		if (prng() % 4)
+			cp = 'a' + prng() % 26;
+		else
+			cp = 0x80 + prng() % 0xc000;
+
+		if (cp >= 0xd800 && cp <= 0xdfff)
+			cp = 'q';
+
+		len += encode(cp, &mixed[len]);
+	}
+
+	memset(ascii, 'a', BENCH_SIZE);
+
+	for (mode = 0; mode < 2; mode++) {
+		buf = mode ? ascii : mixed;
+		if (mode)
+			len = BENCH_SIZE;
+
+		printf("%s: old %.2f GB/s, scalar %.2f GB/s, "
+		    "litany_utf8_valid %.2f GB/s\n", mode ? "ascii" : "mixed",
+		    bench_run(reference_old, buf, len),
+		    bench_run(utf8_scalar, buf, len),
+		    bench_run(valid_api, buf, len));
+	}
+
+	free(mixed);
+	free(ascii);
+}
+
+/*
+ * Returns the throughput in GB/s of the given validator.
+ */
+static double
+bench_run(int (*fn)(const u_int8_t *, size_t), const u_int8_t *p,
+    size_t len)
+{
+	int			idx, acc;
+	double			secs;
+	struct timespec		start, end;
+
+	acc = 0;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+	for (idx = 0; idx < BENCH_ROUNDS; idx++)
+		acc += fn(p, len);
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (acc != BENCH_ROUNDS)
+		fatal("benchmark input was rejected");
+
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	return (((double)len * BENCH_ROUNDS) / secs / 1e9);
+}
+
+static int
+valid_api(const u_int8_t *p, size_t len)
+{
+	return (litany_utf8_valid(p, len));
+}
+
+/*
+ * Encode the given code point, returns the number of bytes written.
+ */
+static size_t
+encode(u_int32_t cp, u_int8_t *out)
+{
+	if (cp < 0x80) {
+		out[0] = cp;
+		return (1);
+	}
+
+	if (cp < 0x800) {
+		out[0] = 0xc0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3f);
+		return (2);
+	}
+
+	if (cp < 0x10000) {
+		out[0] = 0xe0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3f);
+		out[2] = 0x80 | (cp & 0x3f);
+		return (3);
+	}
+
+	out[0] = 0xf0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3f);
+	out[2] = 0x80 | ((cp >> 6) & 0x3f);
+	out[3] = 0x80 | (cp & 0x3f);
+
+	return (4);
+}
+
+/*
+ * A xorshift generator, fixed seed so runs can be reproduced.
+ */
+static u_int64_t
+prng(void)
+{
+	prng_state ^= prng_state << 13;
+	prng_state ^= prng_state >> 7;
+	prng_state ^= prng_state << 17;
+
+	return (prng_state);
+}